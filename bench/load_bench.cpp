@@ -0,0 +1,452 @@
+// load_bench.cpp
+// End-to-end load generator for the ONLINETRADERZ server.
+// Starts ./server against a throw-away DATA_DIR, seeds a catalogue, replays
+// mixed workloads at a fixed concurrency and prints one JSON object per
+// (workload, connection mode) run, suitable for regression tracking.
+// "keepalive" is what the client asked for. The server currently answers
+// every request with Connection: close, so such runs reconnect per request
+// just like "close" runs; "server_closed":true in the output flags that.
+// Compile with: g++ -std=c++17 -O3 -pthread bench/load_bench.cpp -o load_bench
+// Run from the directory that contains public/ (the server serves files from there).
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace std;
+
+// ------------------- Options -------------------
+struct Options {
+    string server = "./server";
+    int port = 18090;
+    int concurrency = 8;
+    double duration = 5.0;   // seconds per run
+    string workload = "all"; // browse|static|checkout|admin|mixed|all
+    string mode = "both";    // keepalive|close|both
+    int seedProducts = 50;
+    int seedOrders = 200;
+};
+
+static void usage() {
+    cerr << "usage: load_bench [--server PATH] [--port N] [--concurrency N] [--duration SEC]\n"
+            "                  [--workload browse|static|checkout|admin|mixed|all]\n"
+            "                  [--mode keepalive|close|both] [--seed-products N] [--seed-orders N]\n";
+}
+
+static bool parseArgs(int argc, char **argv, Options &o) {
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        auto next = [&](string &out) { if (i + 1 >= argc) return false; out = argv[++i]; return true; };
+        string v;
+        if (a == "--help" || a == "-h") return false;
+        if (!next(v)) return false;
+        try {
+            if (a == "--server") o.server = v;
+            else if (a == "--port") o.port = stoi(v);
+            else if (a == "--concurrency") o.concurrency = max(1, stoi(v));
+            else if (a == "--duration") o.duration = max(0.1, stod(v));
+            else if (a == "--workload") o.workload = v;
+            else if (a == "--mode") o.mode = v;
+            else if (a == "--seed-products") o.seedProducts = max(1, stoi(v));
+            else if (a == "--seed-orders") o.seedOrders = max(0, stoi(v));
+            else return false;
+        } catch (...) { return false; }
+    }
+    return true;
+}
+
+// ------------------- Minimal HTTP/1.1 client -------------------
+static int connectTo(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) { close(fd); return -1; }
+    return fd;
+}
+
+static bool sendAll(int fd, const string &data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += (size_t)n;
+    }
+    return true;
+}
+
+struct HttpResult {
+    int status = 0;
+    size_t bodyBytes = 0;
+    bool serverClosed = true; // server asked for (or performed) connection close
+    string body;              // only kept when requested
+};
+
+// Reads one response. Returns false on transport error.
+static bool readResponse(int fd, HttpResult &res, bool keepBody) {
+    string buf;
+    char tmp[65536];
+    size_t headerEnd = string::npos;
+    while (headerEnd == string::npos) {
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf.append(tmp, (size_t)n);
+        headerEnd = buf.find("\r\n\r\n");
+    }
+    string head = buf.substr(0, headerEnd);
+    string lower = head;
+    transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    size_t sp = head.find(' ');
+    res.status = sp == string::npos ? 0 : atoi(head.c_str() + sp + 1);
+    long contentLength = -1;
+    size_t cl = lower.find("\r\ncontent-length:");
+    if (cl != string::npos) contentLength = atol(lower.c_str() + cl + 17);
+    size_t conn = lower.find("\r\nconnection:");
+    res.serverClosed = conn == string::npos || lower.find("close", conn) < lower.find("\r\n", conn + 2);
+
+    size_t have = buf.size() - (headerEnd + 4);
+    if (keepBody) res.body = buf.substr(headerEnd + 4);
+    if (contentLength < 0) {
+        // no length: body runs to EOF
+        ssize_t n;
+        while ((n = recv(fd, tmp, sizeof(tmp), 0)) > 0) {
+            have += (size_t)n;
+            if (keepBody) res.body.append(tmp, (size_t)n);
+        }
+        res.serverClosed = true;
+    } else {
+        while (have < (size_t)contentLength) {
+            ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            have += (size_t)n;
+            if (keepBody) res.body.append(tmp, (size_t)n);
+        }
+    }
+    res.bodyBytes = have;
+    return true;
+}
+
+// Admin session from the seeding login; sent on every request so admin
+// routes are measured with token verification included
+static string g_admin_token;
+
+static string buildRequest(const string &method, const string &path, const string &body, bool keepAlive) {
+    string r = method + " " + path + " HTTP/1.1\r\nHost: 127.0.0.1\r\nUser-Agent: load_bench\r\n";
+    r += keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    if (!g_admin_token.empty()) r += "Authorization: Bearer " + g_admin_token + "\r\n";
+    if (!body.empty() || method == "POST") {
+        r += "Content-Type: application/json\r\nContent-Length: " + to_string(body.size()) + "\r\n";
+    }
+    r += "\r\n";
+    r += body;
+    return r;
+}
+
+// One-shot request used for seeding and health checks
+static bool simpleRequest(int port, const string &method, const string &path, const string &body, HttpResult &res) {
+    int fd = connectTo(port);
+    if (fd < 0) return false;
+    bool ok = sendAll(fd, buildRequest(method, path, body, false)) && readResponse(fd, res, true);
+    close(fd);
+    return ok;
+}
+
+// ------------------- Server process -------------------
+static pid_t startServer(const Options &o, const string &dataDir) {
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        setenv("DATA_DIR", dataDir.c_str(), 1);
+        setenv("PORT", to_string(o.port).c_str(), 1);
+        setenv("LOG_LEVEL", "warn", 1);
+        setenv("ACCESS_LOG", "off", 1);
+        setenv("RATE_LIMIT", "off", 1); // measure the server, not the limiter
+        setenv("ADMIN_USER", "admin", 1);
+        setenv("ADMIN_PASSWORD", "load_bench", 1);
+        execl(o.server.c_str(), o.server.c_str(), (char*)nullptr);
+        perror("exec server");
+        _exit(127);
+    }
+    // wait for the listener
+    for (int i = 0; i < 100; ++i) {
+        int fd = connectTo(o.port);
+        if (fd >= 0) { close(fd); return pid; }
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) return -1;
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+
+static void stopServer(pid_t pid) {
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 100; ++i) {
+        if (waitpid(pid, nullptr, WNOHANG) == pid) return;
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) { return remove(path); }
+
+// ------------------- Workloads -------------------
+struct Request {
+    string method;
+    string path;
+    string body;
+};
+
+struct Workload {
+    string name;
+    // picks the next request for a worker
+    Request (*next)(mt19937_64 &rng, const vector<string> &productIds, const vector<string> &orderIds);
+    bool bursty;
+};
+
+static const string &pick(mt19937_64 &rng, const vector<string> &v) { return v[rng() % v.size()]; }
+
+static Request checkoutRequest(mt19937_64 &rng, const vector<string> &productIds) {
+    int items = 1 + (int)(rng() % 3);
+    string body = "{\"name\":\"Bench Customer\",\"contact\":\"03001234567\",\"email\":\"bench@example.com\","
+                  "\"address\":\"1 Load Street\",\"products\":[";
+    for (int i = 0; i < items; ++i) {
+        if (i) body += ",";
+        body += "{\"product\":\"" + pick(rng, productIds) + "\",\"qty\":" + to_string(1 + rng() % 4) + "}";
+    }
+    body += "]}";
+    return {"POST", "/api/orders", body};
+}
+
+static Request browseNext(mt19937_64 &rng, const vector<string> &, const vector<string> &orderIds) {
+    unsigned r = rng() % 10;
+    if (r < 7) return {"GET", "/api/products", ""};
+    if (r < 9 || orderIds.empty()) return {"GET", "/", ""};
+    return {"GET", "/api/shippingLabel?id=" + pick(rng, orderIds), ""};
+}
+
+static Request staticNext(mt19937_64 &rng, const vector<string> &, const vector<string> &) {
+    static const char *assets[] = {"/index.html", "/style.css", "/product.html", "/images/Banner1.jpg",
+                                   "/images/Banner2.jpg", "/images/Banner3.jpg", "/uploads/product1.jpg"};
+    static const unsigned weights[] = {20, 20, 10, 15, 15, 15, 5};
+    unsigned r = rng() % 100, acc = 0;
+    for (size_t i = 0; i < sizeof(weights) / sizeof(weights[0]); ++i) {
+        acc += weights[i];
+        if (r < acc) return {"GET", assets[i], ""};
+    }
+    return {"GET", "/index.html", ""};
+}
+
+static Request checkoutNext(mt19937_64 &rng, const vector<string> &productIds, const vector<string> &) {
+    return checkoutRequest(rng, productIds);
+}
+
+static Request adminNext(mt19937_64 &rng, const vector<string> &, const vector<string> &orderIds) {
+    if (orderIds.empty() || rng() % 4) return {"GET", "/api/orders", ""};
+    return {"GET", "/api/shippingLabel?id=" + pick(rng, orderIds), ""};
+}
+
+static Request mixedNext(mt19937_64 &rng, const vector<string> &productIds, const vector<string> &orderIds) {
+    unsigned r = rng() % 100;
+    if (r < 60) return browseNext(rng, productIds, orderIds);
+    if (r < 80) return staticNext(rng, productIds, orderIds);
+    if (r < 95) return checkoutRequest(rng, productIds);
+    return adminNext(rng, productIds, orderIds);
+}
+
+// ------------------- Runner -------------------
+struct WorkerStats {
+    vector<uint32_t> latencyUs;
+    uint64_t errors = 0;
+    uint64_t non2xx = 0;
+    uint64_t connects = 0;
+    uint64_t serverCloses = 0; // responses after which the server closed the connection
+    uint64_t bytes = 0;
+};
+
+static void runWorker(const Options &o, const Workload &w, bool keepAlive, int id,
+                      chrono::steady_clock::time_point deadline,
+                      const vector<string> &productIds, const vector<string> &orderIds, WorkerStats &st) {
+    mt19937_64 rng(0x5eed0000ULL + (uint64_t)id);
+    int fd = -1;
+    int burst = 0;
+    while (chrono::steady_clock::now() < deadline) {
+        // checkout bursts: 16 back-to-back orders, then a short pause
+        if (w.bursty && ++burst > 16) {
+            burst = 0;
+            this_thread::sleep_for(chrono::milliseconds(50));
+            continue;
+        }
+        Request req = w.next(rng, productIds, orderIds);
+        auto t0 = chrono::steady_clock::now();
+        if (fd < 0) {
+            fd = connectTo(o.port);
+            st.connects++;
+            if (fd < 0) { st.errors++; continue; }
+        }
+        HttpResult res;
+        bool ok = sendAll(fd, buildRequest(req.method, req.path, req.body, keepAlive)) && readResponse(fd, res, false);
+        auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count();
+        if (!ok) {
+            st.errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        st.latencyUs.push_back((uint32_t)min<long long>(us, UINT32_MAX));
+        st.bytes += res.bodyBytes;
+        if (res.status < 200 || res.status >= 300) st.non2xx++;
+        if (res.serverClosed) st.serverCloses++;
+        if (!keepAlive || res.serverClosed) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) close(fd);
+}
+
+static uint32_t percentile(const vector<uint32_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = (size_t)(p * (double)(sorted.size() - 1) + 0.5);
+    return sorted[min(idx, sorted.size() - 1)];
+}
+
+static void runOne(const Options &o, const Workload &w, bool keepAlive,
+                   const vector<string> &productIds, const vector<string> &orderIds) {
+    vector<WorkerStats> stats(o.concurrency);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(o.duration));
+    for (int i = 0; i < o.concurrency; ++i) {
+        threads.emplace_back(runWorker, cref(o), cref(w), keepAlive, i, deadline, cref(productIds), cref(orderIds), ref(stats[i]));
+    }
+    for (auto &t : threads) t.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<uint32_t> all;
+    uint64_t errors = 0, non2xx = 0, connects = 0, serverCloses = 0, bytes = 0;
+    for (auto &s : stats) {
+        all.insert(all.end(), s.latencyUs.begin(), s.latencyUs.end());
+        errors += s.errors; non2xx += s.non2xx; connects += s.connects; serverCloses += s.serverCloses; bytes += s.bytes;
+    }
+    // every response closed its connection: keep-alive was requested but not honoured
+    bool serverClosed = !all.empty() && serverCloses == all.size();
+    sort(all.begin(), all.end());
+    char line[768];
+    snprintf(line, sizeof(line),
+             "{\"workload\":\"%s\",\"keepalive\":%s,\"server_closed\":%s,\"concurrency\":%d,\"duration_s\":%.3f,"
+             "\"requests\":%zu,\"errors\":%llu,\"non_2xx\":%llu,\"connections\":%llu,\"bytes\":%llu,"
+             "\"throughput_rps\":%.1f,\"latency_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}",
+             w.name.c_str(), keepAlive ? "true" : "false", serverClosed ? "true" : "false", o.concurrency, elapsed,
+             all.size(), (unsigned long long)errors, (unsigned long long)non2xx,
+             (unsigned long long)connects, (unsigned long long)bytes,
+             elapsed > 0 ? (double)all.size() / elapsed : 0.0,
+             percentile(all, 0.50), percentile(all, 0.99), percentile(all, 0.999),
+             all.empty() ? 0u : all.back());
+    cout << line << endl;
+}
+
+// ------------------- Seeding -------------------
+static bool seed(const Options &o, vector<string> &productIds, vector<string> &orderIds) {
+    HttpResult res;
+    if (!simpleRequest(o.port, "POST", "/api/login", "username=admin&password=load_bench", res) || res.status != 200) {
+        cerr << "admin login failed (status " << res.status << ")\n";
+        return false;
+    }
+    size_t t = res.body.find("\"token\":\"");
+    if (t != string::npos) g_admin_token = res.body.substr(t + 9, res.body.find('"', t + 9) - (t + 9));
+    for (int i = 0; i < o.seedProducts; ++i) {
+        string body = "{\"name\":\"Bench product " + to_string(i) + "\",\"price\":" + to_string(100 + (i * 37) % 5000) + "}";
+        if (!simpleRequest(o.port, "POST", "/api/addProduct", body, res) || res.status != 200) {
+            cerr << "seeding products failed (status " << res.status << ")\n";
+            return false;
+        }
+        size_t p = res.body.find("\"id\":\"");
+        if (p != string::npos) productIds.push_back(res.body.substr(p + 6, res.body.find('"', p + 6) - (p + 6)));
+    }
+    mt19937_64 rng(42);
+    for (int i = 0; i < o.seedOrders; ++i) {
+        Request r = checkoutRequest(rng, productIds);
+        if (!simpleRequest(o.port, r.method, r.path, r.body, res) || res.status != 200) {
+            cerr << "seeding orders failed (status " << res.status << ")\n";
+            return false;
+        }
+        size_t p = res.body.find("\"orderId\":\"");
+        if (p != string::npos) orderIds.push_back(res.body.substr(p + 11, res.body.find('"', p + 11) - (p + 11)));
+    }
+    return !productIds.empty();
+}
+
+// ------------------- Main -------------------
+int main(int argc, char **argv) {
+    Options o;
+    if (!parseArgs(argc, argv, o)) { usage(); return 2; }
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<Workload> all = {
+        {"browse", browseNext, false},
+        {"static", staticNext, false},
+        {"checkout", checkoutNext, true},
+        {"admin", adminNext, false},
+        {"mixed", mixedNext, false},
+    };
+    vector<Workload> selected;
+    for (auto &w : all) if (o.workload == "all" || o.workload == w.name) selected.push_back(w);
+    if (selected.empty()) { usage(); return 2; }
+    vector<bool> modes;
+    if (o.mode == "keepalive" || o.mode == "both") modes.push_back(true);
+    if (o.mode == "close" || o.mode == "both") modes.push_back(false);
+    if (modes.empty()) { usage(); return 2; }
+
+    char tmpl[] = "/tmp/otz-bench-XXXXXX";
+    if (!mkdtemp(tmpl)) { perror("mkdtemp"); return 1; }
+    string dataDir = tmpl;
+
+    pid_t pid = startServer(o, dataDir);
+    if (pid < 0) {
+        cerr << "server did not start (" << o.server << " on port " << o.port << ")\n";
+        nftw(dataDir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+
+    vector<string> productIds, orderIds;
+    int rc = 0;
+    if (seed(o, productIds, orderIds)) {
+        for (auto &w : selected) {
+            for (bool ka : modes) runOne(o, w, ka, productIds, orderIds);
+        }
+    } else {
+        rc = 1;
+    }
+
+    stopServer(pid);
+    nftw(dataDir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    return rc;
+}
@@ -0,0 +1,370 @@
+// micro_bench.cpp
+// Per-function microbenchmarks for the parsing, serialization and storage
+// primitives in server.cpp. Datasets come from a fixed-seed generator so
+// numbers are comparable between runs; output is one JSON object per line.
+// Compile with: g++ -std=c++17 -O3 -pthread bench/micro_bench.cpp -o micro_bench -lsqlite3
+#define ONLINETRADERZ_NO_MAIN
+#include "../server.cpp"
+
+#include <ftw.h>
+#include <new>
+
+// ------------------- Allocation counting -------------------
+// Every global operator new is counted so each benchmark can report heap
+// allocations per operation next to its time.
+static atomic<uint64_t> g_allocations(0);
+
+// The replacements below hand out malloc memory, so free is the matching
+// release; GCC cannot see that once a delete is inlined next to a new
+// expression and reports -Wmismatched-new-delete.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(size_t size) {
+    g_allocations.fetch_add(1, memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+// std::pmr::new_delete_resource allocates through the aligned overloads
+void *operator new(size_t size, align_val_t al) {
+    g_allocations.fetch_add(1, memory_order_relaxed);
+    size_t align = max((size_t)al, sizeof(void *));
+    if (void *p = aligned_alloc(align, (max(size, (size_t)1) + align - 1) / align * align)) return p;
+    throw bad_alloc();
+}
+void *operator new[](size_t size, align_val_t al) { return operator new(size, al); }
+void operator delete(void *p, align_val_t) noexcept { free(p); }
+void operator delete[](void *p, align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, align_val_t) noexcept { free(p); }
+void operator delete[](void *p, size_t, align_val_t) noexcept { free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// ------------------- Harness -------------------
+static string g_filter;
+static volatile size_t g_sink; // defeats dead-code elimination
+
+static bool selected(const string &name) {
+    return g_filter.empty() || name.find(g_filter) != string::npos;
+}
+
+static void report(const string &name, uint64_t iterations, double nsPerOp, size_t bytesPerOp, double allocsPerOp) {
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"bench\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f,\"bytes_per_op\":%zu,\"allocs_per_op\":%.2f}",
+             name.c_str(), (unsigned long long)iterations, nsPerOp, nsPerOp > 0 ? 1e9 / nsPerOp : 0.0, bytesPerOp, allocsPerOp);
+    cout << line << endl;
+}
+
+// bytesPerOp is the input (parsers) or output (serializers) size.
+// Calibrates the iteration count to ~50 ms per sample, takes 5 samples and
+// reports the median. f returns a size that is folded into g_sink.
+template <class F>
+static void bench(const string &name, size_t bytesPerOp, F &&f) {
+    if (!selected(name)) return;
+    using clk = chrono::steady_clock;
+    uint64_t iters = 1;
+    for (;;) {
+        auto t0 = clk::now();
+        for (uint64_t i = 0; i < iters; ++i) g_sink = g_sink + f();
+        if (clk::now() - t0 >= chrono::milliseconds(50) || iters >= (1ULL << 30)) break;
+        iters *= 2;
+    }
+    vector<double> samples;
+    uint64_t allocsBefore = g_allocations.load(memory_order_relaxed);
+    for (int s = 0; s < 5; ++s) {
+        auto t0 = clk::now();
+        for (uint64_t i = 0; i < iters; ++i) g_sink = g_sink + f();
+        samples.push_back((double)chrono::duration_cast<chrono::nanoseconds>(clk::now() - t0).count() / (double)iters);
+    }
+    double allocs = (double)(g_allocations.load(memory_order_relaxed) - allocsBefore) / (double)(iters * 5);
+    sort(samples.begin(), samples.end());
+    report(name, iters * 5, samples[2], bytesPerOp, allocs);
+}
+
+// Single timed run, for operations that take seconds (storage at scale)
+template <class F>
+static void benchOnce(const string &name, size_t items, F &&f) {
+    if (!selected(name)) return;
+    auto t0 = chrono::steady_clock::now();
+    g_sink = g_sink + f();
+    double ns = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"bench\":\"%s\",\"items\":%zu,\"total_ms\":%.2f,\"ns_per_item\":%.1f}",
+             name.c_str(), items, ns / 1e6, items ? ns / (double)items : 0.0);
+    cout << line << endl;
+}
+
+// ------------------- Reproducible datasets -------------------
+static const uint64_t DATASET_SEED = 0x0715ADE5ULL;
+
+static string randomWord(mt19937_64 &rng, size_t minLen, size_t maxLen) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+    size_t len = minLen + rng() % (maxLen - minLen + 1);
+    string w;
+    for (size_t i = 0; i < len; ++i) w += letters[rng() % 26];
+    return w;
+}
+
+static vector<Product> makeProducts(size_t n) {
+    mt19937_64 rng(DATASET_SEED);
+    vector<Product> v;
+    for (size_t i = 0; i < n; ++i) {
+        Product p;
+        p.id = "p" + to_string(i + 1);
+        p.title = randomWord(rng, 4, 10) + " " + randomWord(rng, 3, 8) + " " + to_string(rng() % 512) + "gb";
+        p.price = (double)(100 + rng() % 90000) / 10.0;
+        p.img = "uploads/product" + to_string(i + 1) + ".jpg";
+        p.stock = (int)(rng() % 500);
+        v.push_back(p);
+    }
+    return v;
+}
+
+static vector<Order> makeOrders(size_t n) {
+    mt19937_64 rng(DATASET_SEED + 1);
+    vector<Order> v;
+    v.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        Order o;
+        o.id = "O" + to_string(i + 1);
+        int qty = 1 + (int)(rng() % 4);
+        double price = (double)(100 + rng() % 90000) / 10.0;
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.2f", price);
+        o.product = randomWord(rng, 4, 10) + " (RS." + buf + ") x" + to_string(qty);
+        o.name = randomWord(rng, 3, 8) + " " + randomWord(rng, 4, 9);
+        o.contact = "03" + to_string(100000000 + rng() % 899999999);
+        o.email = randomWord(rng, 4, 10) + "@example.com";
+        o.address = to_string(1 + rng() % 999) + " " + randomWord(rng, 5, 12) + " Road";
+        snprintf(buf, sizeof(buf), "%.2f", price * qty);
+        o.productPrice = buf;
+        o.deliveryCharges = "180.00";
+        snprintf(buf, sizeof(buf), "%.2f", price * qty + 180.0);
+        o.totalAmount = buf;
+        o.payment = "Cash on Delivery";
+        snprintf(buf, sizeof(buf), "2026-%02d-%02dT%02d:%02d:%02dZ",
+                 1 + (int)(rng() % 12), 1 + (int)(rng() % 28), (int)(rng() % 24), (int)(rng() % 60), (int)(rng() % 60));
+        o.createdAt = buf;
+        v.push_back(move(o));
+    }
+    return v;
+}
+
+static string makeCheckoutJson() {
+    mt19937_64 rng(DATASET_SEED + 2);
+    string body = "{\"name\":\"" + randomWord(rng, 5, 9) + " " + randomWord(rng, 5, 9) + "\","
+                  "\"contact\":\"03001234567\",\"email\":\"" + randomWord(rng, 6, 10) + "@example.com\","
+                  "\"address\":\"House 12, Street \\\"7\\\", " + randomWord(rng, 6, 12) + "\",\"products\":[";
+    for (int i = 0; i < 4; ++i) {
+        if (i) body += ",";
+        body += "{\"product\":\"p" + to_string(1 + rng() % 50) + "\",\"qty\":" + to_string(1 + rng() % 5) + "}";
+    }
+    body += "],\"payment\":\"cod\",\"shipping\":180}";
+    return body;
+}
+
+static string makeFormBody() {
+    mt19937_64 rng(DATASET_SEED + 3);
+    string body;
+    for (int i = 0; i < 8; ++i) {
+        if (i) body += "&";
+        body += randomWord(rng, 4, 8) + "=" + randomWord(rng, 3, 6) + "+" + randomWord(rng, 3, 6) + "%40" + randomWord(rng, 3, 6) + "%2C%20x";
+    }
+    return body;
+}
+
+static string makeEncoded(size_t len) {
+    mt19937_64 rng(DATASET_SEED + 4);
+    string s;
+    while (s.size() < len) {
+        unsigned r = rng() % 10;
+        if (r < 6) s += randomWord(rng, 1, 6);
+        else if (r < 8) s += '+';
+        else { char hex[4]; snprintf(hex, sizeof(hex), "%%%02X", (unsigned)(rng() % 256)); s += hex; }
+    }
+    return s;
+}
+
+// Product/address-like text; roughly one byte in `dirtyEvery` needs escaping
+static string makeText(size_t len, unsigned dirtyEvery) {
+    mt19937_64 rng(DATASET_SEED + 5);
+    static const char special[] = "\"\\<>&'\n";
+    string s;
+    while (s.size() < len) {
+        if (dirtyEvery && rng() % dirtyEvery == 0) s += special[rng() % (sizeof(special) - 1)];
+        else s += (char)(rng() % 8 == 0 ? ' ' : 'a' + rng() % 26);
+    }
+    return s;
+}
+
+// ------------------- End-to-end request fixture -------------------
+// Runs handleClient on one end of a socketpair, exactly as a worker would.
+static size_t roundTrip(const string &rawRequest) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 0;
+    int big = 4 << 20;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &big, sizeof(big));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &big, sizeof(big));
+    sendAll(sv[1], rawRequest.data(), rawRequest.size());
+    handleClient(sv[0], "127.0.0.1"); // closes sv[0]
+    char buf[65536];
+    size_t total = 0;
+    ssize_t n;
+    while ((n = recv(sv[1], buf, sizeof(buf), 0)) > 0) total += (size_t)n;
+    close(sv[1]);
+    return total;
+}
+
+// ------------------- Storage fixture -------------------
+static string g_bench_dir;
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) { return remove(path); }
+
+static void resetDatabase() {
+    closeDatabase();
+    unlink((g_bench_dir + "/server.db").c_str());
+    unlink((g_bench_dir + "/server.db-wal").c_str());
+    unlink((g_bench_dir + "/server.db-shm").c_str());
+    initDatabase();
+}
+
+// ------------------- Main -------------------
+int main(int argc, char **argv) {
+    size_t maxOrders = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--filter" && i + 1 < argc) g_filter = argv[++i];
+        else if (a == "--max-orders" && i + 1 < argc) maxOrders = (size_t)atol(argv[++i]);
+        else if (a == "--quick") maxOrders = 100000;
+        else {
+            cerr << "usage: micro_bench [--filter SUBSTR] [--max-orders N] [--quick]\n";
+            return 2;
+        }
+    }
+    g_log_level.store(LOG_WARN);
+
+    char tmpl[] = "/tmp/otz-micro-XXXXXX";
+    if (!mkdtemp(tmpl)) { perror("mkdtemp"); return 1; }
+    g_bench_dir = tmpl;
+    g_data_dir = g_bench_dir;
+
+    // parsing
+    string checkout = makeCheckoutJson();
+    string form = makeFormBody();
+    string encoded = makeEncoded(256);
+    bench("parseJson/checkout", checkout.size(), [&]{ return parseJson(checkout).size(); });
+    bench("parseFormUrlEncoded/8_fields", form.size(), [&]{ return parseFormUrlEncoded(form).size(); });
+    bench("urlDecode/256B", encoded.size(), [&]{ return urlDecode(encoded).size(); });
+    // same parsers drawing from a per-request arena, reset each iteration
+    RequestArena arena;
+    bench("parseJson/checkout/arena", checkout.size(), [&]{ arena.reset(); return parseJson(checkout, arena.resource()).size(); });
+    bench("parseFormUrlEncoded/8_fields/arena", form.size(), [&]{ arena.reset(); return parseFormUrlEncoded(form, arena.resource()).size(); });
+
+    // escaping: raw scan per instruction-set tier, then the full appenders
+    string cleanText = makeText(4096, 0), dirtyText = makeText(4096, 64);
+    vector<pair<string, EscapeScanFn>> jsonScans = {{"scalar", jsonScanScalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    jsonScans.push_back({"sse2", jsonScanSse2});
+    if (__builtin_cpu_supports("avx2")) jsonScans.push_back({"avx2", jsonScanAvx2});
+#endif
+    for (auto &scan : jsonScans)
+        bench("jsonScan/4KiB/" + scan.first, cleanText.size(), [&]{ return scan.second(cleanText.data(), cleanText.size()); });
+    string escaped;
+    bench("appendJsonEscaped/4KiB/clean", cleanText.size(), [&]{ escaped.clear(); appendJsonEscaped(escaped, cleanText); return escaped.size(); });
+    bench("appendJsonEscaped/4KiB/dirty", dirtyText.size(), [&]{ escaped.clear(); appendJsonEscaped(escaped, dirtyText); return escaped.size(); });
+    bench("appendHtmlEscaped/4KiB/dirty", dirtyText.size(), [&]{ escaped.clear(); appendHtmlEscaped(escaped, dirtyText); return escaped.size(); });
+
+    // serialization
+    auto serialize = [&](void (*fn)(ArenaString &)) {
+        arena.reset();
+        ArenaString out(arena.resource());
+        fn(out);
+        return out.size();
+    };
+    products = makeProducts(500);
+    bench("serializeProductsJson/500", serialize(serializeProductsJson), [&]{ return serialize(serializeProductsJson); });
+
+    // product search against a 10k catalogue: index build, prefix query, filtered query
+    vector<Product> catalogue = makeProducts(10000);
+    benchOnce("productIndex/rebuild/10k", catalogue.size(), [&]{ g_product_index.rebuildLocked(catalogue); return catalogue.size(); });
+    string firstWord = catalogue[0].title.substr(0, 3);
+    auto search = [&](const SearchQuery &q) {
+        arena.reset();
+        ArenaString out(arena.resource());
+        size_t total = 0;
+        for (const Product *p : g_product_index.searchLocked(q, total)) appendProductJson(out, *p);
+        return out.size() + total;
+    };
+    SearchQuery prefixQuery;
+    prefixQuery.text = firstWord;
+    bench("productSearch/prefix/10k", firstWord.size(), [&]{ return search(prefixQuery); });
+    SearchQuery filteredQuery = prefixQuery;
+    filteredQuery.minPrice = 1000;
+    filteredQuery.maxPrice = 5000;
+    filteredQuery.inStockOnly = true;
+    bench("productSearch/prefix+filters/10k", firstWord.size(), [&]{ return search(filteredQuery); });
+    orders = makeOrders(10000);
+    bench("serializeOrdersJson/10k", serialize(serializeOrdersJson), [&]{ return serialize(serializeOrdersJson); });
+    // shipping labels: barcode alone, a label rendered from the template, a cache hit
+    auto label = [&](const function<void(ArenaString&)> &fn) {
+        arena.reset();
+        ArenaString out(arena.resource());
+        fn(out);
+        return out.size();
+    };
+    const Order &labelOrder = orders[0];
+    bench("code128Svg", labelOrder.id.size(), [&]{ return label([&](ArenaString &out){ appendCode128Svg(out, labelOrder.id); }); });
+    bench("shippingLabel/render", labelOrder.id.size(),
+          [&]{ return label([&](ArenaString &out){ shippingLabelTemplate().render(out, labelOrder); }); });
+    string warm;
+    appendShippingLabel(warm, labelOrder);
+    bench("shippingLabel/cached", labelOrder.id.size(),
+          [&]{ return label([&](ArenaString &out){ g_label_cache.appendTo(out, labelOrder); }); });
+
+    // admin session tokens: a cache miss pays the full HMAC
+    time_t expires;
+    string token = issueAdminToken(time(nullptr), expires);
+    string_view payload(token.data(), token.rfind('.'));
+    bench("adminToken/hmac", payload.size(), [&]{ char mac[64]; sessionMacHex(payload, mac); return (size_t)mac[0]; });
+    bench("adminToken/verify/cached", token.size(), [&]{ return (size_t)verifyAdminToken(token, time(nullptr)); });
+
+    // whole request through handleClient (parse, route, serialize, send)
+    g_rate_limit_enabled.store(false);
+    orders.clear();
+    string login = "POST /api/login HTTP/1.1\r\nHost: x\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                   "Content-Length: 28\r\n\r\nusername=admin&password=1234";
+    bench("handleClient/login", login.size(), [&]{ return roundTrip(login); });
+    string productsReq = "GET /api/products HTTP/1.1\r\nHost: x\r\n\r\n";
+    bench("handleClient/products/500", productsReq.size(), [&]{ return roundTrip(productsReq); });
+
+    // storage at scale
+    for (size_t n : {(size_t)1000, (size_t)100000, (size_t)1000000}) {
+        if (n > maxOrders) break;
+        string suffix = n >= 1000000 ? "1M" : n >= 1000 ? to_string(n / 1000) + "k" : to_string(n);
+        if (!selected("saveOrders/" + suffix) && !selected("loadOrders/cold/" + suffix)) continue;
+        resetDatabase();
+        orders = makeOrders(n);
+        benchOnce("saveOrders/" + suffix, n, [&]{ saveOrders(); return orders.size(); });
+        // cold start: fresh connection, empty statement cache, nothing in memory
+        closeDatabase();
+        orders.clear();
+        orders.shrink_to_fit();
+        initDatabase();
+        benchOnce("loadOrders/cold/" + suffix, n, [&]{ loadOrders(); return orders.size(); });
+        orders.clear();
+        orders.shrink_to_fit();
+    }
+
+    closeDatabase();
+    nftw(g_bench_dir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
@@ -12,12 +12,21 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <dirent.h>
 #include <algorithm>
 #include <cstring>
 #include <cerrno>
@@ -31,39 +40,357 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
+#include <list>
 #include <atomic>
+#include <memory>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <charconv>
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <sqlite3.h>
+#ifdef WITH_POSTGRES
+#include <libpq-fe.h>
+#endif
+#ifdef WITH_LIBJPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#ifdef WITH_LIBPNG
+#include <png.h>
+#endif
+#endif
 
 using namespace std;
 using nlohmann::json;
 // =================== Configuration & Globals for Enhancements ===================
 static atomic<bool> g_running(true);
-static int g_server_fd = -1;
 static string g_data_dir = "data";
+#if !defined(ONLINETRADERZ_NO_MAIN) || defined(WITH_POSTGRES) // also sizes the PostgreSQL pool
 static int g_max_workers = 4;
+#endif
 
-// =================== Simple structured logging ===================
+// =================== Asynchronous structured logging ===================
+// Every thread formats records into its own fixed-size ring (single producer,
+// single consumer); a background writer drains all rings to stderr. A full ring
+// drops the record and bumps a counter, so logging never blocks a worker.
 enum LogLevel { LOG_DEBUG=0, LOG_INFO=1, LOG_WARN=2, LOG_ERROR=3 };
 
+static atomic<int> g_log_level(LOG_INFO);
+static atomic<bool> g_log_async(false);
+static atomic<uint64_t> g_log_dropped(0);
+static atomic<uint64_t> g_log_truncated(0);
+
 static const char* lvlToStr(LogLevel l) {
 switch(l){ case LOG_DEBUG: return "DEBUG"; case LOG_INFO: return "INFO"; case LOG_WARN: return "WARN"; default: return "ERROR"; }
 }
 
+static inline bool logEnabled(LogLevel l) {
+    return (int)l >= g_log_level.load(memory_order_relaxed);
+}
+
+#ifndef ONLINETRADERZ_NO_MAIN // LOG_LEVEL is read by main
+static LogLevel parseLogLevel(string s, LogLevel def) {
+    transform(s.begin(), s.end(), s.begin(), ::tolower);
+    if (s == "debug") return LOG_DEBUG;
+    if (s == "info") return LOG_INFO;
+    if (s == "warn" || s == "warning") return LOG_WARN;
+    if (s == "error") return LOG_ERROR;
+    return def;
+}
+#endif
+
+// "YYYY-MM-DDTHH:MM:SSZ", re-formatted only when the second changes
+struct TimestampCache {
+    time_t sec = (time_t)-1;
+    char buf[32] = {0};
+    size_t len = 0;
+    const char *format(time_t t) {
+        if (t != sec) {
+            tm tm;
+            gmtime_r(&t, &tm);
+            len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+            sec = t;
+        }
+        return buf;
+    }
+};
+
+enum LogSink : uint8_t { SINK_STDERR=0, SINK_ACCESS=1 };
+
+struct LogRecord {
+    uint64_t mono; // steady-clock ns, orders records across rings
+    time_t ts;
+    uint8_t sink;
+    uint8_t level;
+    uint16_t len;
+    char text[500];
+};
+
+class LogRing {
+public:
+    static const size_t CAPACITY = 256; // power of two
+
+    bool push(LogSink sink, LogLevel lvl, uint64_t mono, time_t ts, const string &msg) {
+        size_t head = head_.load(memory_order_relaxed);
+        if (head - tail_.load(memory_order_acquire) >= CAPACITY) return false;
+        LogRecord &r = slots_[head & (CAPACITY - 1)];
+        r.mono = mono;
+        r.ts = ts;
+        r.sink = (uint8_t)sink;
+        r.level = (uint8_t)lvl;
+        if (msg.size() <= sizeof(r.text)) {
+            r.len = (uint16_t)msg.size();
+            memcpy(r.text, msg.data(), r.len);
+        } else {
+            // cut on a UTF-8 boundary and say so, rather than losing the tail silently
+            static const char marker[] = "\xE2\x80\xA6[truncated]";
+            size_t keep = sizeof(r.text) - (sizeof(marker) - 1);
+            while (keep > 0 && ((unsigned char)msg[keep] & 0xC0) == 0x80) --keep;
+            memcpy(r.text, msg.data(), keep);
+            memcpy(r.text + keep, marker, sizeof(marker) - 1);
+            r.len = (uint16_t)(keep + sizeof(marker) - 1);
+            g_log_truncated.fetch_add(1, memory_order_relaxed);
+        }
+        head_.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    template <class F> size_t drain(F &&f) {
+        size_t tail = tail_.load(memory_order_relaxed);
+        size_t head = head_.load(memory_order_acquire);
+        size_t n = head - tail;
+        for (; tail != head; ++tail) f(slots_[tail & (CAPACITY - 1)]);
+        tail_.store(tail, memory_order_release);
+        return n;
+    }
+
+    atomic<bool> retired{false};
+
+private:
+    LogRecord slots_[CAPACITY];
+    alignas(64) atomic<size_t> head_{0};
+    alignas(64) atomic<size_t> tail_{0};
+};
+
+static mutex g_log_rings_mutex;
+static vector<shared_ptr<LogRing>> g_log_rings;
+static mutex g_log_sync_mutex; // serializes direct writes when the writer is not running
+
+struct LogRingHolder {
+    shared_ptr<LogRing> ring;
+    ~LogRingHolder() { if (ring) ring->retired.store(true); }
+};
+
+static LogRing &threadLogRing() {
+    thread_local LogRingHolder holder;
+    if (!holder.ring) {
+        holder.ring = make_shared<LogRing>();
+        lock_guard<mutex> lock(g_log_rings_mutex);
+        g_log_rings.push_back(holder.ring);
+    }
+    return *holder.ring;
+}
+
+static void writeAllStderr(const string &s) {
+    size_t off = 0;
+    while (off < s.size()) {
+        ssize_t n = ::write(STDERR_FILENO, s.data() + off, s.size() - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        off += (size_t)n;
+    }
+}
+
+static void appendLogLine(string &out, TimestampCache &tc, time_t ts, LogLevel lvl, const char *text, size_t len) {
+    const char *stamp = tc.format(ts);
+    out += '[';
+    out.append(stamp, tc.len);
+    out += "] ";
+    out += lvlToStr(lvl);
+    out += " - ";
+    out.append(text, len);
+    out += '\n';
+}
+
 static void logMsg(LogLevel lvl, const string &msg) {
-using namespace chrono;
-auto now = system_clock::now();
-time_t tt = system_clock::to_time_t(now);
-tm tm;
-gmtime_r(&tt, &tm);
-char buf[64];
-strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
-cerr << "[" << buf << "] " << lvlToStr(lvl) << " - " << msg << "\n";
+    time_t now = time(nullptr);
+    if (g_log_async.load(memory_order_acquire)) {
+        uint64_t mono = (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+        if (!threadLogRing().push(SINK_STDERR, lvl, mono, now, msg)) g_log_dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    thread_local TimestampCache tc;
+    string line;
+    appendLogLine(line, tc, now, lvl, msg.data(), msg.size());
+    lock_guard<mutex> lock(g_log_sync_mutex);
+    writeAllStderr(line);
+}
+
+// Level check happens before the message expression is evaluated
+#define LOGI(msg) do { if (logEnabled(LOG_INFO)) logMsg(LOG_INFO, msg); } while (0)
+#define LOGW(msg) do { if (logEnabled(LOG_WARN)) logMsg(LOG_WARN, msg); } while (0)
+#define LOGE(msg) do { if (logEnabled(LOG_ERROR)) logMsg(LOG_ERROR, msg); } while (0)
+#define LOGD(msg) do { if (logEnabled(LOG_DEBUG)) logMsg(LOG_DEBUG, msg); } while (0)
+
+// =================== Access log ===================
+// One line per request in Common Log Format plus latency in microseconds
+// (Apache's %D), appended to DATA_DIR/access.log by the log writer thread.
+// Records travel through the same per-thread rings as diagnostic logs.
+static atomic<bool> g_access_log_enabled(true);
+static double g_access_log_sample = 1.0;          // ACCESS_LOG_SAMPLE, fraction of requests kept
+static size_t g_access_log_max_bytes = 64u << 20; // ACCESS_LOG_MAX_MB, rotate above this size
+static int g_access_log_keep = 5;                 // ACCESS_LOG_KEEP, rotated files retained
+
+static void accessLogPush(time_t ts, const string &entry) {
+    if (!g_log_async.load(memory_order_acquire)) return; // no writer, no file
+    uint64_t mono = (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+    if (!threadLogRing().push(SINK_ACCESS, LOG_INFO, mono, ts, entry)) g_log_dropped.fetch_add(1, memory_order_relaxed);
 }
 
-#define LOGI(msg) logMsg(LOG_INFO, msg)
-#define LOGW(msg) logMsg(LOG_WARN, msg)
-#define LOGE(msg) logMsg(LOG_ERROR, msg)
-#define LOGD(msg) logMsg(LOG_DEBUG, msg)
+class AccessLogFile {
+public:
+    ~AccessLogFile() { if (fd_ >= 0) close(fd_); }
+
+    void open(const string &path) {
+        path_ = path;
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) { cerr << "Failed to open access log " << path_ << " : " << strerror(errno) << "\n"; return; }
+        struct stat st;
+        size_ = (fstat(fd_, &st) == 0) ? (size_t)st.st_size : 0;
+    }
+
+    // entry is "<ip>\t<rest>"; the CLF timestamp is spliced in here
+    void append(time_t ts, const char *entry, size_t len) {
+        if (fd_ < 0) return;
+        const char *tab = (const char*)memchr(entry, '\t', len);
+        if (!tab) return;
+        if (ts != stampSec_) {
+            tm tm;
+            gmtime_r(&ts, &tm);
+            stampLen_ = strftime(stamp_, sizeof(stamp_), "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+            stampSec_ = ts;
+        }
+        buf_.append(entry, tab - entry);
+        buf_ += " - - ";
+        buf_.append(stamp_, stampLen_);
+        buf_ += ' ';
+        buf_.append(tab + 1, len - (tab + 1 - entry));
+        buf_ += '\n';
+    }
+
+    void flush() {
+        if (fd_ < 0 || buf_.empty()) { buf_.clear(); return; }
+        size_t off = 0;
+        while (off < buf_.size()) {
+            ssize_t n = ::write(fd_, buf_.data() + off, buf_.size() - off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            off += (size_t)n;
+        }
+        size_ += off;
+        buf_.clear();
+        if (size_ >= g_access_log_max_bytes) rotate();
+    }
+
+private:
+    void rotate() {
+        close(fd_);
+        fd_ = -1;
+        for (int i = g_access_log_keep - 1; i >= 1; --i) {
+            rename((path_ + "." + to_string(i)).c_str(), (path_ + "." + to_string(i + 1)).c_str());
+        }
+        if (g_access_log_keep > 0) rename(path_.c_str(), (path_ + ".1").c_str());
+        else unlink(path_.c_str());
+        open(path_);
+    }
+
+    string path_;
+    int fd_ = -1;
+    size_t size_ = 0;
+    string buf_;
+    time_t stampSec_ = (time_t)-1;
+    char stamp_[40] = {0};
+    size_t stampLen_ = 0;
+};
+
+class LogWriter {
+public:
+    void openAccessLog(const string &path) { access_.open(path); }
+
+    void start() {
+        stop_ = false;
+        worker_ = thread([this]{ run(); });
+        g_log_async.store(true, memory_order_release);
+    }
+    void stop() {
+        if (!worker_.joinable()) return;
+        {
+            lock_guard<mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        worker_.join();
+        g_log_async.store(false, memory_order_release);
+        drainOnce(); // records pushed while the writer was exiting
+    }
+    ~LogWriter() { stop(); }
+
+private:
+    size_t drainOnce() {
+        vector<shared_ptr<LogRing>> rings;
+        {
+            lock_guard<mutex> lock(g_log_rings_mutex);
+            rings = g_log_rings;
+        }
+        batch_.clear();
+        for (auto &r : rings) {
+            bool retired = r->retired.load(memory_order_acquire);
+            r->drain([&](const LogRecord &rec) { batch_.push_back(rec); });
+            if (retired) {
+                lock_guard<mutex> lock(g_log_rings_mutex);
+                g_log_rings.erase(remove(g_log_rings.begin(), g_log_rings.end(), r), g_log_rings.end());
+            }
+        }
+        stable_sort(batch_.begin(), batch_.end(), [](const LogRecord &a, const LogRecord &b){ return a.mono < b.mono; });
+        string out;
+        for (auto &rec : batch_) {
+            if (rec.sink == SINK_ACCESS) access_.append(rec.ts, rec.text, rec.len);
+            else appendLogLine(out, tc_, rec.ts, (LogLevel)rec.level, rec.text, rec.len);
+        }
+        access_.flush();
+        size_t total = batch_.size();
+        uint64_t dropped = g_log_dropped.load(memory_order_relaxed);
+        if (dropped != reportedDropped_) {
+            string msg = "dropped " + to_string(dropped - reportedDropped_) + " log records (ring full)";
+            appendLogLine(out, tc_, time(nullptr), LOG_WARN, msg.data(), msg.size());
+            reportedDropped_ = dropped;
+        }
+        if (!out.empty()) writeAllStderr(out);
+        return total;
+    }
+    void run() {
+        unique_lock<mutex> lock(mtx_);
+        while (!stop_) {
+            lock.unlock();
+            size_t n = drainOnce();
+            lock.lock();
+            if (n == 0) cv_.wait_for(lock, chrono::milliseconds(20), [this]{ return stop_; });
+        }
+    }
+
+    thread worker_;
+    mutex mtx_;
+    condition_variable cv_;
+    bool stop_ = false;
+    TimestampCache tc_;
+    AccessLogFile access_;
+    vector<LogRecord> batch_;
+    uint64_t reportedDropped_ = 0;
+};
 
 // =================== ThreadPool (simple) ===================
 class ThreadPool {
@@ -80,6 +407,7 @@ if (this->stop && this->tasks.empty()) return;
 task = move(this->tasks.front());
 this->tasks.pop();
 }
+busy.fetch_add(1, memory_order_relaxed);
 try {
 task();
 } catch (const exception &ex) {
@@ -87,6 +415,7 @@ LOGE(string("Unhandled exception in worker: ") + ex.what());
 } catch (...) {
 LOGE("Unhandled non-exception thrown in worker");
 }
+busy.fetch_sub(1, memory_order_relaxed);
 }
 });
 }
@@ -107,31 +436,616 @@ tasks.push(move(f));
 }
 cv.notify_one();
 }
+// Like enqueue, but refuses work once maxQueued tasks are already waiting
+bool tryEnqueue(function<void()> f, size_t maxQueued) {
+{
+unique_lock<mutex> lock(mtx);
+if (stop || tasks.size() >= maxQueued) return false;
+tasks.push(move(f));
+}
+cv.notify_one();
+return true;
+}
+size_t queueDepth() {
+lock_guard<mutex> lock(mtx);
+return tasks.size();
+}
+int busyWorkers() const { return busy.load(memory_order_relaxed); }
+int workerCount() const { return (int)threads.size(); }
 private:
 vector<thread> threads;
 queue<function<void()>> tasks;
 mutex mtx;
 condition_variable cv;
 bool stop;
+atomic<int> busy{0};
 };
 
-// =================== Graceful shutdown handling ===================
 static ThreadPool *g_threadpool_ptr = nullptr;
+
+// =================== Connection deadlines ===================
+// Each connection carries one deadline at a time (header, body or write
+// phase). Deadlines live in a two-level hashed timer wheel driven by a single
+// thread ticking every 100 ms: arm and cancel are O(1) list splices under one
+// mutex, with no timer syscall per connection. When a deadline passes the
+// wheel shuts the socket down, which wakes the worker blocked in recv/send.
+enum DeadlinePhase : uint8_t { PHASE_HEADER, PHASE_BODY, PHASE_WRITE, PHASE_COUNT };
+
+static const char *phaseName(DeadlinePhase p) {
+    switch (p) {
+        case PHASE_HEADER: return "header";
+        case PHASE_BODY: return "body";
+        default: return "write";
+    }
+}
+
+static int g_header_timeout_ms = 10000;
+static int g_body_timeout_ms = 30000;
+static int g_write_timeout_ms = 30000;
+static size_t g_body_max_bytes = 1u << 20; // BODY_MAX_KB; uploads have their own limit
+static const size_t HEADER_MAX_BYTES = 64u << 10;
+static atomic<uint64_t> g_connection_timeouts[PHASE_COUNT];
+
+class TimerWheel {
+public:
+    static const int TICK_MS = 100;
+
+    struct Timer {
+        Timer *prev = nullptr, *next = nullptr;
+        uint64_t expiresTick = 0;
+        int fd = -1;
+        DeadlinePhase phase = PHASE_HEADER;
+        atomic<bool> fired{false};
+    };
+
+    TimerWheel() {
+        for (auto &h : level0_) h.prev = h.next = &h;
+        for (auto &h : level1_) h.prev = h.next = &h;
+    }
+    ~TimerWheel() { stop(); }
+
+    // (Re)arm t to shut fd down after ms; replaces any pending deadline
+    void arm(Timer &t, int fd, DeadlinePhase phase, int ms) {
+        uint64_t ticks = (uint64_t)max(1, (ms + TICK_MS - 1) / TICK_MS);
+        ticks = min<uint64_t>(ticks, (uint64_t)L0 * L1 - 1);
+        lock_guard<mutex> lock(mtx_);
+        unlinkLocked(t);
+        t.fd = fd;
+        t.phase = phase;
+        t.expiresTick = now_ + ticks;
+        linkLocked(t);
+    }
+
+    // After cancel returns the wheel will not touch t's fd again
+    void cancel(Timer &t) {
+        lock_guard<mutex> lock(mtx_);
+        unlinkLocked(t);
+    }
+
+    // Fires every pending deadline now (shutdown drain ran out of time)
+    void expireAll() {
+        lock_guard<mutex> lock(mtx_);
+        for (auto &h : level0_) fireLocked(h);
+        for (auto &h : level1_) fireLocked(h);
+    }
+
+    void start() {
+        running_ = true;
+        thread_ = thread([this]{ run(); });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(mtx_);
+            if (!running_) return;
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    static const int L0 = 256;  // 100 ms slots: 25.6 s
+    static const int L1 = 64;   // 25.6 s slots: ~27 min
+
+    static bool emptyList(const Timer &h) { return h.next == &h; }
+
+    void linkLocked(Timer &t) {
+        Timer *head = t.expiresTick - now_ < (uint64_t)L0 ? &level0_[t.expiresTick % L0]
+                                                         : &level1_[(t.expiresTick / L0) % L1];
+        t.prev = head;
+        t.next = head->next;
+        head->next->prev = &t;
+        head->next = &t;
+    }
+
+    static void unlinkLocked(Timer &t) {
+        if (!t.prev) return;
+        t.prev->next = t.next;
+        t.next->prev = t.prev;
+        t.prev = t.next = nullptr;
+    }
+
+    void tickLocked() {
+        ++now_;
+        // entering a new level-0 round: spread that round's level-1 slot out
+        if (now_ % L0 == 0) {
+            Timer &head = level1_[(now_ / L0) % L1];
+            while (!emptyList(head)) {
+                Timer *t = head.next;
+                unlinkLocked(*t);
+                linkLocked(*t);
+            }
+        }
+        fireLocked(level0_[now_ % L0]);
+    }
+
+    void fireLocked(Timer &head) {
+        while (!emptyList(head)) {
+            Timer *t = head.next;
+            unlinkLocked(*t);
+            t->fired.store(true, memory_order_relaxed);
+            g_connection_timeouts[t->phase].fetch_add(1, memory_order_relaxed);
+            // reads only lose their input so the worker can still answer 408
+            shutdown(t->fd, t->phase == PHASE_WRITE ? SHUT_RDWR : SHUT_RD);
+        }
+    }
+
+    void run() {
+        auto next = chrono::steady_clock::now();
+        unique_lock<mutex> lock(mtx_);
+        while (running_) {
+            next += chrono::milliseconds(TICK_MS);
+            cv_.wait_until(lock, next, [this]{ return !running_; });
+            if (!running_) break;
+            // catch up if the thread was descheduled for several ticks
+            auto now = chrono::steady_clock::now();
+            do tickLocked(); while ((next += chrono::milliseconds(TICK_MS)) <= now);
+            next -= chrono::milliseconds(TICK_MS);
+        }
+    }
+
+    mutex mtx_;
+    condition_variable cv_;
+    thread thread_;
+    bool running_ = false;
+    uint64_t now_ = 0;
+    Timer level0_[L0];
+    Timer level1_[L1];
+};
+
+static TimerWheel g_timer_wheel;
+
+// Owns the deadline of the connection being handled on this thread
+class ConnectionDeadline;
+static thread_local ConnectionDeadline *t_conn_deadline = nullptr;
+
+class ConnectionDeadline {
+public:
+    explicit ConnectionDeadline(int fd) : fd_(fd) { t_conn_deadline = this; }
+    ~ConnectionDeadline() {
+        cancel();
+        t_conn_deadline = nullptr;
+    }
+    void arm(DeadlinePhase phase) {
+        int ms = phase == PHASE_HEADER ? g_header_timeout_ms : phase == PHASE_BODY ? g_body_timeout_ms : g_write_timeout_ms;
+        g_timer_wheel.arm(timer_, fd_, phase, ms);
+    }
+    void cancel() { g_timer_wheel.cancel(timer_); }
+    bool expired() const { return timer_.fired.load(memory_order_relaxed); }
+private:
+    int fd_;
+    TimerWheel::Timer timer_;
+};
+
+// Connection owned by this worker until closeClient runs
+static thread_local int t_client_fd = -1;
+
+// Cancel the deadline before the fd number can be reused by another accept
+static void closeClient(int fd) {
+    if (t_conn_deadline) t_conn_deadline->cancel();
+    if (t_client_fd == fd) t_client_fd = -1;
+    close(fd);
+}
+
+// =================== Metrics ===================
+// Counters live in per-thread shards written only by their owning thread
+// (relaxed load+store, no locked instructions); /metrics sums all shards.
+enum Route {
+    ROUTE_OPTIONS, ROUTE_LOGIN, ROUTE_PRODUCTS, ROUTE_PRODUCT_SEARCH, ROUTE_ADD_PRODUCT, ROUTE_DELETE_PRODUCT,
+    ROUTE_UPLOAD_IMAGE, ROUTE_ORDERS_LIST, ROUTE_ORDERS_CREATE, ROUTE_ORDERS_STREAM, ROUTE_ORDERS_EXPORT,
+    ROUTE_SHIPPING_LABEL, ROUTE_SHIPPING_LABELS, ROUTE_STATS, ROUTE_ADMIN_BACKUP, ROUTE_METRICS,
+    ROUTE_STATIC, ROUTE_OTHER, ROUTE_COUNT
+};
+
+static const char *routeName(Route r) {
+    switch (r) {
+        case ROUTE_OPTIONS: return "options";
+        case ROUTE_LOGIN: return "login";
+        case ROUTE_PRODUCTS: return "products";
+        case ROUTE_PRODUCT_SEARCH: return "product_search";
+        case ROUTE_ADD_PRODUCT: return "add_product";
+        case ROUTE_DELETE_PRODUCT: return "delete_product";
+        case ROUTE_UPLOAD_IMAGE: return "upload_image";
+        case ROUTE_ORDERS_LIST: return "orders_list";
+        case ROUTE_ORDERS_CREATE: return "orders_create";
+        case ROUTE_ORDERS_STREAM: return "orders_stream";
+        case ROUTE_ORDERS_EXPORT: return "orders_export";
+        case ROUTE_SHIPPING_LABEL: return "shipping_label";
+        case ROUTE_SHIPPING_LABELS: return "shipping_labels";
+        case ROUTE_STATS: return "stats";
+        case ROUTE_ADMIN_BACKUP: return "admin_backup";
+        case ROUTE_METRICS: return "metrics";
+        case ROUTE_STATIC: return "static";
+        default: return "other";
+    }
+}
+
+// Log-linear latency buckets (HDR style, two per octave): 1,2,3,4,6,8,12,16,... us up to ~100 s
+static const int LATENCY_BUCKETS = 54; // last bucket is +Inf
+
+static const uint64_t *latencyBounds() {
+    static uint64_t bounds[LATENCY_BUCKETS - 1];
+    static once_flag once;
+    call_once(once, []{
+        int i = 0;
+        bounds[i++] = 1;
+        for (int e = 1; i < LATENCY_BUCKETS - 1; ++e) {
+            bounds[i++] = 1ULL << e;
+            if (i < LATENCY_BUCKETS - 1) bounds[i++] = 3ULL << (e - 1);
+        }
+    });
+    return bounds;
+}
+
+static inline int latencyBucket(uint64_t us) {
+    const uint64_t *b = latencyBounds();
+    return (int)(lower_bound(b, b + LATENCY_BUCKETS - 1, us) - b);
+}
+
+// Only for counters in the calling thread's own shard: a load+store loses
+// increments if two threads share the counter. CacheStats and other shared
+// counters use fetch_add.
+static inline void bump(atomic<uint64_t> &c, uint64_t n = 1) {
+    c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+struct LatencyHistogram {
+    atomic<uint64_t> buckets[LATENCY_BUCKETS] = {};
+    atomic<uint64_t> sumUs{0};
+    atomic<uint64_t> count{0};
+    void observe(uint64_t us) {
+        bump(buckets[latencyBucket(us)]);
+        bump(sumUs, us);
+        bump(count);
+    }
+};
+
+struct MetricsShard {
+    atomic<uint64_t> requests[ROUTE_COUNT][5] = {}; // status class 1xx..5xx
+    LatencyHistogram latency[ROUTE_COUNT];
+    LatencyHistogram sqliteCommit;
+    atomic<uint64_t> staticBytes{0};
+    atomic<uint64_t> rateLimited[ROUTE_COUNT] = {};
+};
+
+static mutex g_metrics_mutex;
+static vector<shared_ptr<MetricsShard>> g_metrics_shards; // shards outlive their threads
+
+static MetricsShard &metricsShard() {
+    thread_local shared_ptr<MetricsShard> shard;
+    if (!shard) {
+        shard = make_shared<MetricsShard>();
+        lock_guard<mutex> lock(g_metrics_mutex);
+        g_metrics_shards.push_back(shard);
+    }
+    return *shard;
+}
+
+static atomic<int64_t> g_open_connections(0);
+static atomic<int64_t> g_sse_subscribers(0);
+static atomic<int64_t> g_sqlite_readers(0);
+static atomic<uint64_t> g_backups_ok(0), g_backups_failed(0);
+static atomic<int64_t> g_backup_last_success(0);
+
+// Caches register a named hit/miss pair once and bump it on lookup
+struct CacheStats {
+    const char *name;
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+};
+
+static vector<CacheStats*> &cacheStatsRegistry() {
+    static vector<CacheStats*> registry;
+    return registry;
+}
+
+CacheStats *registerCacheStats(const char *name) {
+    lock_guard<mutex> lock(g_metrics_mutex);
+    cacheStatsRegistry().push_back(new CacheStats{name});
+    return cacheStatsRegistry().back();
+}
+
+static void observeSqliteCommit(chrono::steady_clock::time_point start) {
+    auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    metricsShard().sqliteCommit.observe((uint64_t)us);
+}
+
+static void appendHistogram(string &out, const char *name, const string &labels,
+                            const uint64_t *buckets, uint64_t sumUs, uint64_t count) {
+    const uint64_t *bounds = latencyBounds();
+    uint64_t cumulative = 0;
+    char le[32];
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        cumulative += buckets[i];
+        if (i + 1 < LATENCY_BUCKETS) snprintf(le, sizeof(le), "%g", (double)bounds[i] / 1e6);
+        else snprintf(le, sizeof(le), "+Inf");
+        out += name; out += "_bucket{"; out += labels;
+        if (!labels.empty()) out += ',';
+        out += "le=\""; out += le; out += "\"} "; out += to_string(cumulative); out += '\n';
+    }
+    char sum[32];
+    snprintf(sum, sizeof(sum), "%.6f", (double)sumUs / 1e6);
+    string braced = labels.empty() ? string() : "{" + labels + "}";
+    out += name; out += "_sum"; out += braced; out += ' '; out += sum; out += '\n';
+    out += name; out += "_count"; out += braced; out += ' '; out += to_string(count); out += '\n';
+}
+
+static string renderMetrics() {
+    struct Totals {
+        uint64_t requests[ROUTE_COUNT][5] = {};
+        uint64_t latency[ROUTE_COUNT][LATENCY_BUCKETS] = {};
+        uint64_t latencySum[ROUTE_COUNT] = {};
+        uint64_t latencyCount[ROUTE_COUNT] = {};
+        uint64_t commit[LATENCY_BUCKETS] = {};
+        uint64_t commitSum = 0, commitCount = 0;
+        uint64_t staticBytes = 0;
+        uint64_t rateLimited[ROUTE_COUNT] = {};
+    };
+    auto t = make_unique<Totals>();
+    vector<pair<const char*, pair<uint64_t,uint64_t>>> caches;
+    {
+        lock_guard<mutex> lock(g_metrics_mutex);
+        for (auto &sp : g_metrics_shards) {
+            MetricsShard &s = *sp;
+            for (int r = 0; r < ROUTE_COUNT; ++r) {
+                for (int c = 0; c < 5; ++c) t->requests[r][c] += s.requests[r][c].load(memory_order_relaxed);
+                for (int b = 0; b < LATENCY_BUCKETS; ++b) t->latency[r][b] += s.latency[r].buckets[b].load(memory_order_relaxed);
+                t->latencySum[r] += s.latency[r].sumUs.load(memory_order_relaxed);
+                t->latencyCount[r] += s.latency[r].count.load(memory_order_relaxed);
+            }
+            for (int b = 0; b < LATENCY_BUCKETS; ++b) t->commit[b] += s.sqliteCommit.buckets[b].load(memory_order_relaxed);
+            t->commitSum += s.sqliteCommit.sumUs.load(memory_order_relaxed);
+            t->commitCount += s.sqliteCommit.count.load(memory_order_relaxed);
+            t->staticBytes += s.staticBytes.load(memory_order_relaxed);
+            for (int r = 0; r < ROUTE_COUNT; ++r) t->rateLimited[r] += s.rateLimited[r].load(memory_order_relaxed);
+        }
+        for (auto *c : cacheStatsRegistry()) {
+            caches.push_back({c->name, {c->hits.load(memory_order_relaxed), c->misses.load(memory_order_relaxed)}});
+        }
+    }
+
+    string out;
+    out.reserve(16384);
+    out += "# HELP http_requests_total Requests handled, by route and status class.\n";
+    out += "# TYPE http_requests_total counter\n";
+    for (int r = 0; r < ROUTE_COUNT; ++r) {
+        for (int c = 0; c < 5; ++c) {
+            if (!t->requests[r][c]) continue;
+            out += "http_requests_total{route=\""; out += routeName((Route)r);
+            out += "\",code=\""; out += to_string(c + 1); out += "xx\"} ";
+            out += to_string(t->requests[r][c]); out += '\n';
+        }
+    }
+    out += "# HELP http_rate_limited_total Requests rejected with 429 by the per-IP limiter.\n";
+    out += "# TYPE http_rate_limited_total counter\n";
+    for (int r = 0; r < ROUTE_COUNT; ++r) {
+        if (!t->rateLimited[r]) continue;
+        out += "http_rate_limited_total{route=\""; out += routeName((Route)r); out += "\"} ";
+        out += to_string(t->rateLimited[r]); out += '\n';
+    }
+    out += "# HELP http_request_duration_seconds Time from accept hand-off to response sent.\n";
+    out += "# TYPE http_request_duration_seconds histogram\n";
+    for (int r = 0; r < ROUTE_COUNT; ++r) {
+        if (!t->latencyCount[r]) continue;
+        appendHistogram(out, "http_request_duration_seconds", string("route=\"") + routeName((Route)r) + "\"",
+                        t->latency[r], t->latencySum[r], t->latencyCount[r]);
+    }
+    out += "# HELP sqlite_commit_duration_seconds Latency of SQLite write commits.\n";
+    out += "# TYPE sqlite_commit_duration_seconds histogram\n";
+    appendHistogram(out, "sqlite_commit_duration_seconds", "", t->commit, t->commitSum, t->commitCount);
+
+    ThreadPool *pool = g_threadpool_ptr;
+    out += "# HELP threadpool_queue_depth Accepted connections waiting for a worker.\n";
+    out += "# TYPE threadpool_queue_depth gauge\n";
+    out += "threadpool_queue_depth " + to_string(pool ? pool->queueDepth() : 0) + "\n";
+    out += "# HELP threadpool_busy_workers Workers currently handling a connection.\n";
+    out += "# TYPE threadpool_busy_workers gauge\n";
+    out += "threadpool_busy_workers " + to_string(pool ? pool->busyWorkers() : 0) + "\n";
+    out += "# HELP threadpool_workers Configured worker threads.\n";
+    out += "# TYPE threadpool_workers gauge\n";
+    out += "threadpool_workers " + to_string(pool ? pool->workerCount() : 0) + "\n";
+    out += "# HELP http_open_connections Client connections accepted and not yet closed.\n";
+    out += "# TYPE http_open_connections gauge\n";
+    out += "http_open_connections " + to_string(g_open_connections.load(memory_order_relaxed)) + "\n";
+    out += "# HELP sse_subscribers Admin sessions attached to /api/orders/stream.\n";
+    out += "# TYPE sse_subscribers gauge\n";
+    out += "sse_subscribers " + to_string(g_sse_subscribers.load(memory_order_relaxed)) + "\n";
+    out += "# HELP sqlite_read_connections Per-thread read-only SQLite connections open.\n";
+    out += "# TYPE sqlite_read_connections gauge\n";
+    out += "sqlite_read_connections " + to_string(g_sqlite_readers.load(memory_order_relaxed)) + "\n";
+    out += "# HELP backups_total Database backups attempted, by outcome.\n";
+    out += "# TYPE backups_total counter\n";
+    out += "backups_total{result=\"ok\"} " + to_string(g_backups_ok.load(memory_order_relaxed)) + "\n";
+    out += "backups_total{result=\"failed\"} " + to_string(g_backups_failed.load(memory_order_relaxed)) + "\n";
+    out += "# HELP backup_last_success_timestamp_seconds Unix time of the last completed backup.\n";
+    out += "# TYPE backup_last_success_timestamp_seconds gauge\n";
+    out += "backup_last_success_timestamp_seconds " + to_string(g_backup_last_success.load(memory_order_relaxed)) + "\n";
+    out += "# HELP static_bytes_served_total Body bytes sent for files under public/.\n";
+    out += "# TYPE static_bytes_served_total counter\n";
+    out += "static_bytes_served_total " + to_string(t->staticBytes) + "\n";
+    out += "# HELP connection_timeouts_total Connections shut down by a read or write deadline.\n";
+    out += "# TYPE connection_timeouts_total counter\n";
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        out += string("connection_timeouts_total{phase=\"") + phaseName((DeadlinePhase)p) + "\"} ";
+        out += to_string(g_connection_timeouts[p].load(memory_order_relaxed)) + "\n";
+    }
+    out += "# HELP log_records_dropped_total Log records dropped because a ring was full.\n";
+    out += "# TYPE log_records_dropped_total counter\n";
+    out += "log_records_dropped_total " + to_string(g_log_dropped.load(memory_order_relaxed)) + "\n";
+    out += "# HELP log_records_truncated_total Log records cut to fit a ring slot.\n";
+    out += "# TYPE log_records_truncated_total counter\n";
+    out += "log_records_truncated_total " + to_string(g_log_truncated.load(memory_order_relaxed)) + "\n";
+    if (!caches.empty()) {
+        out += "# HELP cache_hits_total Cache lookups served from the cache.\n# TYPE cache_hits_total counter\n";
+        for (auto &c : caches) out += string("cache_hits_total{cache=\"") + c.first + "\"} " + to_string(c.second.first) + "\n";
+        out += "# HELP cache_misses_total Cache lookups that missed.\n# TYPE cache_misses_total counter\n";
+        for (auto &c : caches) out += string("cache_misses_total{cache=\"") + c.first + "\"} " + to_string(c.second.second) + "\n";
+        out += "# HELP cache_hit_ratio Hits over lookups since start.\n# TYPE cache_hit_ratio gauge\n";
+        for (auto &c : caches) {
+            uint64_t total = c.second.first + c.second.second;
+            char ratio[32];
+            snprintf(ratio, sizeof(ratio), "%.4f", total ? (double)c.second.first / (double)total : 0.0);
+            out += string("cache_hit_ratio{cache=\"") + c.first + "\"} " + ratio + "\n";
+        }
+    }
+    return out;
+}
+
+// =================== Rate limiting ===================
+// Token bucket per (client IP, route). Buckets refill lazily on access, so
+// idle clients cost nothing; the table is split into lock stripes keyed by
+// a hash of the IP so workers rarely contend.
+struct RatePolicy {
+    double burst;        // bucket capacity
+    double perSecond;    // refill rate; 0 = unlimited
+};
+
+static atomic<bool> g_rate_limit_enabled(true);
+static bool g_trust_proxy = false;   // take the client IP from X-Forwarded-For
+
+static RatePolicy g_rate_policies[ROUTE_COUNT] = {
+    /* options         */ {0, 0},
+    /* login           */ {5, 0.2},      // slows password guessing
+    /* products        */ {60, 20},
+    /* product_search  */ {60, 20},
+    /* add_product     */ {10, 1},
+    /* delete_product  */ {10, 1},
+    /* upload_image    */ {10, 0.5},
+    /* orders_list     */ {30, 5},
+    /* orders_create   */ {10, 0.5},
+    /* orders_stream   */ {10, 0.5},     // EventSource reconnects every 3 s
+    /* orders_export   */ {5, 0.1},
+    /* shipping_label  */ {30, 5},
+    /* shipping_labels */ {10, 1},      // up to 500 labels per request
+    /* stats           */ {30, 5},
+    /* admin_backup    */ {5, 0.1},
+    /* metrics         */ {0, 0},
+    /* static          */ {200, 100},
+    /* other           */ {60, 20},
+};
+
+#ifndef ONLINETRADERZ_NO_MAIN
+// RATE_LIMIT_SCALE multiplies every burst and rate (e.g. 10 for load tests)
+static void scaleRatePolicies(double factor) {
+    for (auto &p : g_rate_policies) { p.burst *= factor; p.perSecond *= factor; }
+}
+#endif
+
+struct TokenBucket {
+    float tokens = -1;   // < 0 until first use (starts full)
+    int64_t lastNs = 0;
+};
+
+struct ClientBuckets {
+    TokenBucket route[ROUTE_COUNT];
+    int64_t lastSeenNs = 0;
+};
+
+static const int RATE_LIMIT_STRIPES = 64;
+static const size_t RATE_LIMIT_STRIPE_MAX = 8192; // clients per stripe before a sweep
+
+struct RateLimitStripe {
+    mutex m;
+    unordered_map<string, ClientBuckets> clients;
+};
+
+static RateLimitStripe g_rate_stripes[RATE_LIMIT_STRIPES];
+
+static int64_t monotonicNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Clients idle long enough for every bucket to be full again are
+// indistinguishable from new ones and can be dropped. Caller holds stripe.m.
+static void sweepRateStripe(RateLimitStripe &stripe, int64_t now) {
+    double slowest = 0;
+    for (auto &p : g_rate_policies) if (p.perSecond > 0) slowest = max(slowest, p.burst / p.perSecond);
+    int64_t idleNs = (int64_t)(slowest * 1e9) + 1000000000LL;
+    for (auto it = stripe.clients.begin(); it != stripe.clients.end();) {
+        if (now - it->second.lastSeenNs > idleNs) it = stripe.clients.erase(it);
+        else ++it;
+    }
+}
+
+// Take one token for ip on route. Returns 0 when allowed, otherwise the
+// number of seconds until a token is available (for Retry-After).
+int rateLimitAcquire(const string &ip, Route route) {
+    const RatePolicy &policy = g_rate_policies[route];
+    if (!g_rate_limit_enabled.load(memory_order_relaxed) || policy.perSecond <= 0) return 0;
+
+    auto &stripe = g_rate_stripes[hash<string>()(ip) % RATE_LIMIT_STRIPES];
+    int64_t now = monotonicNs();
+    lock_guard<mutex> lock(stripe.m);
+    if (stripe.clients.size() >= RATE_LIMIT_STRIPE_MAX && !stripe.clients.count(ip)) sweepRateStripe(stripe, now);
+
+    ClientBuckets &client = stripe.clients[ip];
+    client.lastSeenNs = now;
+    TokenBucket &b = client.route[route];
+    if (b.tokens < 0) {
+        b.tokens = (float)policy.burst;
+    } else {
+        double refill = (double)(now - b.lastNs) * 1e-9 * policy.perSecond;
+        b.tokens = (float)min(policy.burst, (double)b.tokens + refill);
+    }
+    b.lastNs = now;
+    if (b.tokens >= 1.0f) {
+        b.tokens -= 1.0f;
+        return 0;
+    }
+    bump(metricsShard().rateLimited[route]);
+    return max(1, (int)ceil((1.0 - b.tokens) / policy.perSecond));
+}
+
+// =================== Graceful shutdown handling ===================
 static sqlite3 *g_db = nullptr;
-static mutex g_storage_mutex; // simple mutex to guard products/orders vectors & db writes
+static mutex g_storage_mutex; // guards the in-memory products/orders vectors
+
+#ifndef ONLINETRADERZ_NO_MAIN // benchmark builds have no accept loop
+// Signal handlers only set flags and write to this pipe, which wakes the accept loop
+static int g_wake_pipe[2] = {-1, -1};
+static atomic<bool> g_upgrade_requested(false);
+static atomic<int> g_shutdown_signal(0); // logged by the accept loop, not the handler
+
+static void wakeAcceptLoop() {
+    if (g_wake_pipe[1] < 0) return;
+    char b = 1;
+    ssize_t ignored = write(g_wake_pipe[1], &b, 1);
+    (void)ignored;
+}
 
 static void gracefulShutdown(int signo) {
-string s = "Received signal ";
-s += to_string(signo);
-LOGI(s + " - initiating graceful shutdown");
+g_shutdown_signal.store(signo);
 g_running.store(false);
-if (g_server_fd >= 0) {
-// closing listening socket will unblock accept
-close(g_server_fd);
-g_server_fd = -1;
+wakeAcceptLoop();
+// the accept loop closes the listener and drains; the threadpool destructor finishes tasks
 }
-// allow threadpool destructor to run and finish tasks
+
+static void upgradeSignal(int) {
+    g_upgrade_requested.store(true);
+    wakeAcceptLoop();
 }
+#endif // ONLINETRADERZ_NO_MAIN
 
 // =================== End of enhancements; original code begins ===================
 
@@ -180,13 +1094,25 @@ if (filename.empty()) return g_data_dir + "/";
 return g_data_dir + "/" + filename;
 }
 
+// Ids as the API generates them ("p12", "O345"): letters, digits, '_' and
+// '-', at most 64 bytes. They end up in file names, so nothing else passes.
+static bool idCharsSafe(string_view id) {
+    if (id.empty() || id.size() > 64) return false;
+    for (char c : id) {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-') return false;
+    }
+    return true;
+}
+
+string_view trimView(string_view s) {
+size_t start = 0, end = s.size();
+while (start < end && isspace((unsigned char)s[start])) start++;
+while (end > start && isspace((unsigned char)s[end - 1])) end--;
+return s.substr(start, end - start);
+}
+
 string trim(const string &s) {
-auto start = s.begin();
-while (start != s.end() && isspace((unsigned char)*start)) start++;
-auto end = s.end();
-if (start == end) return "";
-do { end--; } while (distance(start, end) > 0 && isspace((unsigned char)*end));
-return string(start, end + 1);
+return string(trimView(s));
 }
 
 string nowISO8601() {
@@ -217,585 +1143,4445 @@ ss << file.rdbuf();
 return ss.str();
 }
 
-// atomic write helper: write to temp file then rename, ensure fsync
-bool atomicWriteFile(const string &path, const string &content) {
-// ensure parent directory exists
-string dir;
-size_t pos = path.find_last_of('/');
-if (pos == string::npos) dir = "";
-else dir = path.substr(0, pos+1);
-
-if (!dir.empty()) {  
-    struct stat info;  
-    if (stat(dir.c_str(), &info) != 0) {  
-        if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {  
-            cerr << "mkdir failed: " << strerror(errno) << "\n";  
-            // continue; attempt to write anyway  
-        }  
-    }  
-}  
+// Atomic file writer: content is streamed into a temp file beside the target,
+// then commit() fsyncs it, renames it over the target and fsyncs the directory.
+// The temp name is unique per writer so concurrent writers never share one;
+// a writer destroyed without commit() removes its temp file.
+class AtomicFileWriter {
+public:
+    explicit AtomicFileWriter(const string &path) : path_(path) {
+        size_t pos = path.find_last_of('/');
+        dir_ = pos == string::npos ? "." : path.substr(0, pos + 1);
+        struct stat info;
+        if (stat(dir_.c_str(), &info) != 0 && mkdir(dir_.c_str(), 0777) != 0 && errno != EEXIST) {
+            cerr << "mkdir failed: " << strerror(errno) << "\n"; // attempt the open anyway
+        }
+        static atomic<uint64_t> seq(0);
+        tmp_ = path + ".tmp." + to_string(getpid()) + "." + to_string(seq.fetch_add(1, memory_order_relaxed));
+        fd_ = open(tmp_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) cerr << "Failed to open temp file for writing: " << tmp_ << " : " << strerror(errno) << "\n";
+    }
+    ~AtomicFileWriter() { abort(); }
+    AtomicFileWriter(const AtomicFileWriter &) = delete;
+    AtomicFileWriter &operator=(const AtomicFileWriter &) = delete;
 
-string tmp = path + ".tmp";  
-int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);  
-if (fd < 0) {  
-    cerr << "Failed to open temp file for writing: " << tmp << " : " << strerror(errno) << "\n";  
-    return false;  
-}  
-ssize_t written = write(fd, content.c_str(), content.size());  
-if (written < 0 || (size_t)written != content.size()) {  
-    cerr << "Failed to write entire content to temp file: " << tmp << " : " << strerror(errno) << "\n";  
-    close(fd);  
-    return false;  
-}  
-// flush to disk  
-if (fsync(fd) != 0) {  
-    cerr << "fsync failed on temp file: " << tmp << " : " << strerror(errno) << "\n";  
-}  
-close(fd);  
-if (rename(tmp.c_str(), path.c_str()) != 0) {  
-    cerr << "rename failed: " << strerror(errno) << "\n";  
-    // attempt to remove tmp  
-    unlink(tmp.c_str());  
-    return false;  
-}  
-return true;
+    bool ok() const { return fd_ >= 0; }
+    size_t size() const { return size_; }
 
-}
+    bool write(const char *data, size_t len) {
+        if (fd_ < 0) return false;
+        while (len > 0) {
+            ssize_t w = ::write(fd_, data, len);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                cerr << "Failed to write temp file: " << tmp_ << " : " << strerror(errno) << "\n";
+                abort();
+                return false;
+            }
+            data += w;
+            len -= (size_t)w;
+            size_ += (size_t)w;
+        }
+        return true;
+    }
 
-// ------------------- Storage (products & orders) using SQLite -------------------
+    bool commit() {
+        if (fd_ < 0) return false;
+        if (fsync(fd_) != 0) cerr << "fsync failed on temp file: " << tmp_ << " : " << strerror(errno) << "\n";
+        close(fd_);
+        fd_ = -1;
+        if (rename(tmp_.c_str(), path_.c_str()) != 0) {
+            cerr << "rename failed: " << strerror(errno) << "\n";
+            unlink(tmp_.c_str());
+            return false;
+        }
+        int dfd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0) { fsync(dfd); close(dfd); } // make the rename itself durable
+        return true;
+    }
 
-// Create DB and tables if not exist
-bool initDatabase() {
-string dbPath = ensureDataFolder("server.db");
-int rc = sqlite3_open(dbPath.c_str(), &g_db);
-if (rc != SQLITE_OK) {
-LOGE(string("Failed to open SQLite database: ") + sqlite3_errmsg(g_db));
-if (g_db) sqlite3_close(g_db);
-g_db = nullptr;
-return false;
-}
-const char *createSQL =
-"BEGIN;"
-"CREATE TABLE IF NOT EXISTS products ("
-"id TEXT PRIMARY KEY,"
-"title TEXT,"
-"price REAL,"
-"img TEXT,"
-"stock INTEGER"
-");"
-"CREATE TABLE IF NOT EXISTS orders ("
-"id TEXT PRIMARY KEY,"
-"product TEXT,"
-"name TEXT,"
-"contact TEXT,"
-"email TEXT,"
-"address TEXT,"
-"productPrice TEXT,"
-"deliveryCharges TEXT,"
-"totalAmount TEXT,"
-"payment TEXT,"
-"createdAt TEXT"
-");"
-"COMMIT;";
-char *err = nullptr;
-rc = sqlite3_exec(g_db, createSQL, nullptr, nullptr, &err);
-if (rc != SQLITE_OK) {
-LOGE(string("Failed to create tables: ") + (err ? err : "unknown"));
-if (err) sqlite3_free(err);
-return false;
-}
-// Enable WAL mode for better concurrency (best-effort)
-sqlite3_exec(g_db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
-return true;
-}
+    void abort() {
+        if (fd_ < 0) return;
+        close(fd_);
+        fd_ = -1;
+        unlink(tmp_.c_str());
+    }
 
-// Attempt to migrate existing text files into SQLite if tables are empty
-void migrateTextFilesIfNeeded() {
+private:
+    string path_, dir_, tmp_;
+    int fd_ = -1;
+    size_t size_ = 0;
+};
+
+bool atomicWriteFile(const string &path, const string &content) {
+    AtomicFileWriter out(path);
+    return out.write(content.data(), content.size()) && out.commit();
+}
+
+// ------------------- Product search index -------------------
+// Inverted index over product titles for /api/products/search. Terms are
+// lowercased alphanumeric runs (UTF-8 bytes count as word characters) kept in
+// an ordered map, so a query token matches every term it prefixes with one
+// lower_bound. Docs carry a copy of their product for filtering and output.
+// All access happens under g_storage_mutex, alongside `products`.
+struct SearchQuery {
+    string text;
+    double minPrice = -1;
+    double maxPrice = -1;
+    bool inStockOnly = false;
+    size_t limit = 20;
+};
+
+static void tokenizeTitle(string_view text, vector<string> &out) {
+    string cur;
+    for (unsigned char c : text) {
+        if (isalnum(c) || c >= 0x80) {
+            cur += (char)tolower(c);
+        } else if (!cur.empty()) {
+            out.push_back(move(cur));
+            cur.clear();
+        }
+    }
+    if (!cur.empty()) out.push_back(move(cur));
+}
+
+class ProductSearchIndex {
+public:
+    void rebuildLocked(const vector<Product> &all) {
+        postings_.clear();
+        docs_.clear();
+        byId_.clear();
+        for (auto &p : all) addLocked(p);
+    }
+
+    void addLocked(const Product &p) {
+        removeLocked(p.id);
+        uint32_t doc = (uint32_t)docs_.size();
+        docs_.push_back({p, {}, true});
+        tokenizeTitle(p.title, docs_.back().terms);
+        auto &terms = docs_.back().terms;
+        sort(terms.begin(), terms.end());
+        terms.erase(unique(terms.begin(), terms.end()), terms.end());
+        for (auto &t : terms) postings_[t].push_back(doc); // doc ids ascend, lists stay sorted
+        byId_[p.id] = doc;
+    }
+
+    void removeLocked(const string &productId) {
+        auto it = byId_.find(productId);
+        if (it == byId_.end()) return;
+        Doc &d = docs_[it->second];
+        for (auto &t : d.terms) {
+            auto pit = postings_.find(t);
+            if (pit == postings_.end()) continue;
+            auto &list = pit->second;
+            auto pos = lower_bound(list.begin(), list.end(), it->second);
+            if (pos != list.end() && *pos == it->second) list.erase(pos);
+            if (list.empty()) postings_.erase(pit);
+        }
+        d.live = false;
+        d.terms.clear();
+        byId_.erase(it);
+        // tombstones are reclaimed once they outnumber live docs
+        if (docs_.size() > 64 && byId_.size() < docs_.size() / 2) compactLocked();
+    }
+
+    // Every query token must prefix some title term. Scores favour exact
+    // terms and tokens that cover more of the term; ties go to shorter titles.
+    vector<const Product*> searchLocked(const SearchQuery &q, size_t &total) const {
+        vector<string> tokens;
+        tokenizeTitle(q.text, tokens);
+        vector<pair<double, uint32_t>> scored;
+        if (tokens.empty()) {
+            for (uint32_t d = 0; d < docs_.size(); ++d) if (docs_[d].live) scored.push_back({0.0, d});
+        } else {
+            struct Hit { size_t matched = 0; double score = 0, best = 0; };
+            unordered_map<uint32_t, Hit> hits;
+            for (size_t ti = 0; ti < tokens.size(); ++ti) {
+                const string &tok = tokens[ti];
+                for (auto it = postings_.lower_bound(tok); it != postings_.end() && it->first.compare(0, tok.size(), tok) == 0; ++it) {
+                    double w = it->first.size() == tok.size() ? 2.0 : (double)tok.size() / (double)it->first.size();
+                    for (uint32_t d : it->second) {
+                        if (ti > 0 && !hits.count(d)) continue; // missed an earlier token
+                        Hit &h = hits[d];
+                        if (h.matched == ti) {               // first term matching this token
+                            h.matched = ti + 1;
+                            h.best = w;
+                            h.score += w;
+                        } else if (h.matched == ti + 1 && w > h.best) { // a better term for the same token
+                            h.score += w - h.best;
+                            h.best = w;
+                        }
+                    }
+                }
+            }
+            for (auto &h : hits) if (h.second.matched == tokens.size()) scored.push_back({h.second.score, h.first});
+        }
+
+        vector<pair<double, uint32_t>> kept;
+        kept.reserve(scored.size());
+        for (auto &sd : scored) {
+            const Product &p = docs_[sd.second].product;
+            if (q.minPrice >= 0 && p.price < q.minPrice) continue;
+            if (q.maxPrice >= 0 && p.price > q.maxPrice) continue;
+            if (q.inStockOnly && p.stock <= 0) continue;
+            kept.push_back(sd);
+        }
+        total = kept.size();
+        auto better = [this](const pair<double, uint32_t> &a, const pair<double, uint32_t> &b) {
+            if (a.first != b.first) return a.first > b.first;
+            const Product &pa = docs_[a.second].product, &pb = docs_[b.second].product;
+            if (pa.title.size() != pb.title.size()) return pa.title.size() < pb.title.size();
+            return pa.id < pb.id;
+        };
+        size_t n = min(q.limit, kept.size());
+        partial_sort(kept.begin(), kept.begin() + n, kept.end(), better);
+        vector<const Product*> out;
+        out.reserve(n);
+        for (size_t i = 0; i < n; ++i) out.push_back(&docs_[kept[i].second].product);
+        return out;
+    }
+
+private:
+    struct Doc {
+        Product product;
+        vector<string> terms;
+        bool live;
+    };
+
+    void compactLocked() {
+        vector<Product> live;
+        live.reserve(byId_.size());
+        for (auto &d : docs_) if (d.live) live.push_back(move(d.product));
+        rebuildLocked(live);
+    }
+
+    map<string, vector<uint32_t>> postings_;
+    vector<Doc> docs_;
+    unordered_map<string, uint32_t> byId_;
+};
+
+static ProductSearchIndex g_product_index;
+
+// ------------------- Sales aggregates -------------------
+// Running totals behind /api/stats, so the dashboard never walks every order.
+// Each order is folded in once as it is appended (locally or by a replica
+// refresh) and the whole set is rebuilt when orders are loaded at startup.
+// Amounts are kept in integer cents. Per-product figures come from the order's
+// "Title (RS.price) xqty, ..." summary, so products are keyed by title.
+struct SalesBucket {
+    uint64_t orders = 0;
+    int64_t revenueCents = 0;
+};
+
+struct ProductSales {
+    string title;
+    uint64_t orders = 0;
+    uint64_t units = 0;
+    int64_t revenueCents = 0;
+};
+
+struct SalesSnapshot {
+    SalesBucket total;
+    vector<pair<string, SalesBucket>> daily;   // oldest first
+    vector<pair<string, SalesBucket>> weekly;  // oldest first
+    vector<ProductSales> products;             // highest revenue first
+    size_t productCount = 0;
+};
+
+static int64_t parseCents(string_view s) {
+    s = trimView(s);
+    bool neg = !s.empty() && s[0] == '-';
+    if (neg) s.remove_prefix(1);
+    int64_t whole = 0, frac = 0;
+    int fracDigits = 0;
+    size_t i = 0;
+    for (; i < s.size() && isdigit((unsigned char)s[i]); ++i) whole = whole * 10 + (s[i] - '0');
+    if (i < s.size() && s[i] == '.') {
+        for (++i; i < s.size() && isdigit((unsigned char)s[i]) && fracDigits < 2; ++i, ++fracDigits) frac = frac * 10 + (s[i] - '0');
+    }
+    if (fracDigits == 1) frac *= 10;
+    int64_t cents = whole * 100 + frac;
+    return neg ? -cents : cents;
+}
+
+// "2024-05-17T..." -> day "2024-05-17" and ISO week "2024-W20"
+static bool salesBucketKeys(const string &createdAt, string &day, string &week) {
+    int y, m, d;
+    if (createdAt.size() < 10 || sscanf(createdAt.c_str(), "%4d-%2d-%2d", &y, &m, &d) != 3) return false;
+    tm t{};
+    t.tm_year = y - 1900;
+    t.tm_mon = m - 1;
+    t.tm_mday = d;
+    t.tm_hour = 12;
+    time_t ts = timegm(&t);
+    long long days = (long long)ts / 86400;
+    int weekday = (int)((days + 3) % 7);          // 1970-01-01 was a Thursday; Monday = 0
+    time_t thursday = (time_t)((days - weekday + 3) * 86400 + 43200);
+    tm th;
+    gmtime_r(&thursday, &th);                     // the ISO year is the year of that week's Thursday
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%04d-W%02d", th.tm_year + 1900, th.tm_yday / 7 + 1);
+    day.assign(createdAt, 0, 10);
+    week = buf;
+    return true;
+}
+
+class SalesStats {
+public:
+    void rebuild(const vector<Order> &all) {
+        lock_guard<mutex> lock(mtx_);
+        total_ = {};
+        lastDayKey_.clear();
+        daily_.clear();
+        weekly_.clear();
+        products_.clear();
+        for (auto &o : all) addLocked(o);
+    }
+
+    void add(const Order &o) {
+        lock_guard<mutex> lock(mtx_);
+        addLocked(o);
+    }
+
+    SalesSnapshot snapshot(size_t days, size_t weeks, size_t top) {
+        SalesSnapshot s;
+        lock_guard<mutex> lock(mtx_);
+        s.total = total_;
+        tail(daily_, days, s.daily);
+        tail(weekly_, weeks, s.weekly);
+        s.productCount = products_.size();
+        vector<const ProductSales*> ranked;
+        ranked.reserve(products_.size());
+        for (auto &kv : products_) ranked.push_back(&kv.second);
+        size_t n = min(top, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(), [](const ProductSales *a, const ProductSales *b) {
+            if (a->revenueCents != b->revenueCents) return a->revenueCents > b->revenueCents;
+            return a->title < b->title;
+        });
+        for (size_t i = 0; i < n; ++i) s.products.push_back(*ranked[i]);
+        return s;
+    }
+
+private:
+    void addLocked(const Order &o) {
+        int64_t cents = parseCents(o.totalAmount);
+        bump(total_, cents);
+        // orders mostly arrive in date order, so the previous day's buckets usually match
+        if (!lastDayKey_.empty() && o.createdAt.compare(0, lastDayKey_.size(), lastDayKey_) == 0) {
+            bump(*lastDay_, cents);
+            bump(*lastWeek_, cents);
+        } else {
+            string day, week;
+            if (salesBucketKeys(o.createdAt, day, week)) {
+                lastDay_ = &daily_[day];
+                lastWeek_ = &weekly_[week];
+                lastDayKey_ = move(day);
+                bump(*lastDay_, cents);
+                bump(*lastWeek_, cents);
+            }
+        }
+        // Items are "Title (RS.12.00) x2" joined by ", "; titles may contain commas
+        string_view rest = o.product;
+        while (!rest.empty()) {
+            size_t open = rest.find(" (RS.");
+            if (open == string_view::npos) break;
+            size_t close = rest.find(") x", open);
+            if (close == string_view::npos) break;
+            size_t q = close + 3, qEnd = q;
+            while (qEnd < rest.size() && isdigit((unsigned char)rest[qEnd])) ++qEnd;
+            uint64_t qty = 0;
+            from_chars(rest.data() + q, rest.data() + qEnd, qty);
+            string_view title = rest.substr(0, open);
+            ProductSales &p = products_[string(title)];
+            if (p.title.empty()) p.title = string(title);
+            p.orders++;
+            p.units += qty;
+            p.revenueCents += parseCents(rest.substr(open + 5, close - open - 5)) * (int64_t)qty;
+            rest.remove_prefix(qEnd);
+            if (rest.substr(0, 2) == ", ") rest.remove_prefix(2);
+        }
+    }
+
+    static void bump(SalesBucket &b, int64_t cents) {
+        b.orders++;
+        b.revenueCents += cents;
+    }
+
+    static void tail(const map<string, SalesBucket> &m, size_t n, vector<pair<string, SalesBucket>> &out) {
+        auto it = m.end();
+        for (size_t i = 0; i < n && it != m.begin(); ++i) --it;
+        out.assign(it, m.end());
+    }
+
+    mutex mtx_;  // taken after g_storage_mutex when both are held
+    SalesBucket total_;
+    map<string, SalesBucket> daily_;   // keys sort chronologically
+    map<string, SalesBucket> weekly_;
+    string lastDayKey_;                // buckets of the last day seen (map nodes don't move)
+    SalesBucket *lastDay_ = nullptr;
+    SalesBucket *lastWeek_ = nullptr;
+    unordered_map<string, ProductSales> products_;
+};
+
+static SalesStats g_sales_stats;
+
+// ------------------- Storage (products & orders) -------------------
+// Persistence sits behind the Storage interface: SQLite in DATA_DIR by
+// default, or a shared PostgreSQL database with STORAGE=postgres (built
+// WITH_POSTGRES). The products/orders vectors stay the read path; backends
+// only see writes, startup loads and, when replicas share a database, the
+// periodic refresh. Backends synchronise internally, and a call may block on
+// the network, so callers do not hold g_storage_mutex across one.
+
+// A completed idempotency key as persisted next to its order
+struct IdempotencyRecord {
+    string key;
+    uint64_t bodyHash = 0;
+    string status;
+    string response;
+    time_t expires = 0;
+};
+
+enum StoreResult { STORE_OK, STORE_DUPLICATE_KEY, STORE_FAILED };
+
+// Order columns in table order; backends bind and read rows through this
+static string Order::* const ORDER_COLUMNS[] = {
+    &Order::id, &Order::product, &Order::name, &Order::contact, &Order::email, &Order::address,
+    &Order::productPrice, &Order::deliveryCharges, &Order::totalAmount, &Order::payment, &Order::createdAt,
+};
+static const int ORDER_COLUMN_COUNT = sizeof(ORDER_COLUMNS) / sizeof(ORDER_COLUMNS[0]);
+
+class Storage {
+public:
+    virtual ~Storage() {}
+    virtual const char *name() const = 0;
+    // true when other processes write the same data (refresh from it)
+    virtual bool shared() const { return false; }
+
+    virtual bool loadProducts(vector<Product> &out) = 0;
+    virtual bool loadOrders(vector<Order> &out) = 0;
+    // orders whose O<n> id is above afterSeq, for refreshing a replica
+    virtual bool loadOrdersAfter(long long afterSeq, vector<Order> &out) = 0;
+    // products plus new orders in one go; backends may batch the two reads
+    virtual bool loadChanges(vector<Product> &productsOut, long long afterSeq, vector<Order> &ordersOut) {
+        return loadProducts(productsOut) && loadOrdersAfter(afterSeq, ordersOut);
+    }
+    virtual long long countRows(const char *table) = 0;
+
+    virtual bool upsertProduct(const Product &p) = 0;
+    virtual bool deleteProduct(const string &id) = 0;
+    virtual bool updateProductImage(const string &id, const string &img) = 0;
+    // Inserts the order and, if given, its idempotency key in one
+    // transaction. A live key already in the table gives STORE_DUPLICATE_KEY
+    // and no order row.
+    virtual StoreResult insertOrder(const Order &o, const IdempotencyRecord *key) = 0;
+    // Bulk replace of a whole table (text-file migration, benchmarks)
+    virtual bool replaceProducts(const vector<Product> &rows) = 0;
+    virtual bool replaceOrders(const vector<Order> &rows) = 0;
+    // Bulk insert-or-overwrite by id in one transaction (--import)
+    virtual bool upsertProducts(const vector<Product> &rows) = 0;
+    virtual bool upsertOrders(const vector<Order> &rows) = 0;
+
+    // Drops expired keys and returns the rest
+    virtual bool loadIdempotencyKeys(time_t now, vector<IdempotencyRecord> &out) = 0;
+    virtual bool findIdempotencyKey(const string &key, IdempotencyRecord &out) = 0;
+    virtual bool findOrder(const string &id, Order &out) = 0;
+    // Streams orders with createdAt in [from, to] in insertion order, one row
+    // at a time. Either bound may be empty; `to` compares by prefix, so a
+    // bare date includes that whole day. onRow returns false to stop early.
+    // True only if every row was delivered.
+    virtual bool scanOrders(const string &from, const string &to, const function<bool(const Order&)> &onRow) = 0;
+
+    // Online copy of the database to path, pagesPerStep pages at a time with
+    // pauseMs between batches. Backends that are backed up by their own
+    // tooling (PostgreSQL) leave canBackup() false.
+    virtual bool canBackup() const { return false; }
+    virtual bool backupTo(const string &, int, int, const atomic<bool> &) { return false; }
+
+    // Token naming the startup snapshot that matches the stored data; empty
+    // if there is none. Only single-process backends keep one.
+    virtual string readSnapshotToken() { return ""; }
+    virtual bool writeSnapshotToken(const string &) { return false; }
+
+    // Next numeric part of a 'p' (product) or 'O' (order) id; <= 0 on failure
+    virtual long long nextId(char kind) = 0;
+};
+
+static unique_ptr<Storage> g_storage;
+static string g_storage_kind = "sqlite"; // STORAGE=sqlite|postgres
+
+// ------------------- SQLite storage -------------------
+// Writes go through one connection (g_db); db_mutex_ keeps its transactions
+// from interleaving. Reads use a read-only connection per calling thread,
+// opened on first use, so under WAL they run in parallel with each other and
+// with the writer instead of queueing behind checkout inserts.
+#define INSERT_PRODUCT_SQL "INSERT INTO products (id, title, price, img, stock) VALUES (?, ?, ?, ?, ?)"
+#define INSERT_ORDER_SQL "INSERT INTO orders " \
+    "(id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt) " \
+    "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
+class SqliteStorage : public Storage {
+public:
+    const char *name() const override { return "sqlite"; }
+
+    bool open() {
+        dbPath_ = ensureDataFolder("server.db");
+        int rc = sqlite3_open(dbPath_.c_str(), &g_db);
+        if (rc != SQLITE_OK) {
+            LOGE(string("Failed to open SQLite database: ") + sqlite3_errmsg(g_db));
+            if (g_db) sqlite3_close(g_db);
+            g_db = nullptr;
+            return false;
+        }
+        const char *createSQL =
+            "BEGIN;"
+            "CREATE TABLE IF NOT EXISTS products ("
+            "id TEXT PRIMARY KEY,"
+            "title TEXT,"
+            "price REAL,"
+            "img TEXT,"
+            "stock INTEGER"
+            ");"
+            "CREATE TABLE IF NOT EXISTS orders ("
+            "id TEXT PRIMARY KEY,"
+            "product TEXT,"
+            "name TEXT,"
+            "contact TEXT,"
+            "email TEXT,"
+            "address TEXT,"
+            "productPrice TEXT,"
+            "deliveryCharges TEXT,"
+            "totalAmount TEXT,"
+            "payment TEXT,"
+            "createdAt TEXT"
+            ");"
+            "CREATE TABLE IF NOT EXISTS idempotency_keys ("
+            "key TEXT PRIMARY KEY,"
+            "body_hash INTEGER,"
+            "status TEXT,"
+            "response TEXT,"
+            "expires_at INTEGER"
+            ");"
+            "CREATE TABLE IF NOT EXISTS meta ("
+            "key TEXT PRIMARY KEY,"
+            "value TEXT"
+            ");"
+            "COMMIT;";
+        char *err = nullptr;
+        rc = sqlite3_exec(g_db, createSQL, nullptr, nullptr, &err);
+        if (rc != SQLITE_OK) {
+            LOGE(string("Failed to create tables: ") + (err ? err : "unknown"));
+            if (err) sqlite3_free(err);
+            return false;
+        }
+        // WAL lets the reader connections see committed data without blocking the writer
+        sqlite3_exec(g_db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+        sqlite3_busy_timeout(g_db, 5000);
+        return true;
+    }
+
+    ~SqliteStorage() override {
+        lock_guard<mutex> lock(readers_mutex_);
+        for (sqlite3 *r : readers_) sqlite3_close(r);
+        g_sqlite_readers.fetch_sub((int64_t)readers_.size(), memory_order_relaxed);
+        if (g_db) sqlite3_close(g_db);
+        g_db = nullptr;
+    }
+
+    bool loadProducts(vector<Product> &out) override {
+        Reader db(*this);
+        Stmt stmt(db, "SELECT id, title, price, img, stock FROM products ORDER BY id;");
+        if (!stmt) return false;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            Product p;
+            p.id = text(stmt, 0);
+            p.title = text(stmt, 1);
+            p.price = sqlite3_column_double(stmt, 2);
+            p.img = text(stmt, 3);
+            p.stock = sqlite3_column_int(stmt, 4);
+            out.push_back(move(p));
+        }
+        return true;
+    }
+
+    bool loadOrders(vector<Order> &out) override {
+        Reader db(*this);
+        Stmt stmt(db, "SELECT id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt FROM orders ORDER BY id;");
+        if (!stmt) return false;
+        while (sqlite3_step(stmt) == SQLITE_ROW) out.push_back(readOrder(stmt));
+        return true;
+    }
+
+    bool loadOrdersAfter(long long afterSeq, vector<Order> &out) override {
+        Reader db(*this);
+        Stmt stmt(db, "SELECT id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt "
+                  "FROM orders WHERE id GLOB 'O[0-9]*' AND CAST(substr(id, 2) AS INTEGER) > ? ORDER BY CAST(substr(id, 2) AS INTEGER);");
+        if (!stmt) return false;
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)afterSeq);
+        while (sqlite3_step(stmt) == SQLITE_ROW) out.push_back(readOrder(stmt));
+        return true;
+    }
+
+    long long countRows(const char *table) override {
+        Reader db(*this);
+        Stmt stmt(db, string("SELECT COUNT(*) FROM ") + table + ";");
+        return stmt && sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    }
+
+    bool upsertProduct(const Product &p) override {
+        lock_guard<mutex> lock(db_mutex_);
+        Stmt stmt("INSERT OR REPLACE INTO products (id, title, price, img, stock) VALUES (?, ?, ?, ?, ?);");
+        return stmt && bindProduct(stmt, p) && step(stmt, "upsert product");
+    }
+
+    bool deleteProduct(const string &id) override {
+        lock_guard<mutex> lock(db_mutex_);
+        Stmt stmt("DELETE FROM products WHERE id = ?;");
+        if (!stmt) return false;
+        sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+        return step(stmt, "delete product");
+    }
+
+    bool updateProductImage(const string &id, const string &img) override {
+        lock_guard<mutex> lock(db_mutex_);
+        Stmt stmt("UPDATE products SET img = ? WHERE id = ?;");
+        if (!stmt) return false;
+        sqlite3_bind_text(stmt, 1, img.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, id.c_str(), -1, SQLITE_TRANSIENT);
+        return step(stmt, "update product image");
+    }
+
+    StoreResult insertOrder(const Order &o, const IdempotencyRecord *key) override {
+        lock_guard<mutex> lock(db_mutex_);
+        auto commitStart = chrono::steady_clock::now();
+        if (!key) {
+            Stmt stmt(INSERT_ORDER_SQL);
+            bool ok = stmt && bindOrder(stmt, o) && step(stmt, "insert order " + o.id);
+            observeSqliteCommit(commitStart);
+            return ok ? STORE_OK : STORE_FAILED;
+        }
+        sqlite3_exec(g_db, "BEGIN;", nullptr, nullptr, nullptr);
+        StoreResult result = STORE_FAILED;
+        {
+            Stmt expired("DELETE FROM idempotency_keys WHERE key = ? AND expires_at <= ?;");
+            Stmt keyInsert("INSERT INTO idempotency_keys (key, body_hash, status, response, expires_at) VALUES (?, ?, ?, ?, ?);");
+            Stmt orderInsert(INSERT_ORDER_SQL);
+            if (expired && keyInsert && orderInsert) {
+                sqlite3_bind_text(expired, 1, key->key.c_str(), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int64(expired, 2, (sqlite3_int64)time(nullptr));
+                bindIdempotencyKey(keyInsert, *key);
+                bindOrder(orderInsert, o);
+                if (step(expired, "expire idempotency key")) {
+                    int rc = sqlite3_step(keyInsert);
+                    if (rc == SQLITE_CONSTRAINT) result = STORE_DUPLICATE_KEY;
+                    else if (rc != SQLITE_DONE) LOGE(string("Failed to store idempotency key: ") + sqlite3_errmsg(g_db));
+                    else if (step(orderInsert, "insert order " + o.id)) result = STORE_OK;
+                }
+            }
+        }
+        sqlite3_exec(g_db, result == STORE_OK ? "COMMIT;" : "ROLLBACK;", nullptr, nullptr, nullptr);
+        observeSqliteCommit(commitStart);
+        return result;
+    }
+
+    bool replaceProducts(const vector<Product> &rows) override {
+        return writeRows("DELETE FROM products;", INSERT_PRODUCT_SQL, rows, bindProduct, "product");
+    }
+
+    bool replaceOrders(const vector<Order> &rows) override {
+        return writeRows("DELETE FROM orders;", INSERT_ORDER_SQL, rows, bindOrder, "order");
+    }
+
+    // ON CONFLICT ... DO UPDATE keeps the rowid, so exports keep their order
+    bool upsertProducts(const vector<Product> &rows) override {
+        return writeRows(nullptr, INSERT_PRODUCT_SQL
+                         " ON CONFLICT(id) DO UPDATE SET title = excluded.title, price = excluded.price,"
+                         " img = excluded.img, stock = excluded.stock;", rows, bindProduct, "product");
+    }
+
+    bool upsertOrders(const vector<Order> &rows) override {
+        return writeRows(nullptr, INSERT_ORDER_SQL
+                         " ON CONFLICT(id) DO UPDATE SET product = excluded.product, name = excluded.name,"
+                         " contact = excluded.contact, email = excluded.email, address = excluded.address,"
+                         " productPrice = excluded.productPrice, deliveryCharges = excluded.deliveryCharges,"
+                         " totalAmount = excluded.totalAmount, payment = excluded.payment, createdAt = excluded.createdAt;",
+                         rows, bindOrder, "order");
+    }
+
+    bool loadIdempotencyKeys(time_t now, vector<IdempotencyRecord> &out) override {
+        lock_guard<mutex> lock(db_mutex_);
+        {
+            Stmt expired("DELETE FROM idempotency_keys WHERE expires_at <= ?;");
+            if (expired) {
+                sqlite3_bind_int64(expired, 1, (sqlite3_int64)now);
+                sqlite3_step(expired);
+            }
+        }
+        Stmt stmt("SELECT key, body_hash, status, response, expires_at FROM idempotency_keys;");
+        if (!stmt) return false;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) continue;
+            out.push_back(readIdempotencyKey(stmt));
+        }
+        return true;
+    }
+
+    bool findIdempotencyKey(const string &key, IdempotencyRecord &out) override {
+        Reader db(*this);
+        Stmt stmt(db, "SELECT key, body_hash, status, response, expires_at FROM idempotency_keys WHERE key = ?;");
+        if (!stmt) return false;
+        sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_ROW) return false;
+        out = readIdempotencyKey(stmt);
+        return true;
+    }
+
+    bool findOrder(const string &id, Order &out) override {
+        Reader db(*this);
+        Stmt stmt(db, "SELECT id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt FROM orders WHERE id = ?;");
+        if (!stmt) return false;
+        sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_ROW) return false;
+        out = readOrder(stmt);
+        return true;
+    }
+
+    // Runs on this thread's read connection, so the export reads one WAL
+    // snapshot while checkout keeps writing
+    bool scanOrders(const string &from, const string &to, const function<bool(const Order&)> &onRow) override {
+        Reader db(*this);
+        Stmt stmt(db, "SELECT id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt "
+                  "FROM orders WHERE (?1 = '' OR createdAt >= ?1) AND (?2 = '' OR substr(createdAt, 1, length(?2)) <= ?2) ORDER BY rowid;");
+        if (!stmt) return false;
+        sqlite3_bind_text(stmt, 1, from.c_str(), (int)from.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, to.c_str(), (int)to.size(), SQLITE_TRANSIENT);
+        Order o; // reused, so its strings keep their capacity between rows
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            for (int i = 0; i < ORDER_COLUMN_COUNT; ++i) {
+                const unsigned char *t = sqlite3_column_text(stmt, i);
+                (o.*ORDER_COLUMNS[i]).assign(t ? (const char*)t : "", t ? (size_t)sqlite3_column_bytes(stmt, i) : 0);
+            }
+            if (!onRow(o)) return false;
+        }
+        if (rc != SQLITE_DONE) LOGE(string("Failed to scan orders: ") + sqlite3_errmsg(db));
+        return rc == SQLITE_DONE;
+    }
+
+    bool canBackup() const override { return true; }
+
+    string readSnapshotToken() override {
+        Reader db(*this);
+        Stmt stmt(db, "SELECT value FROM meta WHERE key = 'snapshot_token';");
+        return stmt && sqlite3_step(stmt) == SQLITE_ROW ? text(stmt, 0) : "";
+    }
+
+    bool writeSnapshotToken(const string &token) override {
+        lock_guard<mutex> lock(db_mutex_);
+        Stmt stmt(token.empty() ? "DELETE FROM meta WHERE key = 'snapshot_token';"
+                                : "INSERT OR REPLACE INTO meta (key, value) VALUES ('snapshot_token', ?);");
+        if (!stmt) return false;
+        if (!token.empty()) sqlite3_bind_text(stmt, 1, token.c_str(), -1, SQLITE_TRANSIENT);
+        return step(stmt, "store snapshot token");
+    }
+
+    // The source is a private read connection holding one read transaction
+    // for the whole copy. Under WAL that pins a snapshot: commits carry on
+    // and do not force the backup to restart, while the pauses between
+    // batches keep the extra I/O away from request latency.
+    bool backupTo(const string &path, int pagesPerStep, int pauseMs, const atomic<bool> &cancel) override {
+        sqlite3 *src = nullptr, *dst = nullptr;
+        int rc = sqlite3_open_v2(dbPath_.c_str(), &src, SQLITE_OPEN_READONLY, nullptr);
+        if (rc == SQLITE_OK) rc = sqlite3_open(path.c_str(), &dst);
+        if (rc == SQLITE_OK) {
+            sqlite3_busy_timeout(src, 5000);
+            rc = sqlite3_exec(src, "BEGIN; SELECT count(*) FROM sqlite_master;", nullptr, nullptr, nullptr);
+        }
+        if (rc == SQLITE_OK) {
+            sqlite3_backup *backup = sqlite3_backup_init(dst, "main", src, "main");
+            rc = backup ? SQLITE_OK : sqlite3_errcode(dst);
+            while (backup && !cancel.load(memory_order_relaxed)) {
+                rc = sqlite3_backup_step(backup, max(1, pagesPerStep));
+                if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) break;
+                if (pauseMs > 0) this_thread::sleep_for(chrono::milliseconds(pauseMs));
+            }
+            if (backup) sqlite3_backup_finish(backup);
+        }
+        if (rc != SQLITE_DONE && !cancel.load()) {
+            LOGE("SQLite backup to " + path + " failed: " + sqlite3_errstr(rc));
+        }
+        if (src) sqlite3_exec(src, "COMMIT;", nullptr, nullptr, nullptr);
+        sqlite3_close(src);
+        sqlite3_close(dst);
+        return rc == SQLITE_DONE;
+    }
+
+    // Ids come from the counters loadProducts/loadOrders seed from existing rows
+    long long nextId(char kind) override {
+        lock_guard<mutex> lock(g_storage_mutex);
+        return kind == 'O' ? ++currentOrderID : ++currentProductID;
+    }
+
+private:
+    // This thread's read-only connection, or the writer (under db_mutex_) if
+    // one cannot be opened. Readers are closed with the storage; the
+    // generation check makes a thread open a fresh one after a reopen.
+    class Reader {
+    public:
+        explicit Reader(SqliteStorage &s) : db_(s.threadReader()) {
+            if (!db_) {
+                fallback_ = unique_lock<mutex>(s.db_mutex_);
+                db_ = g_db;
+            }
+        }
+        operator sqlite3 *() const { return db_; }
+    private:
+        sqlite3 *db_;
+        unique_lock<mutex> fallback_;
+    };
+
+    sqlite3 *threadReader() {
+        static thread_local uint64_t t_generation = 0;
+        static thread_local sqlite3 *t_reader = nullptr;
+        if (t_reader && t_generation == generation_) return t_reader;
+        t_reader = nullptr;
+        sqlite3 *db = nullptr;
+        if (sqlite3_open_v2(dbPath_.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+            LOGW(string("Failed to open SQLite read connection: ") + (db ? sqlite3_errmsg(db) : "out of memory"));
+            sqlite3_close(db);
+            return nullptr;
+        }
+        sqlite3_busy_timeout(db, 5000);
+        {
+            lock_guard<mutex> lock(readers_mutex_);
+            readers_.push_back(db);
+        }
+        g_sqlite_readers.fetch_add(1, memory_order_relaxed);
+        t_generation = generation_;
+        t_reader = db;
+        return db;
+    }
+
+    static uint64_t nextGeneration() {
+        static atomic<uint64_t> counter(0);
+        return counter.fetch_add(1, memory_order_relaxed) + 1;
+    }
+
+    // Prepared statement finalized on scope exit; converts to false if prepare failed
+    struct Stmt {
+        sqlite3_stmt *s = nullptr;
+        explicit Stmt(const string &sql) : Stmt(g_db, sql) {}
+        Stmt(sqlite3 *db, const string &sql) {
+            if (db && sqlite3_prepare_v2(db, sql.c_str(), -1, &s, nullptr) != SQLITE_OK) {
+                LOGE(string("Failed to prepare statement: ") + sqlite3_errmsg(db));
+                s = nullptr;
+            }
+        }
+        ~Stmt() { sqlite3_finalize(s); }
+        operator sqlite3_stmt *() const { return s; }
+        explicit operator bool() const { return s != nullptr; }
+    };
+
+    // One transaction: optional clearSql, then insertSql for every row
+    template <class Row>
+    bool writeRows(const char *clearSql, const char *insertSql, const vector<Row> &rows,
+                   bool (*bind)(sqlite3_stmt*, const Row&), const char *what) {
+        lock_guard<mutex> lock(db_mutex_);
+        sqlite3_exec(g_db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
+        if (clearSql) sqlite3_exec(g_db, clearSql, nullptr, nullptr, nullptr);
+        bool ok = false;
+        {
+            Stmt stmt(insertSql);
+            if (stmt) {
+                ok = true;
+                for (size_t i = 0; ok && i < rows.size(); ++i) {
+                    bind(stmt, rows[i]);
+                    ok = step(stmt, string("insert ") + what + " " + rows[i].id);
+                    sqlite3_reset(stmt);
+                }
+            } else {
+                LOGE(string("Failed to prepare insert into ") + what + "s");
+            }
+        }
+        auto commitStart = chrono::steady_clock::now();
+        sqlite3_exec(g_db, ok ? "COMMIT;" : "ROLLBACK;", nullptr, nullptr, nullptr);
+        observeSqliteCommit(commitStart);
+        return ok;
+    }
+
+    static bool step(sqlite3_stmt *stmt, const string &what) {
+        if (sqlite3_step(stmt) == SQLITE_DONE) return true;
+        LOGE("Failed to " + what + ": " + sqlite3_errmsg(g_db));
+        return false;
+    }
+
+    static string text(sqlite3_stmt *stmt, int col) {
+        const unsigned char *t = sqlite3_column_text(stmt, col);
+        return t ? (const char*)t : "";
+    }
+
+    static bool bindProduct(sqlite3_stmt *stmt, const Product &p) {
+        sqlite3_bind_text(stmt, 1, p.id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, p.title.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_double(stmt, 3, p.price);
+        sqlite3_bind_text(stmt, 4, p.img.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 5, p.stock);
+        return true;
+    }
+
+    static bool bindOrder(sqlite3_stmt *stmt, const Order &o) {
+        for (int i = 0; i < ORDER_COLUMN_COUNT; ++i) {
+            const string &v = o.*ORDER_COLUMNS[i];
+            sqlite3_bind_text(stmt, i + 1, v.c_str(), (int)v.size(), SQLITE_TRANSIENT);
+        }
+        return true;
+    }
+
+    static Order readOrder(sqlite3_stmt *stmt) {
+        Order o;
+        for (int i = 0; i < ORDER_COLUMN_COUNT; ++i) o.*ORDER_COLUMNS[i] = text(stmt, i);
+        return o;
+    }
+
+    static void bindIdempotencyKey(sqlite3_stmt *stmt, const IdempotencyRecord &r) {
+        sqlite3_bind_text(stmt, 1, r.key.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)r.bodyHash);
+        sqlite3_bind_text(stmt, 3, r.status.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, r.response.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 5, (sqlite3_int64)r.expires);
+    }
+
+    static IdempotencyRecord readIdempotencyKey(sqlite3_stmt *stmt) {
+        IdempotencyRecord r;
+        r.key = text(stmt, 0);
+        r.bodyHash = (uint64_t)sqlite3_column_int64(stmt, 1);
+        r.status = sqlite3_column_type(stmt, 2) == SQLITE_NULL ? "200 OK" : text(stmt, 2);
+        r.response = text(stmt, 3);
+        r.expires = (time_t)sqlite3_column_int64(stmt, 4);
+        return r;
+    }
+
+    string dbPath_;
+    const uint64_t generation_ = nextGeneration();
+    mutex db_mutex_;
+    mutex readers_mutex_;
+    vector<sqlite3*> readers_;
+};
+#undef INSERT_PRODUCT_SQL
+#undef INSERT_ORDER_SQL
+
+#ifdef WITH_POSTGRES
+// ------------------- PostgreSQL storage -------------------
+// A fixed pool of connections, each with every statement prepared once.
+// Multi-statement writes are pipelined: the statements go out back to back
+// and run in the pipeline's implicit transaction, so an order plus its
+// idempotency key costs one round trip and an error rolls back both. Bulk
+// replaces stream rows with COPY. Ids come from sequences so replicas never
+// hand out the same one.
+class PgPool {
+public:
+    struct Statement { const char *name; const char *sql; int params; };
+
+    ~PgPool() { for (PGconn *c : all_) PQfinish(c); }
+
+    bool open(const vector<pair<string, string>> &params, int size, vector<Statement> statements) {
+        params_ = params;
+        statements_ = move(statements);
+        for (int i = 0; i < size; ++i) {
+            PGconn *c = connect();
+            if (!c) return false;
+            all_.push_back(c);
+            idle_.push_back(c);
+        }
+        return true;
+    }
+
+    // Borrows a connection, waiting up to five seconds; returns it on scope exit
+    class Lease {
+    public:
+        explicit Lease(PgPool &pool) : pool_(pool), conn_(pool.acquire()) {}
+        ~Lease() { if (conn_) pool_.release(conn_); }
+        PGconn *get() const { return conn_; }
+        explicit operator bool() const { return conn_ != nullptr; }
+    private:
+        PgPool &pool_;
+        PGconn *conn_;
+    };
+
+    // Re-opens a dropped connection and prepares its statements again
+    bool reconnect(PGconn *c) {
+        PQreset(c);
+        return PQstatus(c) == CONNECTION_OK && prepare(c);
+    }
+
+private:
+    PGconn *connect() {
+        vector<const char*> keys, values;
+        for (auto &kv : params_) { keys.push_back(kv.first.c_str()); values.push_back(kv.second.c_str()); }
+        keys.push_back(nullptr);
+        values.push_back(nullptr);
+        PGconn *c = PQconnectdbParams(keys.data(), values.data(), 0);
+        if (PQstatus(c) != CONNECTION_OK) {
+            LOGE(string("PostgreSQL connection failed: ") + PQerrorMessage(c));
+            PQfinish(c);
+            return nullptr;
+        }
+        if (!prepare(c)) {
+            PQfinish(c);
+            return nullptr;
+        }
+        return c;
+    }
+
+    bool prepare(PGconn *c) {
+        for (auto &s : statements_) {
+            PGresult *r = PQprepare(c, s.name, s.sql, s.params, nullptr);
+            bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+            if (!ok) LOGE(string("Failed to prepare ") + s.name + ": " + PQresultErrorMessage(r));
+            PQclear(r);
+            if (!ok) return false;
+        }
+        return true;
+    }
+
+    PGconn *acquire() {
+        unique_lock<mutex> lock(m_);
+        if (!cv_.wait_for(lock, chrono::seconds(5), [this]{ return !idle_.empty(); })) {
+            LOGE("Timed out waiting for a PostgreSQL connection");
+            return nullptr;
+        }
+        PGconn *c = idle_.back();
+        idle_.pop_back();
+        return c;
+    }
+
+    // A connection that dropped is reset before it goes back, so the next
+    // borrower gets a working one
+    void release(PGconn *c) {
+        if (PQstatus(c) != CONNECTION_OK || PQtransactionStatus(c) != PQTRANS_IDLE) reconnect(c);
+        {
+            lock_guard<mutex> lock(m_);
+            idle_.push_back(c);
+        }
+        cv_.notify_one();
+    }
+
+    vector<pair<string, string>> params_;
+    vector<Statement> statements_;
+    vector<PGconn*> all_;
+    vector<PGconn*> idle_;
+    mutex m_;
+    condition_variable cv_;
+};
+
+// column list, and the numeric part of an O<n> id (NULL for legacy ids)
+#define ORDER_SELECT "id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt"
+#define ORDER_SEQ "(CASE WHEN id ~ '^O[0-9]{1,18}$' THEN substring(id from 2)::bigint END)"
+#define PRODUCT_SELECT "id, title, price, img, stock"
+// Moves a sequence past the highest id in its table
+#define SYNC_ORDER_SEQ "SELECT setval('order_id_seq', GREATEST(s.last_value, m.n)) FROM order_id_seq s," \
+    " (SELECT max(" ORDER_SEQ ") AS n FROM orders) m WHERE m.n > s.last_value OR (m.n IS NOT NULL AND NOT s.is_called);"
+#define SYNC_PRODUCT_SEQ "SELECT setval('product_id_seq', GREATEST(s.last_value, m.n)) FROM product_id_seq s," \
+    " (SELECT max(CASE WHEN id ~ '^p[0-9]{1,18}$' THEN substring(id from 2)::bigint END) AS n FROM products) m" \
+    " WHERE m.n > s.last_value OR (m.n IS NOT NULL AND NOT s.is_called);"
+
+class PostgresStorage : public Storage {
+public:
+    const char *name() const override { return "postgres"; }
+    bool shared() const override { return true; }
+
+    // DB_HOST, DB_PORT, DB_NAME, DB_USER, DB_PASS; DB_POOL_SIZE connections
+    bool open(int poolSize) {
+        vector<pair<string, string>> params = {{"connect_timeout", "5"}, {"application_name", "onlinetraderz"}};
+        const pair<const char*, const char*> env[] = {
+            {"DB_HOST", "host"}, {"DB_PORT", "port"}, {"DB_NAME", "dbname"}, {"DB_USER", "user"}, {"DB_PASS", "password"},
+        };
+        for (auto &e : env) {
+            const char *v = getenv(e.first);
+            if (v && *v) params.push_back({e.second, v});
+        }
+        if (!createSchema(params)) return false;
+        if (!pool_.open(params, poolSize, {
+                {"load_products", "SELECT id, title, price, img, stock FROM products ORDER BY id", 0},
+                {"load_orders", "SELECT " ORDER_SELECT " FROM orders ORDER BY id", 0},
+                {"load_orders_after", "SELECT " ORDER_SELECT " FROM orders WHERE " ORDER_SEQ " > $1 ORDER BY " ORDER_SEQ, 1},
+                {"upsert_product", "INSERT INTO products (id, title, price, img, stock) VALUES ($1, $2, $3, $4, $5) "
+                                   "ON CONFLICT (id) DO UPDATE SET title = EXCLUDED.title, price = EXCLUDED.price, "
+                                   "img = EXCLUDED.img, stock = EXCLUDED.stock", 5},
+                {"delete_product", "DELETE FROM products WHERE id = $1", 1},
+                {"update_product_image", "UPDATE products SET img = $2 WHERE id = $1", 2},
+                {"insert_order", "INSERT INTO orders (id, product, name, contact, email, address, productPrice, "
+                                 "deliveryCharges, totalAmount, payment, createdAt) "
+                                 "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11)", 11},
+                {"expire_key", "DELETE FROM idempotency_keys WHERE key = $1 AND expires_at <= $2", 2},
+                {"insert_key", "INSERT INTO idempotency_keys (key, body_hash, status, response, expires_at) "
+                               "VALUES ($1, $2, $3, $4, $5)", 5},
+                {"expire_keys", "DELETE FROM idempotency_keys WHERE expires_at <= $1", 1},
+                {"load_keys", "SELECT key, body_hash, status, response, expires_at FROM idempotency_keys", 0},
+                {"find_key", "SELECT key, body_hash, status, response, expires_at FROM idempotency_keys WHERE key = $1", 1},
+                {"find_order", "SELECT " ORDER_SELECT " FROM orders WHERE id = $1", 1},
+                {"scan_orders", "SELECT " ORDER_SELECT " FROM orders WHERE ($1 = '' OR createdAt >= $1) AND "
+                                "($2 = '' OR left(createdAt, length($2)) <= $2) ORDER BY " ORDER_SEQ " NULLS FIRST, id", 2},
+                {"next_order_id", "SELECT nextval('order_id_seq')", 0},
+                {"next_product_id", "SELECT nextval('product_id_seq')", 0},
+            })) return false;
+        return true;
+    }
+
+    bool loadProducts(vector<Product> &out) override {
+        return run({{"load_products", {}}}, [&](size_t, PGresult *r){ readProducts(r, out); });
+    }
+
+    bool loadOrders(vector<Order> &out) override {
+        return run({{"load_orders", {}}}, [&](size_t, PGresult *r){ readOrders(r, out); });
+    }
+
+    bool loadOrdersAfter(long long afterSeq, vector<Order> &out) override {
+        return run({{"load_orders_after", {to_string(afterSeq)}}}, [&](size_t, PGresult *r){ readOrders(r, out); });
+    }
+
+    // both reads in one round trip
+    bool loadChanges(vector<Product> &productsOut, long long afterSeq, vector<Order> &ordersOut) override {
+        return run({{"load_products", {}}, {"load_orders_after", {to_string(afterSeq)}}}, [&](size_t i, PGresult *r){
+            if (i == 0) readProducts(r, productsOut);
+            else readOrders(r, ordersOut);
+        });
+    }
+
+    long long countRows(const char *table) override {
+        PgPool::Lease conn(pool_);
+        if (!conn) return -1;
+        PGresult *r = PQexec(conn.get(), (string("SELECT count(*) FROM ") + table).c_str());
+        long long n = PQresultStatus(r) == PGRES_TUPLES_OK ? atoll(PQgetvalue(r, 0, 0)) : -1;
+        PQclear(r);
+        return n;
+    }
+
+    bool upsertProduct(const Product &p) override {
+        char price[32];
+        snprintf(price, sizeof(price), "%.17g", p.price);
+        return run({{"upsert_product", {p.id, p.title, price, p.img, to_string(p.stock)}}});
+    }
+
+    bool deleteProduct(const string &id) override {
+        return run({{"delete_product", {id}}});
+    }
+
+    bool updateProductImage(const string &id, const string &img) override {
+        return run({{"update_product_image", {id, img}}});
+    }
+
+    StoreResult insertOrder(const Order &o, const IdempotencyRecord *key) override {
+        vector<Call> calls;
+        if (key) {
+            calls.push_back({"expire_key", {key->key, to_string((long long)time(nullptr))}});
+            calls.push_back({"insert_key", {key->key, to_string((long long)key->bodyHash), key->status,
+                                            key->response, to_string((long long)key->expires)}});
+        }
+        Call order{"insert_order", {}};
+        for (auto column : ORDER_COLUMNS) order.values.push_back(o.*column);
+        calls.push_back(move(order));
+        string sqlstate;
+        if (run(calls, nullptr, &sqlstate)) return STORE_OK;
+        return sqlstate == "23505" && key ? STORE_DUPLICATE_KEY : STORE_FAILED; // unique_violation
+    }
+
+    bool replaceProducts(const vector<Product> &rows) override {
+        return copyRows("DELETE FROM products", "COPY products (" PRODUCT_SELECT ") FROM STDIN", nullptr,
+                        rows, appendCopyProduct);
+    }
+
+    bool replaceOrders(const vector<Order> &rows) override {
+        return copyRows("DELETE FROM orders", "COPY orders (" ORDER_SELECT ") FROM STDIN", nullptr,
+                        rows, appendCopyOrder);
+    }
+
+    // COPY into a temporary table, then one INSERT ... ON CONFLICT; the id
+    // sequences move past any imported ids in the same transaction
+    bool upsertProducts(const vector<Product> &rows) override {
+        return copyRows("CREATE TEMP TABLE import_products (LIKE products) ON COMMIT DROP",
+                        "COPY import_products (" PRODUCT_SELECT ") FROM STDIN",
+                        "INSERT INTO products SELECT * FROM import_products ON CONFLICT (id) DO UPDATE SET "
+                        "title = EXCLUDED.title, price = EXCLUDED.price, img = EXCLUDED.img, stock = EXCLUDED.stock;"
+                        SYNC_PRODUCT_SEQ, rows, appendCopyProduct);
+    }
+
+    bool upsertOrders(const vector<Order> &rows) override {
+        return copyRows("CREATE TEMP TABLE import_orders (LIKE orders) ON COMMIT DROP",
+                        "COPY import_orders (" ORDER_SELECT ") FROM STDIN",
+                        "INSERT INTO orders SELECT * FROM import_orders ON CONFLICT (id) DO UPDATE SET "
+                        "product = EXCLUDED.product, name = EXCLUDED.name, contact = EXCLUDED.contact, "
+                        "email = EXCLUDED.email, address = EXCLUDED.address, productPrice = EXCLUDED.productPrice, "
+                        "deliveryCharges = EXCLUDED.deliveryCharges, totalAmount = EXCLUDED.totalAmount, "
+                        "payment = EXCLUDED.payment, createdAt = EXCLUDED.createdAt;"
+                        SYNC_ORDER_SEQ, rows, appendCopyOrder);
+    }
+
+    bool loadIdempotencyKeys(time_t now, vector<IdempotencyRecord> &out) override {
+        return run({{"expire_keys", {to_string((long long)now)}}, {"load_keys", {}}}, [&](size_t i, PGresult *r) {
+            if (i == 1) for (int row = 0; row < PQntuples(r); ++row) out.push_back(readKey(r, row));
+        });
+    }
+
+    bool findIdempotencyKey(const string &key, IdempotencyRecord &out) override {
+        bool found = false;
+        bool ok = run({{"find_key", {key}}}, [&](size_t, PGresult *r) {
+            if (PQntuples(r) > 0) { out = readKey(r, 0); found = true; }
+        });
+        return ok && found;
+    }
+
+    bool findOrder(const string &id, Order &out) override {
+        vector<Order> found;
+        return run({{"find_order", {id}}}, [&](size_t, PGresult *r){ readOrders(r, found); }) && !found.empty() &&
+               (out = move(found[0]), true);
+    }
+
+    // Single-row mode hands over one row per PGresult instead of buffering the
+    // whole result set. Stopping early cancels the query.
+    bool scanOrders(const string &from, const string &to, const function<bool(const Order&)> &onRow) override {
+        PgPool::Lease lease(pool_);
+        if (!lease) return false;
+        PGconn *c = lease.get();
+        const char *values[2] = {from.c_str(), to.c_str()};
+        if (!PQsendQueryPrepared(c, "scan_orders", 2, values, nullptr, nullptr, 0)) {
+            LOGE(string("PostgreSQL scan_orders failed: ") + PQerrorMessage(c));
+            return false;
+        }
+        PQsetSingleRowMode(c);
+        bool ok = true, stopped = false;
+        Order o;
+        while (PGresult *r = PQgetResult(c)) {
+            ExecStatusType st = PQresultStatus(r);
+            if (st == PGRES_SINGLE_TUPLE && !stopped) {
+                for (int col = 0; col < ORDER_COLUMN_COUNT; ++col) o.*ORDER_COLUMNS[col] = value(r, 0, col);
+                if (!onRow(o)) {
+                    stopped = true;
+                    if (PGcancel *cancel = PQgetCancel(c)) {
+                        char err[256];
+                        PQcancel(cancel, err, sizeof(err));
+                        PQfreeCancel(cancel);
+                    }
+                }
+            } else if (st != PGRES_SINGLE_TUPLE && st != PGRES_TUPLES_OK) {
+                if (!stopped) LOGE(string("PostgreSQL scan_orders failed: ") + PQresultErrorMessage(r));
+                ok = false;
+            }
+            PQclear(r);
+        }
+        return ok && !stopped;
+    }
+
+    long long nextId(char kind) override {
+        long long id = -1;
+        run({{kind == 'O' ? "next_order_id" : "next_product_id", {}}}, [&](size_t, PGresult *r) {
+            if (PQntuples(r) > 0) id = atoll(PQgetvalue(r, 0, 0));
+        });
+        return id;
+    }
+
+private:
+
+    struct Call {
+        const char *statement;
+        vector<string> values;
+    };
+
+    // One-off connection for DDL. Sequences start past the highest existing
+    // id, so switching an existing database over keeps ids unique.
+    static bool createSchema(const vector<pair<string, string>> &params) {
+        PgPool setup;
+        if (!setup.open(params, 1, {})) return false;
+        PgPool::Lease conn(setup);
+        if (!conn) return false;
+        PGresult *r = PQexec(conn.get(),
+            "CREATE TABLE IF NOT EXISTS products ("
+            "id TEXT PRIMARY KEY, title TEXT, price DOUBLE PRECISION, img TEXT, stock INTEGER);"
+            "CREATE TABLE IF NOT EXISTS orders ("
+            "id TEXT PRIMARY KEY, product TEXT, name TEXT, contact TEXT, email TEXT, address TEXT,"
+            "productPrice TEXT, deliveryCharges TEXT, totalAmount TEXT, payment TEXT, createdAt TEXT);"
+            "CREATE INDEX IF NOT EXISTS orders_seq_idx ON orders (" ORDER_SEQ ");"
+            "CREATE TABLE IF NOT EXISTS idempotency_keys ("
+            "key TEXT PRIMARY KEY, body_hash BIGINT, status TEXT, response TEXT, expires_at BIGINT);"
+            "CREATE SEQUENCE IF NOT EXISTS order_id_seq;"
+            "CREATE SEQUENCE IF NOT EXISTS product_id_seq;"
+            SYNC_ORDER_SEQ SYNC_PRODUCT_SEQ);
+        bool ok = PQresultStatus(r) == PGRES_TUPLES_OK || PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) LOGE(string("Failed to create PostgreSQL schema: ") + PQresultErrorMessage(r));
+        PQclear(r);
+        return ok;
+    }
+
+    // Sends the calls as one pipeline and reads the results back in order;
+    // onResult sees each successful result. Returns false if any call failed,
+    // in which case the implicit transaction rolled all of them back.
+    // A connection found dead (e.g. the server restarted) is re-established
+    // and the calls retried once, provided nothing was handed out yet.
+    bool run(const vector<Call> &calls, const function<void(size_t, PGresult*)> &onResult = nullptr,
+             string *sqlstate = nullptr) {
+        PgPool::Lease lease(pool_);
+        if (!lease) return false;
+        size_t delivered = 0;
+        if (runOnce(lease.get(), calls, onResult, sqlstate, delivered)) return true;
+        if (PQstatus(lease.get()) != CONNECTION_BAD || delivered > 0 || !pool_.reconnect(lease.get())) return false;
+        LOGW("PostgreSQL connection re-established; retrying");
+        if (sqlstate) sqlstate->clear();
+        return runOnce(lease.get(), calls, onResult, sqlstate, delivered);
+    }
+
+    bool runOnce(PGconn *c, const vector<Call> &calls, const function<void(size_t, PGresult*)> &onResult,
+                 string *sqlstate, size_t &delivered) {
+        bool pipelined = calls.size() > 1;
+        if (pipelined && !PQenterPipelineMode(c)) return false;
+        size_t sent = 0;
+        for (auto &call : calls) {
+            vector<const char*> values;
+            for (auto &v : call.values) values.push_back(v.c_str());
+            if (!PQsendQueryPrepared(c, call.statement, (int)values.size(), values.data(), nullptr, nullptr, 0)) break;
+            ++sent;
+        }
+        if (pipelined) PQpipelineSync(c);
+        bool ok = sent == calls.size();
+        if (!ok) LOGE(string("PostgreSQL send failed: ") + PQerrorMessage(c));
+        for (size_t i = 0; i < sent; ++i) {
+            while (PGresult *r = PQgetResult(c)) {
+                ExecStatusType st = PQresultStatus(r);
+                if (st == PGRES_TUPLES_OK || st == PGRES_COMMAND_OK) {
+                    if (onResult) onResult(i, r);
+                    ++delivered;
+                } else {
+                    if (st == PGRES_FATAL_ERROR) {
+                        const char *state = PQresultErrorField(r, PG_DIAG_SQLSTATE);
+                        if (sqlstate && sqlstate->empty() && state) *sqlstate = state;
+                        if (!state || strcmp(state, "23505") != 0 || !sqlstate) {
+                            LOGE(string("PostgreSQL ") + calls[i].statement + " failed: " + PQresultErrorMessage(r));
+                        }
+                    }
+                    ok = false;
+                }
+                PQclear(r);
+            }
+        }
+        if (pipelined) {
+            while (PGresult *r = PQgetResult(c)) { // the sync marker
+                bool sync = PQresultStatus(r) == PGRES_PIPELINE_SYNC;
+                PQclear(r);
+                if (sync) break;
+            }
+            PQexitPipelineMode(c);
+        }
+        return ok;
+    }
+
+    // COPY escaping for the text format
+    static void appendCopyField(string &buf, const string &v) {
+        for (char ch : v) {
+            switch (ch) {
+            case '\\': buf += "\\\\"; break;
+            case '\t': buf += "\\t"; break;
+            case '\n': buf += "\\n"; break;
+            case '\r': buf += "\\r"; break;
+            default: buf += ch;
+            }
+        }
+    }
+
+    static void appendCopyProduct(string &buf, const Product &p) {
+        char price[32];
+        snprintf(price, sizeof(price), "%.17g", p.price);
+        appendCopyField(buf, p.id); buf += '\t';
+        appendCopyField(buf, p.title); buf += '\t';
+        buf += price; buf += '\t';
+        appendCopyField(buf, p.img); buf += '\t';
+        buf += to_string(p.stock); buf += '\n';
+    }
+
+    static void appendCopyOrder(string &buf, const Order &o) {
+        for (int c = 0; c < ORDER_COLUMN_COUNT; ++c) {
+            if (c) buf += '\t';
+            appendCopyField(buf, o.*ORDER_COLUMNS[c]);
+        }
+        buf += '\n';
+    }
+
+    // One transaction: `before`, the rows streamed with COPY in 256 KB
+    // chunks, then `after` if given
+    template <class Row>
+    bool copyRows(const char *before, const char *copySql, const char *after, const vector<Row> &rows,
+                  void (*appendRow)(string&, const Row&)) {
+        PgPool::Lease lease(pool_);
+        if (!lease) return false;
+        PGconn *c = lease.get();
+        auto exec = [&](const string &sql, ExecStatusType want) {
+            PGresult *r = PQexec(c, sql.c_str());
+            // a multi-statement `after` reports its last statement, which may be a SELECT
+            bool ok = PQresultStatus(r) == want || (want == PGRES_COMMAND_OK && PQresultStatus(r) == PGRES_TUPLES_OK);
+            if (!ok) LOGE("PostgreSQL " + sql + " failed: " + PQresultErrorMessage(r));
+            PQclear(r);
+            return ok;
+        };
+        if (!exec("BEGIN", PGRES_COMMAND_OK)) return false;
+        bool ok = exec(before, PGRES_COMMAND_OK) && exec(copySql, PGRES_COPY_IN);
+        if (ok) {
+            string buf;
+            buf.reserve(256 * 1024 + 4096);
+            for (auto &row : rows) {
+                appendRow(buf, row);
+                if (buf.size() >= 256 * 1024) {
+                    ok = PQputCopyData(c, buf.data(), (int)buf.size()) == 1;
+                    buf.clear();
+                    if (!ok) break;
+                }
+            }
+            if (ok && !buf.empty()) ok = PQputCopyData(c, buf.data(), (int)buf.size()) == 1;
+            PQputCopyEnd(c, ok ? nullptr : "aborted");
+            while (PGresult *r = PQgetResult(c)) {
+                if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+                    LOGE(string("PostgreSQL ") + copySql + " failed: " + PQresultErrorMessage(r));
+                    ok = false;
+                }
+                PQclear(r);
+            }
+        }
+        if (ok && after) ok = exec(after, PGRES_COMMAND_OK);
+        return exec(ok ? "COMMIT" : "ROLLBACK", PGRES_COMMAND_OK) && ok;
+    }
+
+    static string value(PGresult *r, int row, int col) {
+        return PQgetisnull(r, row, col) ? string() : string(PQgetvalue(r, row, col), PQgetlength(r, row, col));
+    }
+
+    static void readProducts(PGresult *r, vector<Product> &out) {
+        for (int row = 0; row < PQntuples(r); ++row) {
+            Product p;
+            p.id = value(r, row, 0);
+            p.title = value(r, row, 1);
+            p.price = atof(PQgetvalue(r, row, 2));
+            p.img = value(r, row, 3);
+            p.stock = atoi(PQgetvalue(r, row, 4));
+            out.push_back(move(p));
+        }
+    }
+
+    static void readOrders(PGresult *r, vector<Order> &out) {
+        for (int row = 0; row < PQntuples(r); ++row) {
+            Order o;
+            for (int c = 0; c < ORDER_COLUMN_COUNT; ++c) o.*ORDER_COLUMNS[c] = value(r, row, c);
+            out.push_back(move(o));
+        }
+    }
+
+    static IdempotencyRecord readKey(PGresult *r, int row) {
+        IdempotencyRecord k;
+        k.key = value(r, row, 0);
+        k.bodyHash = (uint64_t)atoll(PQgetvalue(r, row, 1));
+        k.status = PQgetisnull(r, row, 2) ? "200 OK" : value(r, row, 2);
+        k.response = value(r, row, 3);
+        k.expires = (time_t)atoll(PQgetvalue(r, row, 4));
+        return k;
+    }
+
+    PgPool pool_;
+};
+#undef ORDER_SELECT
+#undef ORDER_SEQ
+#undef PRODUCT_SELECT
+#undef SYNC_ORDER_SEQ
+#undef SYNC_PRODUCT_SEQ
+#endif // WITH_POSTGRES
+
+// Create DB and tables if not exist
+bool initDatabase() {
+#ifdef WITH_POSTGRES
+    if (g_storage_kind == "postgres") {
+        int poolSize = g_max_workers;
+        if (const char *env_pool = getenv("DB_POOL_SIZE")) {
+            try { poolSize = max(1, stoi(string(env_pool))); } catch(...) {}
+        }
+        unique_ptr<PostgresStorage> pg(new PostgresStorage());
+        if (!pg->open(poolSize)) return false;
+        g_storage = move(pg);
+        LOGI("Using PostgreSQL storage (pool=" + to_string(poolSize) + ")");
+        return true;
+    }
+#endif
+    if (g_storage_kind != "sqlite") {
+        LOGE("Unknown or unavailable STORAGE backend: " + g_storage_kind);
+        return false;
+    }
+    unique_ptr<SqliteStorage> sqlite(new SqliteStorage());
+    if (!sqlite->open()) return false;
+    g_storage = move(sqlite);
+    return true;
+}
+
+void closeDatabase() {
+    g_storage.reset();
+}
+
+// Attempt to migrate existing text files into the database if tables are empty
+void migrateTextFilesIfNeeded() {
+if (!g_storage) return;
+
+if (g_storage->countRows("products") == 0) {
+    // Try to read products.txt and insert rows
+    string productsPath = ensureDataFolder("products.txt");
+    ifstream pf(productsPath);
+    if (pf.is_open()) {
+        LOGI(string("Migrating products.txt into ") + g_storage->name() + " (products table empty)");
+        vector<Product> rows;
+        string line;
+        while (getline(pf, line)) {
+            if (line.empty()) continue;
+            istringstream iss(line);
+            Product p; string priceStr, stockStr;
+            getline(iss, p.id, '|');
+            getline(iss, p.title, '|');
+            getline(iss, priceStr, '|');
+            try { p.price = priceStr.empty() ? 0.0 : stod(priceStr); } catch(...) { p.price = 0.0; }
+            getline(iss, p.img, '|');
+            getline(iss, stockStr, '|');
+            try { p.stock = stockStr.empty() ? 0 : stoi(stockStr); } catch(...) { p.stock = 0; }
+            rows.push_back(move(p));
+        }
+        g_storage->replaceProducts(rows);
+    }
+}
+
+if (g_storage->countRows("orders") == 0) {
+    string ordersPath = ensureDataFolder("orders.txt");
+    ifstream ofile(ordersPath);
+    if (ofile.is_open()) {
+        LOGI(string("Migrating orders.txt into ") + g_storage->name() + " (orders table empty)");
+        vector<Order> rows;
+        string line;
+        while (getline(ofile, line)) {
+            if (line.empty()) continue;
+            istringstream iss(line);
+            Order o;
+            for (auto column : ORDER_COLUMNS) getline(iss, o.*column, '|');
+            rows.push_back(move(o));
+        }
+        g_storage->replaceOrders(rows);
+    }
+}
+
+}
+
+// Highest O<n> / p<n> number among loaded rows; seeds the SQLite id counters
+static void trackMaxId(const string &id, char kind, int &current) {
+    if (id.size() > 1 && id[0] == kind) {
+        try {
+            int num = stoi(id.substr(1));
+            if (num > current) current = num;
+        } catch (...) {}
+    }
+}
+
+// Load products from the database into memory
+void loadProducts() {
+vector<Product> loaded;
+if (g_storage) g_storage->loadProducts(loaded);
 lock_guard<mutex> lock(g_storage_mutex);
-if (!g_db) return;
-
-// Check if products table is empty  
-int count = 0;  
-sqlite3_stmt *stmt = nullptr;  
-const char *countProductsSql = "SELECT COUNT(*) FROM products;";  
-if (sqlite3_prepare_v2(g_db, countProductsSql, -1, &stmt, nullptr) == SQLITE_OK) {  
-    if (sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int(stmt, 0);  
-}  
-sqlite3_finalize(stmt);  
-
-if (count == 0) {  
-    // Try to read products.txt and insert rows  
-    string productsPath = ensureDataFolder("products.txt");  
-    ifstream pf(productsPath);  
-    if (pf.is_open()) {  
-        LOGI("Migrating products.txt into SQLite (products table empty)");  
-        string line;  
-        sqlite3_exec(g_db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);  
-        const char *insertSQL = "INSERT INTO products (id,title,price,img,stock) VALUES (?,?,?,?,?);";  
-        sqlite3_stmt *ins = nullptr;  
-        sqlite3_prepare_v2(g_db, insertSQL, -1, &ins, nullptr);  
-        while (getline(pf, line)) {  
-            if (line.empty()) continue;  
-            istringstream iss(line);  
-            Product p; string priceStr, stockStr;  
-            getline(iss, p.id, '|');  
-            getline(iss, p.title, '|');  
-            getline(iss, priceStr, '|');  
-            try { p.price = priceStr.empty() ? 0.0 : stod(priceStr); } catch(...) { p.price = 0.0; }  
-            getline(iss, p.img, '|');  
-            getline(iss, stockStr, '|');  
-            try { p.stock = stockStr.empty() ? 0 : stoi(stockStr); } catch(...) { p.stock = 0; }  
-
-            sqlite3_bind_text(ins, 1, p.id.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 2, p.title.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_double(ins, 3, p.price);  
-            sqlite3_bind_text(ins, 4, p.img.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_int(ins, 5, p.stock);  
-            sqlite3_step(ins);  
-            sqlite3_reset(ins);  
-        }  
-        sqlite3_finalize(ins);  
-        sqlite3_exec(g_db, "COMMIT;", nullptr, nullptr, nullptr);  
-        pf.close();  
-    }  
-}  
+products = move(loaded);
+for (auto &p : products) trackMaxId(p.id, 'p', currentProductID);
+g_product_index.rebuildLocked(products);
+}
+
+// Persist in-memory products to DB (simple: replace the table)
+void saveProducts() {
+vector<Product> snapshot;
+{
+    lock_guard<mutex> lock(g_storage_mutex);
+    snapshot = products;
+}
+if (g_storage) g_storage->replaceProducts(snapshot);
+}
+
+// Load orders from the database into memory
+void loadOrders() {
+vector<Order> loaded;
+if (g_storage) g_storage->loadOrders(loaded);
+lock_guard<mutex> lock(g_storage_mutex);
+orders = move(loaded);
+for (auto &o : orders) trackMaxId(o.id, 'O', currentOrderID);
+g_sales_stats.rebuild(orders);
+}
+
+// Persist in-memory orders to DB (simple: replace the table)
+void saveOrders() {
+lock_guard<mutex> lock(g_storage_mutex);
+if (g_storage) g_storage->replaceOrders(orders);
+}
+
+// ------------------- Startup snapshot -------------------
+// A clean shutdown dumps products, orders and the id counters to
+// DATA_DIR/snapshot.bin: a fixed header, length-prefixed records in native
+// byte order, then the file offset of every order so boot can decode orders
+// on several threads. The header carries a random token that is also stored in
+// the database. On boot the file is mmapped and used only if the database
+// still holds the same token; the token is cleared right after, so any later
+// write (or a crash) makes the snapshot stale and the next boot reads SQLite.
+// SNAPSHOT=off disables it. Remove snapshot.bin after editing server.db by hand.
+// --import stores SNAPSHOT_STALE instead, which also keeps a server that was
+// running during the import from writing a snapshot of its older state.
+static const char SNAPSHOT_STALE[] = "stale";
+
+#ifndef ONLINETRADERZ_NO_MAIN // only main loads and writes snapshots
+static bool g_snapshot_enabled = true;
+
+static const char SNAPSHOT_MAGIC[8] = {'O', 'T', 'Z', 'S', 'N', 'A', 'P', '1'};
+static const char SNAPSHOT_TRAILER[8] = {'O', 'T', 'Z', 'S', 'E', 'N', 'D', '1'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    char token[32];
+    uint64_t productCount;
+    uint64_t orderCount;
+    int64_t currentProductID;
+    int64_t currentOrderID;
+};
+
+static string snapshotPath() { return ensureDataFolder("snapshot.bin"); }
+
+static string newSnapshotToken() {
+    random_device rd;
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%08x%08x%08x%08x", rd(), rd(), rd(), rd());
+    return string(buf, 32);
+}
+
+// Bounds-checked reads over the mapped file; ok() turns false on overrun
+class SnapshotReader {
+public:
+    SnapshotReader(const char *p, const char *end) : p_(p), end_(end) {}
+    bool ok() const { return ok_; }
+
+    template <class T> T pod() {
+        T v{};
+        if (!take(sizeof(T))) return v;
+        memcpy(&v, p_ - sizeof(T), sizeof(T));
+        return v;
+    }
+    void str(string &out) {
+        uint32_t n = pod<uint32_t>();
+        if (take(n)) out.assign(p_ - n, n);
+    }
+    bool expect(const char (&tag)[8]) { return take(8) && memcmp(p_ - 8, tag, 8) == 0; }
+
+private:
+    bool take(size_t n) {
+        if (!ok_ || (size_t)(end_ - p_) < n) return ok_ = false;
+        p_ += n;
+        return true;
+    }
+    const char *p_, *end_;
+    bool ok_ = true;
+};
+
+template <class T> static void snapshotPut(string &buf, const T &v) { buf.append((const char*)&v, sizeof(T)); }
+static void snapshotPutStr(string &buf, const string &s) {
+    snapshotPut(buf, (uint32_t)s.size());
+    buf += s;
+}
+
+// Called once no more writes can happen
+static bool writeStartupSnapshot() {
+    if (!g_snapshot_enabled || !g_storage || g_storage->shared()) return false;
+    if (!g_storage->readSnapshotToken().empty()) {
+        LOGI("Database was changed by another process; not writing a startup snapshot");
+        return false;
+    }
+    auto started = chrono::steady_clock::now();
+    string token = newSnapshotToken();
+    AtomicFileWriter out(snapshotPath());
+    if (!out.ok()) return false;
+    string buf;
+    buf.reserve(1 << 20);
+    bool ok = true;
+    auto flushIfFull = [&] {
+        if (buf.size() < (1 << 20)) return;
+        ok = ok && out.write(buf.data(), buf.size());
+        buf.clear();
+    };
+    vector<uint64_t> orderOffsets;
+    {
+        lock_guard<mutex> lock(g_storage_mutex);
+        SnapshotHeader h{};
+        memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+        h.version = SNAPSHOT_VERSION;
+        h.headerBytes = sizeof(SnapshotHeader);
+        memcpy(h.token, token.data(), sizeof(h.token));
+        h.productCount = products.size();
+        h.orderCount = orders.size();
+        h.currentProductID = currentProductID;
+        h.currentOrderID = currentOrderID;
+        snapshotPut(buf, h);
+        for (auto &p : products) {
+            snapshotPutStr(buf, p.id);
+            snapshotPutStr(buf, p.title);
+            snapshotPut(buf, p.price);
+            snapshotPutStr(buf, p.img);
+            snapshotPut(buf, (int32_t)p.stock);
+            flushIfFull();
+        }
+        orderOffsets.reserve(orders.size() + 1);
+        for (auto &o : orders) {
+            orderOffsets.push_back(out.size() + buf.size());
+            for (auto column : ORDER_COLUMNS) snapshotPutStr(buf, o.*column);
+            flushIfFull();
+        }
+    }
+    uint64_t indexPos = out.size() + buf.size();
+    orderOffsets.push_back(indexPos); // end of the last order
+    for (uint64_t off : orderOffsets) {
+        snapshotPut(buf, off);
+        flushIfFull();
+    }
+    snapshotPut(buf, indexPos);
+    buf.append(SNAPSHOT_TRAILER, sizeof(SNAPSHOT_TRAILER));
+    ok = ok && out.write(buf.data(), buf.size()) && out.commit();
+    // the token goes in last: a snapshot without it is never trusted
+    ok = ok && g_storage->writeSnapshotToken(token);
+    if (ok) {
+        long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+        LOGI("Wrote startup snapshot (" + to_string(out.size()) + " bytes) in " + to_string(ms) + " ms");
+    } else {
+        LOGW("Could not write startup snapshot; next start reads the database");
+    }
+    return ok;
+}
+
+// Replaces loadProducts()/loadOrders() when a current snapshot exists.
+// Clears the database's token either way. If that fails the snapshot is
+// neither used nor kept: a later start would still take it for current.
+static bool loadStartupSnapshot() {
+    if (!g_storage || g_storage->shared()) return false;
+    string token = g_storage->readSnapshotToken();
+    if (!token.empty() && !g_storage->writeSnapshotToken("")) {
+        LOGW("Could not clear the startup snapshot token; loading from the database");
+        unlink(snapshotPath().c_str());
+        return false;
+    }
+    if (!g_snapshot_enabled || token.size() != sizeof(SnapshotHeader::token)) return false;
+
+    auto started = chrono::steady_clock::now();
+    int fd = open(snapshotPath().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SnapshotHeader)) {
+        map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    const char *base = (const char*)map;
+    SnapshotReader in(base, base + st.st_size);
+    const char *end = base + st.st_size;
+    SnapshotHeader h = in.pod<SnapshotHeader>();
+    bool ok = memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) == 0 && h.version == SNAPSHOT_VERSION &&
+              h.headerBytes == sizeof(SnapshotHeader) && memcmp(h.token, token.data(), sizeof(h.token)) == 0 &&
+              h.productCount <= (uint64_t)st.st_size && h.orderCount <= (uint64_t)st.st_size;
+    // trailer: [offsets...][index position][SNAPSHOT_TRAILER]
+    uint64_t indexPos = 0;
+    if (ok && (size_t)st.st_size >= sizeof(SnapshotHeader) + 16) {
+        SnapshotReader tail(end - 16, end);
+        indexPos = tail.pod<uint64_t>();
+        ok = tail.expect(SNAPSHOT_TRAILER) && indexPos <= (uint64_t)st.st_size - 16 &&
+             ((uint64_t)st.st_size - 16 - indexPos) / 8 == h.orderCount + 1;
+    } else {
+        ok = false;
+    }
+    vector<Product> loadedProducts;
+    vector<Order> loadedOrders;
+    if (ok) {
+        loadedProducts.resize(h.productCount);
+        for (auto &p : loadedProducts) {
+            in.str(p.id);
+            in.str(p.title);
+            p.price = in.pod<double>();
+            in.str(p.img);
+            p.stock = in.pod<int32_t>();
+        }
+        ok = in.ok();
+    }
+    if (ok) {
+        // Orders decode in contiguous slices, one thread each
+        auto offset = [&](size_t i) {
+            uint64_t v;
+            memcpy(&v, base + indexPos + i * 8, 8);
+            return v;
+        };
+        loadedOrders.resize(h.orderCount);
+        size_t n = loadedOrders.size();
+        size_t threads = n < 20000 ? 1 : min<size_t>(8, max(1u, thread::hardware_concurrency()));
+        vector<char> sliceOk(threads, 1);
+        auto decode = [&](size_t t) {
+            size_t from = n * t / threads, to = n * (t + 1) / threads;
+            uint64_t a = offset(from), b = offset(to);
+            if (a > b || b > indexPos) { sliceOk[t] = 0; return; }
+            SnapshotReader slice(base + a, base + b);
+            for (size_t i = from; i < to; ++i) {
+                for (auto column : ORDER_COLUMNS) slice.str(loadedOrders[i].*column);
+            }
+            sliceOk[t] = slice.ok();
+        };
+        vector<thread> workers;
+        for (size_t t = 1; t < threads; ++t) workers.emplace_back(decode, t);
+        decode(0);
+        for (auto &w : workers) w.join();
+        ok = all_of(sliceOk.begin(), sliceOk.end(), [](char c){ return c != 0; });
+    }
+    munmap(map, (size_t)st.st_size);
+    if (!ok) {
+        LOGW("Startup snapshot is unusable; loading from the database");
+        return false;
+    }
+
+    lock_guard<mutex> lock(g_storage_mutex);
+    products = move(loadedProducts);
+    orders = move(loadedOrders);
+    currentProductID = (int)h.currentProductID;
+    currentOrderID = (int)h.currentOrderID;
+    g_product_index.rebuildLocked(products);
+    g_sales_stats.rebuild(orders);
+    long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    LOGI("Loaded " + to_string(products.size()) + " products and " + to_string(orders.size()) +
+         " orders from the startup snapshot in " + to_string(ms) + " ms");
+    return true;
+}
+#endif // ONLINETRADERZ_NO_MAIN
+
+// ------------------- Bulk import -------------------
+// `server --import FILE` merges a pipe-delimited export in the products.txt
+// or orders.txt layout into the database, then exits. The file is mmapped and
+// cut at line boundaries into one chunk per thread; chunks are parsed and
+// validated in parallel, repeated ids keep their last row, and the rows are
+// upserted by id in batches of IMPORT_BATCH_ROWS, one transaction each.
+// Order rows without the leading id column (the oldest orders.txt) get new
+// ids. A running single-node server does not see the rows until restarted.
+#ifndef ONLINETRADERZ_NO_MAIN // reached only through main's --import
+static size_t g_import_batch_rows = 5000;
+static const size_t IMPORT_REPORTED_ERRORS = 20;
+
+struct ImportChunk {
+    string_view text;
+    vector<Product> products;
+    vector<Order> orders;
+    vector<pair<size_t, const char*>> errors; // (line within chunk, reason), first few only
+    size_t rejected = 0;
+    size_t lines = 0;
+};
+
+// "12", "-3.50", " 180.00 "; empty only when optional
+static bool importAmountValid(string_view s, bool required) {
+    s = trimView(s);
+    if (s.empty()) return !required;
+    if (s[0] == '-') s.remove_prefix(1);
+    size_t i = 0, digits = 0;
+    for (; i < s.size() && isdigit((unsigned char)s[i]); ++i) ++digits;
+    if (i < s.size() && s[i] == '.') {
+        for (++i; i < s.size() && isdigit((unsigned char)s[i]); ++i) ++digits;
+    }
+    return digits > 0 && i == s.size();
+}
+
+static bool importDateValid(string_view s) {
+    if (s.empty()) return true;
+    if (s.size() < 10 || s[4] != '-' || s[7] != '-') return false;
+    for (size_t i : {0, 1, 2, 3, 5, 6, 8, 9}) {
+        if (!isdigit((unsigned char)s[i])) return false;
+    }
+    return true;
+}
+
+// id|title|price|img|stock
+static const char *parseImportProduct(const string_view *f, size_t n, vector<Product> &out) {
+    if (n != 5) return "expected 5 fields";
+    if (!idCharsSafe(f[0])) return "invalid id";
+    if (!importAmountValid(f[2], false)) return "invalid price";
+    string_view stock = trimView(f[4]);
+    int stockValue = 0;
+    if (!stock.empty()) {
+        auto res = from_chars(stock.data(), stock.data() + stock.size(), stockValue);
+        if (res.ec != errc() || res.ptr != stock.data() + stock.size() || stockValue < 0) return "invalid stock";
+    }
+    Product p;
+    p.id.assign(f[0]);
+    p.title.assign(f[1]);
+    string price(trimView(f[2]));
+    p.price = price.empty() ? 0.0 : strtod(price.c_str(), nullptr);
+    p.img.assign(f[3]);
+    p.stock = stockValue;
+    out.push_back(move(p));
+    return nullptr;
+}
+
+// [id|]product|name|contact|email|address|productPrice|deliveryCharges|totalAmount|payment|createdAt
+static const char *parseImportOrder(const string_view *f, size_t n, vector<Order> &out) {
+    if (n != (size_t)ORDER_COLUMN_COUNT && n != (size_t)ORDER_COLUMN_COUNT - 1) return "expected 10 or 11 fields";
+    size_t skip = ORDER_COLUMN_COUNT - n; // 1 when the id column is missing
+    if (!skip && !idCharsSafe(f[0])) return "invalid id";
+    Order o;
+    for (size_t c = skip; c < (size_t)ORDER_COLUMN_COUNT; ++c) (o.*ORDER_COLUMNS[c]).assign(f[c - skip]);
+    if (!importAmountValid(o.productPrice, false) || !importAmountValid(o.deliveryCharges, false) ||
+        !importAmountValid(o.totalAmount, true)) return "invalid amount";
+    if (!importDateValid(o.createdAt)) return "invalid createdAt";
+    out.push_back(move(o));
+    return nullptr;
+}
+
+static void parseImportChunk(bool productsFile, ImportChunk &chunk) {
+    const size_t maxFields = ORDER_COLUMN_COUNT + 1;
+    string_view fields[maxFields];
+    size_t lines = count(chunk.text.begin(), chunk.text.end(), '\n') + 1;
+    if (productsFile) chunk.products.reserve(lines);
+    else chunk.orders.reserve(lines);
+    size_t pos = 0;
+    while (pos < chunk.text.size()) {
+        size_t nl = chunk.text.find('\n', pos);
+        if (nl == string_view::npos) nl = chunk.text.size();
+        string_view line = chunk.text.substr(pos, nl - pos);
+        pos = nl + 1;
+        ++chunk.lines;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty()) continue;
+        size_t n = 0;
+        for (size_t start = 0;; ++n) {
+            size_t bar = line.find('|', start);
+            if (n < maxFields) fields[n] = line.substr(start, bar == string_view::npos ? string_view::npos : bar - start);
+            if (bar == string_view::npos) break;
+            start = bar + 1;
+        }
+        ++n;
+        const char *error = productsFile ? parseImportProduct(fields, n, chunk.products)
+                                         : parseImportOrder(fields, n, chunk.orders);
+        if (error) {
+            if (chunk.errors.size() < IMPORT_REPORTED_ERRORS) chunk.errors.push_back({chunk.lines, error});
+            ++chunk.rejected;
+        }
+    }
+}
+
+// Drops all but the last row for each id; rows with an empty id are kept
+template <class Row>
+static size_t dropDuplicateIds(vector<Row> &rows) {
+    // (hash, index) sorted: equal ids end up adjacent, in file order
+    vector<pair<size_t, size_t>> keys;
+    keys.reserve(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (!rows[i].id.empty()) keys.push_back({hash<string>()(rows[i].id), i});
+    }
+    sort(keys.begin(), keys.end());
+    vector<char> keep(rows.size(), 1);
+    for (size_t a = 0; a < keys.size(); ++a) {
+        for (size_t b = a + 1; b < keys.size() && keys[b].first == keys[a].first; ++b) {
+            if (rows[keys[b].second].id == rows[keys[a].second].id) {
+                keep[keys[a].second] = 0;
+                break;
+            }
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (!keep[i]) continue;
+        if (kept != i) rows[kept] = move(rows[i]);
+        ++kept;
+    }
+    size_t dropped = rows.size() - kept;
+    rows.resize(kept);
+    return dropped;
+}
+
+template <class Row>
+static bool importBatches(vector<Row> &rows, const char *what, bool (Storage::*upsert)(const vector<Row>&)) {
+    auto started = chrono::steady_clock::now();
+    auto reported = started;
+    vector<Row> batch;
+    for (size_t done = 0; done < rows.size();) {
+        size_t n = min(g_import_batch_rows, rows.size() - done);
+        batch.assign(make_move_iterator(rows.begin() + done), make_move_iterator(rows.begin() + done + n));
+        if (!((*g_storage).*upsert)(batch)) {
+            LOGE(string("Import stopped: writing ") + what + " " + to_string(done + 1) + "-" + to_string(done + n) +
+                 " failed; " + to_string(done) + " were imported");
+            return false;
+        }
+        done += n;
+        auto now = chrono::steady_clock::now();
+        if (done == rows.size() || now - reported >= chrono::seconds(1)) {
+            reported = now;
+            double sec = max(1e-3, chrono::duration<double>(now - started).count());
+            LOGI(string("Imported ") + to_string(done) + "/" + to_string(rows.size()) + " " + what + " (" +
+                 to_string(done * 100 / rows.size()) + "%, " + to_string((long long)(done / sec)) + " rows/s)");
+        }
+    }
+    return true;
+}
+
+// Returns the process exit code
+static int runImport(const string &path) {
+    auto started = chrono::steady_clock::now();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LOGE("Cannot open " + path + ": " + strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        LOGW(path + " is empty; nothing to import");
+        return 0;
+    }
+    void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGE("Cannot map " + path + ": " + strerror(errno));
+        return 1;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    string_view text((const char*)map, (size_t)st.st_size);
+
+    // the first non-empty line decides the layout: 5 fields are products
+    size_t first = text.find_first_not_of("\r\n");
+    string_view firstLine = first == string_view::npos ? string_view() : text.substr(first, text.find('\n', first) - first);
+    bool productsFile = count(firstLine.begin(), firstLine.end(), '|') == 4;
+
+    size_t threads = text.size() < (1 << 20) ? 1 : min<size_t>(8, max(1u, thread::hardware_concurrency()));
+    vector<ImportChunk> chunks;
+    for (size_t t = 0, start = 0; t < threads && start < text.size(); ++t) {
+        size_t end = t + 1 == threads ? text.size() : max(start, text.size() * (t + 1) / threads);
+        end = text.find('\n', end);
+        end = end == string_view::npos ? text.size() : end + 1;
+        chunks.emplace_back();
+        chunks.back().text = text.substr(start, end - start);
+        start = end;
+    }
+    vector<thread> workers;
+    for (size_t t = 1; t < chunks.size(); ++t) workers.emplace_back(parseImportChunk, productsFile, ref(chunks[t]));
+    parseImportChunk(productsFile, chunks[0]);
+    for (auto &w : workers) w.join();
+
+    vector<Product> productRows;
+    vector<Order> orderRows;
+    size_t rejected = 0, lineBase = 0, total = 0;
+    for (auto &c : chunks) total += c.products.size() + c.orders.size();
+    productRows = move(chunks[0].products);
+    orderRows = move(chunks[0].orders);
+    productRows.reserve(productsFile ? total : 0);
+    orderRows.reserve(productsFile ? 0 : total);
+    for (auto &c : chunks) {
+        for (auto &e : c.errors) {
+            if (rejected < IMPORT_REPORTED_ERRORS) LOGW(path + ":" + to_string(lineBase + e.first) + ": " + e.second + " - skipped");
+            ++rejected;
+        }
+        rejected += c.rejected - c.errors.size();
+        lineBase += c.lines;
+        move(c.products.begin(), c.products.end(), back_inserter(productRows));
+        move(c.orders.begin(), c.orders.end(), back_inserter(orderRows));
+        c = ImportChunk();
+    }
+    munmap(map, (size_t)st.st_size);
+    size_t duplicates = productsFile ? dropDuplicateIds(productRows) : dropDuplicateIds(orderRows);
+    long long parseMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    LOGI("Parsed " + path + " as " + (productsFile ? "products" : "orders") + " on " + to_string(chunks.size()) +
+         " thread(s) in " + to_string(parseMs) + " ms: " + to_string(productsFile ? productRows.size() : orderRows.size()) +
+         " rows, " + to_string(rejected) + " rejected, " + to_string(duplicates) + " repeated ids collapsed");
+
+    // Rows without an id continue after both the stored and the imported ids
+    size_t unnamed = count_if(orderRows.begin(), orderRows.end(), [](const Order &o){ return o.id.empty(); });
+    if (unnamed > 0) {
+        if (!g_storage->shared()) {
+            g_storage->scanOrders("", "", [](const Order &o){ trackMaxId(o.id, 'O', currentOrderID); return true; });
+        }
+        long long next = g_storage->nextId('O');
+        if (next <= 0) {
+            LOGE("Could not allocate order ids for the import");
+            return 1;
+        }
+        int fileMax = 0;
+        for (auto &o : orderRows) trackMaxId(o.id, 'O', fileMax);
+        next = max(next, (long long)fileMax + 1);
+        for (auto &o : orderRows) {
+            if (o.id.empty()) o.id = "O" + to_string(next++);
+        }
+        LOGI("Assigned ids to " + to_string(unnamed) + " orders without one");
+    }
+
+    // from here on the database may differ from any startup snapshot
+    if (!g_storage->shared()) g_storage->writeSnapshotToken(SNAPSHOT_STALE);
+    bool ok = productsFile ? importBatches(productRows, "products", &Storage::upsertProducts)
+                           : importBatches(orderRows, "orders", &Storage::upsertOrders);
+    long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+    if (ok) LOGI("Import of " + path + " finished in " + to_string(ms) + " ms");
+    return ok ? 0 : 1;
+}
+#endif // ONLINETRADERZ_NO_MAIN
+
+// ------------------- Idempotency keys -------------------
+// POST /api/orders accepts an Idempotency-Key header. The first request with
+// a key claims it; retries with the same key and body get the stored
+// response back without creating another order. Completed entries live for
+// g_idempotency_ttl seconds in memory and in the idempotency_keys table, so
+// a retry that lands after a restart is still recognised.
+static int g_idempotency_ttl = 24 * 3600;
+static const int IDEMPOTENCY_SHARDS = 16;
+static const size_t IDEMPOTENCY_MAX_KEY = 255;
+// A claim whose request never completed (worker died) is released after this
+static const int IDEMPOTENCY_IN_FLIGHT_TIMEOUT = 60;
+
+struct IdempotencyEntry {
+    uint64_t bodyHash = 0;
+    bool done = false;     // false while the claiming request is still running
+    time_t expires = 0;
+    string status;
+    string response;
+};
+
+struct IdempotencyShard {
+    mutex m;
+    unordered_map<string, IdempotencyEntry> entries;
+    unsigned insertsSinceSweep = 0;
+};
+
+static IdempotencyShard g_idempotency[IDEMPOTENCY_SHARDS];
+static CacheStats *g_idempotency_stats = registerCacheStats("idempotency");
+
+static uint64_t fnv1a64(string_view s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : s) h = (h ^ c) * 1099511628211ULL;
+    return h;
+}
+
+static IdempotencyShard &idempotencyShard(const string &key) {
+    return g_idempotency[fnv1a64(key) % IDEMPOTENCY_SHARDS];
+}
+
+// Caller holds shard.m
+static void sweepIdempotencyShard(IdempotencyShard &shard, time_t now) {
+    for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+        if (it->second.expires <= now) it = shard.entries.erase(it);
+        else ++it;
+    }
+    shard.insertsSinceSweep = 0;
+}
+
+enum IdempotencyOutcome { IDEMPOTENCY_CLAIMED, IDEMPOTENCY_REPLAY, IDEMPOTENCY_IN_FLIGHT, IDEMPOTENCY_MISMATCH };
+
+// Claim `key` for a request whose body hashes to bodyHash. On REPLAY the
+// stored status and response are copied out.
+IdempotencyOutcome claimIdempotencyKey(const string &key, uint64_t bodyHash, string &status, string &response) {
+    auto &shard = idempotencyShard(key);
+    time_t now = time(nullptr);
+    lock_guard<mutex> lock(shard.m);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end() && it->second.expires <= now) {
+        shard.entries.erase(it);
+        it = shard.entries.end();
+    }
+    if (it == shard.entries.end()) {
+        if (++shard.insertsSinceSweep >= 256) sweepIdempotencyShard(shard, now);
+        IdempotencyEntry &e = shard.entries[key];
+        e.bodyHash = bodyHash;
+        e.expires = now + IDEMPOTENCY_IN_FLIGHT_TIMEOUT;
+        g_idempotency_stats->misses.fetch_add(1, memory_order_relaxed);
+        return IDEMPOTENCY_CLAIMED;
+    }
+    if (it->second.bodyHash != bodyHash) return IDEMPOTENCY_MISMATCH;
+    if (!it->second.done) return IDEMPOTENCY_IN_FLIGHT;
+    status = it->second.status;
+    response = it->second.response;
+    g_idempotency_stats->hits.fetch_add(1, memory_order_relaxed);
+    return IDEMPOTENCY_REPLAY;
+}
+
+void completeIdempotencyKey(const string &key, const string &status, const string &response, time_t expires) {
+    auto &shard = idempotencyShard(key);
+    lock_guard<mutex> lock(shard.m);
+    IdempotencyEntry &e = shard.entries[key];
+    e.done = true;
+    e.expires = expires;
+    e.status = status;
+    e.response = response;
+}
+
+void releaseIdempotencyKey(const string &key) {
+    auto &shard = idempotencyShard(key);
+    lock_guard<mutex> lock(shard.m);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end() && !it->second.done) shard.entries.erase(it);
+}
+
+// Releases an unfinished claim if the handler bails out before completing it
+struct IdempotencyClaim {
+    string key;
+    bool completed = false;
+    ~IdempotencyClaim() { if (!key.empty() && !completed) releaseIdempotencyKey(key); }
+};
+
+// Drop expired rows and load the rest into the in-memory table
+void loadIdempotencyKeys() {
+    if (!g_storage) return;
+    vector<IdempotencyRecord> records;
+    g_storage->loadIdempotencyKeys(time(nullptr), records);
+    for (auto &r : records) {
+        IdempotencyEntry e;
+        e.bodyHash = r.bodyHash;
+        e.done = true;
+        e.status = move(r.status);
+        e.response = move(r.response);
+        e.expires = r.expires;
+        auto &shard = idempotencyShard(r.key);
+        lock_guard<mutex> shardLock(shard.m);
+        shard.entries[r.key] = move(e);
+    }
+    if (!records.empty()) LOGI("Loaded " + to_string(records.size()) + " idempotency keys");
+}
+
+// ------------------- Utilities (unchanged) -------------------
+// Ids come from the storage backend (a counter for SQLite, a sequence shared
+// by all replicas for PostgreSQL). Must not be called under g_storage_mutex.
+// Both return "" if the backend could not allocate one.
+string generateProductID() {
+    long long n = g_storage->nextId('p');
+    return n > 0 ? "p" + to_string(n) : string();
+}
+string generateOrderID() {
+    long long n = g_storage->nextId('O');
+    return n > 0 ? "O" + to_string(n) : string();
+}
+
+// ------------------- Per-request arena -------------------
+// Each worker thread owns one monotonic arena that handleClient releases at the
+// start of every connection. The request buffer, parsed fields and serialized
+// bodies all come from it, so a request costs a handful of heap allocations
+// (only when a body outgrows the initial block) instead of dozens.
+using ArenaString = pmr::string;
+using ArenaFields = pmr::map<pmr::string, pmr::string, less<>>;
+
+class RequestArena {
+public:
+    static const size_t INITIAL_BYTES = 64 * 1024;
+    RequestArena() : block_(new char[INITIAL_BYTES]), mr_(block_.get(), INITIAL_BYTES) {}
+    pmr::memory_resource *resource() { return &mr_; }
+    void reset() { mr_.release(); }
+private:
+    unique_ptr<char[]> block_;
+    pmr::monotonic_buffer_resource mr_;
+};
+
+static RequestArena &threadArena() {
+    thread_local RequestArena arena;
+    return arena;
+}
+
+// Value of a parsed field, or empty
+static string_view field(const ArenaFields &kv, string_view key) {
+    auto it = kv.find(key);
+    return it == kv.end() ? string_view() : string_view(it->second);
+}
+
+// ------------------- Simple JSON parser for flat keys -------------------
+ArenaFields parseJson(string_view body, pmr::memory_resource *mr = pmr::get_default_resource()) {
+ArenaFields res(mr);
+ArenaString key(mr), val(mr);
+enum State { NONE, IN_KEY, AFTER_KEY, IN_VAL } st = NONE;
+bool esc = false;
+for (size_t i=0;i<body.size();++i) {
+char c = body[i];
+if (st == NONE) {
+if (c == '"') { st = IN_KEY; key.clear(); esc=false; }
+} else if (st == IN_KEY) {
+if (c == '"' && !esc) { st = AFTER_KEY; }
+else {
+if (c == '\\' && !esc) esc = true; else { key.push_back(c); esc=false; }
+}
+} else if (st == AFTER_KEY) {
+if (c == ':') {
+// move to value; find starting quote
+size_t j = i+1;
+while (j < body.size() && isspace((unsigned char)body[j])) j++;
+if (j < body.size() && body[j] == '"') { st = IN_VAL; i = j; val.clear(); esc=false; }
+else {
+// non-string value (number, boolean) - capture until comma or }
+size_t k = j;
+while (k < body.size() && body[k] != ',' && body[k] != '}' && body[k] != '\n' && body[k] != '\r') k++;
+string_view raw = body.substr(j, k-j);
+// trim
+size_t a = raw.find_first_not_of(" \t\n\r");
+size_t b = raw.find_last_not_of(" \t\n\r");
+res[key] = (a==string_view::npos) ? string_view() : raw.substr(a, b-a+1);
+i = k-1;
+st = NONE;
+}
+}
+} else if (st == IN_VAL) {
+if (c == '"' && !esc) {
+// value ended
+res[key] = val;
+st = NONE;
+} else {
+if (c == '\\' && !esc) esc = true; else { val.push_back(c); esc=false; }
+}
+}
+}
+return res;
+}
+
+// parse application/x-www-form-urlencoded
+static inline int hexValue(char c) {
+if (c >= '0' && c <= '9') return c - '0';
+if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+return -1;
+}
+
+ArenaString urlDecode(string_view src, pmr::memory_resource *mr = pmr::get_default_resource()) {
+ArenaString out(mr);
+out.reserve(src.size());
+for (size_t i=0;i<src.size();++i) {
+if (src[i] == '+') out.push_back(' ');
+else if (src[i] == '%' && i+2 < src.size()) {
+int hi = hexValue(src[i+1]), lo = hexValue(src[i+2]);
+out.push_back((char)(hi < 0 || lo < 0 ? 0 : hi * 16 + lo));
+i += 2;
+} else out.push_back(src[i]);
+}
+return out;
+}
+ArenaFields parseFormUrlEncoded(string_view body, pmr::memory_resource *mr = pmr::get_default_resource()) {
+ArenaFields res(mr);
+size_t pos = 0;
+while (pos < body.size()) {
+size_t eq = body.find('=', pos);
+if (eq == string_view::npos) break;
+string_view k = body.substr(pos, eq-pos);
+size_t amp = body.find('&', eq+1);
+string_view v;
+if (amp == string_view::npos) { v = body.substr(eq+1); pos = body.size(); }
+else { v = body.substr(eq+1, amp-(eq+1)); pos = amp+1; }
+res[urlDecode(k, mr)] = urlDecode(v, mr);
+}
+return res;
+}
+
+// ------------------- Utility / HTTP -------------------
+// Per-request bookkeeping filled in by the response writers, read by the access log
+struct RequestContext {
+    Route route = ROUTE_OTHER;
+    int status = 0;
+    size_t bytesSent = 0; // body bytes
+};
+static thread_local RequestContext t_req;
+
+// Writes every iovec, resuming after short writes and EINTR. Returns bytes written;
+// less than the total means the peer went away or the socket failed.
+size_t writevAll(int fd, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        total += (size_t)n;
+        size_t left = (size_t)n;
+        while (iovcnt > 0 && left >= iov->iov_len) { left -= iov->iov_len; ++iov; --iovcnt; }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return total;
+}
+
+bool sendAll(int fd, const char *data, size_t len) {
+    struct iovec iov = { (void*)data, len };
+    return writevAll(fd, &iov, 1) == len;
+}
+
+// Formats the status line and headers; returns the length snprintf wanted
+// (may exceed cap, in which case the caller retries with a larger buffer).
+// extraHeaders must be empty or a sequence of "Name: value\r\n" lines.
+static size_t formatResponseHead(char *buf, size_t cap, const string &status, const string &contentType,
+                                 size_t contentLength, const string &extraHeaders) {
+    int n = snprintf(buf, cap,
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+                     "Access-Control-Allow-Headers: Content-Type, Idempotency-Key, Authorization\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s"
+                     "Connection: close\r\n\r\n",
+                     status.c_str(), contentType.c_str(), contentLength, extraHeaders.c_str());
+    return n < 0 ? 0 : (size_t)n;
+}
+
+// Headers are formatted into a stack buffer and go out with the body in one
+// writev, without concatenating them. The body is borrowed (e.g. an arena buffer).
+bool sendResponseView(int clientSocket, const string &status, const string &contentType, string_view body,
+                      const string &extraHeaders = "") {
+    t_req.status = atoi(status.c_str());
+    char stackHead[1024];
+    string heapHead;
+    char *head = stackHead;
+    size_t headLen = formatResponseHead(stackHead, sizeof(stackHead), status, contentType, body.size(), extraHeaders);
+    if (headLen >= sizeof(stackHead)) {
+        heapHead.resize(headLen + 1);
+        head = &heapHead[0];
+        formatResponseHead(head, heapHead.size(), status, contentType, body.size(), extraHeaders);
+    }
+    struct iovec iov[2] = { { head, headLen }, { (void*)body.data(), body.size() } };
+    if (t_conn_deadline) t_conn_deadline->arm(PHASE_WRITE);
+    size_t written = writevAll(clientSocket, iov, body.empty() ? 1 : 2);
+    t_req.bytesSent += written > headLen ? written - headLen : 0;
+    return written == headLen + body.size();
+}
+
+// Owning variant: handlers pass large bodies by move
+bool sendResponse(int clientSocket, const string &status, const string &contentType, string body,
+                  const string &extraHeaders = "") {
+    return sendResponseView(clientSocket, status, contentType, body, extraHeaders);
+}
+
+// Body writer for Transfer-Encoding: chunked. Output collects in a fixed-size
+// buffer that goes out as one chunk whenever it fills, so memory stays flat
+// however long the body is. Each chunk gets its own write deadline. After a
+// failed write ok() turns false and further output is dropped.
+class ChunkedWriter {
+public:
+    static constexpr size_t CHUNK_BYTES = 64 * 1024;
+
+    ChunkedWriter(int fd, pmr::memory_resource *mr) : fd_(fd), buf_(mr) { buf_.reserve(CHUNK_BYTES + 4096); }
+
+    ArenaString &buffer() { return buf_; }
+    bool ok() const { return ok_; }
+
+    // Call after appending to buffer()
+    void maybeFlush() { if (buf_.size() >= CHUNK_BYTES) flush(); }
+
+    void flush() {
+        if (buf_.empty() || !ok_) { buf_.clear(); return; }
+        char size[24];
+        int n = snprintf(size, sizeof(size), "%zx\r\n", buf_.size());
+        struct iovec iov[3] = { { size, (size_t)n }, { &buf_[0], buf_.size() }, { (void*)"\r\n", 2 } };
+        if (t_conn_deadline) t_conn_deadline->arm(PHASE_WRITE);
+        ok_ = writevAll(fd_, iov, 3) == (size_t)n + buf_.size() + 2;
+        if (ok_) t_req.bytesSent += buf_.size();
+        buf_.clear();
+    }
+
+    // Flushes and writes the terminating zero-length chunk
+    bool finish() {
+        flush();
+        if (ok_) ok_ = sendAll(fd_, "0\r\n\r\n", 5);
+        return ok_;
+    }
+
+private:
+    int fd_;
+    ArenaString buf_;
+    bool ok_ = true;
+};
+
+string getQueryParam(string_view path, string_view key, pmr::memory_resource *mr = pmr::get_default_resource()) {
+size_t q = path.find('?');
+if (q == string_view::npos) return "";
+auto params = parseFormUrlEncoded(path.substr(q+1), mr);
+return string(field(params, key));
+}
+
+// Raw value of an access_token query parameter (admin links, EventSource)
+static string_view accessTokenParam(string_view path) {
+    size_t q = path.find('?');
+    if (q == string_view::npos) return string_view();
+    for (size_t pos = q + 1; pos < path.size();) {
+        size_t amp = path.find('&', pos);
+        string_view pair = path.substr(pos, amp == string_view::npos ? string_view::npos : amp - pos);
+        if (pair.substr(0, 13) == "access_token=") return pair.substr(13);
+        if (amp == string_view::npos) break;
+        pos = amp + 1;
+    }
+    return string_view();
+}
+
+// ------------------- Escaping -------------------
+// Scanners return the offset of the first byte that needs escaping (or n).
+// Clean runs between those bytes are bulk-appended, so the common case of
+// plain ASCII text is one scan and one append per field.
+using EscapeScanFn = size_t (*)(const char *p, size_t n);
+
+static inline bool jsonNeedsEscape(unsigned char c) { return c < 0x20 || c == '"' || c == '\\'; }
+static inline bool htmlNeedsEscape(unsigned char c) {
+    return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+}
+
+static size_t jsonScanScalar(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && !jsonNeedsEscape((unsigned char)p[i])) ++i;
+    return i;
+}
+static size_t htmlScanScalar(const char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && !htmlNeedsEscape((unsigned char)p[i])) ++i;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 is baseline on x86-64; bytes <= 0x1F are found with an unsigned min
+// because _mm_cmplt_epi8 is signed and would also flag UTF-8 bytes.
+// The 16-byte kernels are force-inlined into the AVX2 scanners so their tails
+// are VEX-encoded too; calling legacy-SSE code with dirty upper YMM halves
+// costs a state transition per call, which dominates on short fields.
+static inline __attribute__((always_inline)) size_t jsonScan16(const char *p, size_t i, size_t n) {
+    const __m128i ctl = _mm_set1_epi8(0x1F), quote = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+                      _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    while (i < n && !jsonNeedsEscape((unsigned char)p[i])) ++i;
+    return i;
+}
+static inline __attribute__((always_inline)) size_t htmlScan16(const char *p, size_t i, size_t n) {
+    const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'),
+                  dq = _mm_set1_epi8('"'), sq = _mm_set1_epi8('\'');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, dq)),
+                                   _mm_cmpeq_epi8(v, sq)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    while (i < n && !htmlNeedsEscape((unsigned char)p[i])) ++i;
+    return i;
+}
+static size_t jsonScanSse2(const char *p, size_t n) { return jsonScan16(p, 0, n); }
+static size_t htmlScanSse2(const char *p, size_t n) { return htmlScan16(p, 0, n); }
+
+__attribute__((target("avx2")))
+static size_t jsonScanAvx2(const char *p, size_t n) {
+    const __m256i ctl = _mm256_set1_epi8(0x1F), quote = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v),
+                      _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bs)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return jsonScan16(p, i, n);
+}
+__attribute__((target("avx2")))
+static size_t htmlScanAvx2(const char *p, size_t n) {
+    const __m256i amp = _mm256_set1_epi8('&'), lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'),
+                  dq = _mm256_set1_epi8('"'), sq = _mm256_set1_epi8('\'');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, lt)),
+                      _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, dq)),
+                                      _mm256_cmpeq_epi8(v, sq)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return htmlScan16(p, i, n);
+}
+#endif
+
+struct EscapeScanners {
+    const char *name;
+    EscapeScanFn json;
+    EscapeScanFn html;
+};
+
+// Picked once at startup from CPUID; ESCAPE_SIMD=scalar|sse2 forces a lower tier
+static EscapeScanners selectEscapeScanners() {
+    const char *force = getenv("ESCAPE_SIMD");
+    string want = force ? force : "";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (want.empty() || want == "avx2") {
+        if (__builtin_cpu_supports("avx2")) return {"avx2", jsonScanAvx2, htmlScanAvx2};
+    }
+    if (want != "scalar" && __builtin_cpu_supports("sse2")) return {"sse2", jsonScanSse2, htmlScanSse2};
+#endif
+    return {"scalar", jsonScanScalar, htmlScanScalar};
+}
+static const EscapeScanners g_escape = selectEscapeScanners();
+
+// Append s as the inside of a JSON string literal (UTF-8 passes through)
+template <class Str>
+void appendJsonEscaped(Str &out, string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    const char *p = s.data();
+    size_t n = s.size();
+    while (n) {
+        size_t clean = g_escape.json(p, n);
+        out.append(p, clean);
+        if (clean == n) break;
+        unsigned char c = (unsigned char)p[clean];
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        default: {
+            char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            out.append(u, 6);
+        }
+        }
+        p += clean + 1;
+        n -= clean + 1;
+    }
+}
+
+// Append s escaped for HTML text and quoted attribute values
+template <class Str>
+void appendHtmlEscaped(Str &out, string_view s) {
+    const char *p = s.data();
+    size_t n = s.size();
+    while (n) {
+        size_t clean = g_escape.html(p, n);
+        out.append(p, clean);
+        if (clean == n) break;
+        switch (p[clean]) {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '"': out += "&quot;"; break;
+        default:  out += "&#39;"; break;
+        }
+        p += clean + 1;
+        n -= clean + 1;
+    }
+}
+
+string htmlEscape(string_view s) {
+    string out;
+    out.reserve(s.size() + 16);
+    appendHtmlEscaped(out, s);
+    return out;
+}
+
+// ------------------- Serializers -------------------
+// Append "name":"value" (no leading comma)
+template <class Str>
+static void appendJsonField(Str &out, string_view name, string_view value) {
+    out += '"';
+    out += name;
+    out += "\":\"";
+    appendJsonEscaped(out, value);
+    out += '"';
+}
+
+// One product as a JSON object
+template <class Str>
+void appendProductJson(Str &out, const Product &p) {
+    char num[32];
+    out += '{';
+    appendJsonField(out, "id", p.id);
+    out += ',';
+    appendJsonField(out, "title", p.title);
+    out.append(num, (size_t)snprintf(num, sizeof(num), ",\"price\":%.2f,", p.price));
+    appendJsonField(out, "img", p.img);
+    out.append(num, (size_t)snprintf(num, sizeof(num), ",\"stock\":%d}", p.stock));
+}
+
+// GET /api/products body
+void serializeProductsJson(ArenaString &out) {
+    out += '[';
+    {
+        lock_guard<mutex> lock(g_storage_mutex);
+        out.reserve(out.size() + products.size() * 128);
+        for (size_t i=0;i<products.size();++i) {
+            if (i) out += ',';
+            appendProductJson(out, products[i]);
+        }
+    }
+    out += ']';
+}
+
+// GET /api/products/search body: {"total":N,"results":[...]} (total before limit)
+void serializeProductSearch(ArenaString &out, const SearchQuery &q) {
+    lock_guard<mutex> lock(g_storage_mutex);
+    size_t total = 0;
+    auto hits = g_product_index.searchLocked(q, total);
+    out.reserve(out.size() + 32 + hits.size() * 128);
+    out += "{\"total\":";
+    out += to_string(total);
+    out += ",\"results\":[";
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (i) out += ',';
+        appendProductJson(out, *hits[i]);
+    }
+    out += "]}";
+}
+
+// One order as a JSON object
+template <class Str>
+void appendOrderJson(Str &out, const Order &o) {
+    out += '{';
+    appendJsonField(out, "id", o.id); out += ',';
+    appendJsonField(out, "product", o.product); out += ',';
+    appendJsonField(out, "name", o.name); out += ',';
+    appendJsonField(out, "contact", o.contact); out += ',';
+    appendJsonField(out, "email", o.email); out += ',';
+    appendJsonField(out, "address", o.address); out += ',';
+    appendJsonField(out, "productPrice", o.productPrice); out += ',';
+    appendJsonField(out, "deliveryCharges", o.deliveryCharges); out += ',';
+    appendJsonField(out, "totalAmount", o.totalAmount); out += ',';
+    appendJsonField(out, "payment", o.payment); out += ',';
+    appendJsonField(out, "createdAt", o.createdAt);
+    out += '}';
+}
+
+template <class Str>
+void appendCents(Str &out, int64_t cents) {
+    char num[32];
+    out.append(num, (size_t)snprintf(num, sizeof(num), "%s%lld.%02lld", cents < 0 ? "-" : "",
+                                     (long long)(llabs(cents) / 100), (long long)(llabs(cents) % 100)));
+}
+
+template <class Str>
+void appendSalesBucket(Str &out, const SalesBucket &b) {
+    out += "\"orders\":";
+    out += to_string(b.orders);
+    out += ",\"revenue\":";
+    appendCents(out, b.revenueCents);
+    out += ",\"averageBasket\":";
+    appendCents(out, b.orders ? b.revenueCents / (int64_t)b.orders : 0);
+}
+
+// GET /api/stats body
+void serializeSalesStats(ArenaString &out, size_t days, size_t weeks, size_t top) {
+    SalesSnapshot s = g_sales_stats.snapshot(days, weeks, top);
+    out.reserve(out.size() + 128 + (s.daily.size() + s.weekly.size()) * 80 + s.products.size() * 128);
+    out += "{\"totals\":{";
+    appendSalesBucket(out, s.total);
+    out += "},\"daily\":[";
+    for (size_t i = 0; i < s.daily.size(); ++i) {
+        if (i) out += ',';
+        out += '{';
+        appendJsonField(out, "date", s.daily[i].first);
+        out += ',';
+        appendSalesBucket(out, s.daily[i].second);
+        out += '}';
+    }
+    out += "],\"weekly\":[";
+    for (size_t i = 0; i < s.weekly.size(); ++i) {
+        if (i) out += ',';
+        out += '{';
+        appendJsonField(out, "week", s.weekly[i].first);
+        out += ',';
+        appendSalesBucket(out, s.weekly[i].second);
+        out += '}';
+    }
+    out += "],\"productCount\":";
+    out += to_string(s.productCount);
+    out += ",\"products\":[";
+    for (size_t i = 0; i < s.products.size(); ++i) {
+        const ProductSales &p = s.products[i];
+        if (i) out += ',';
+        out += '{';
+        appendJsonField(out, "title", p.title);
+        out += ",\"orders\":";
+        out += to_string(p.orders);
+        out += ",\"units\":";
+        out += to_string(p.units);
+        out += ",\"revenue\":";
+        appendCents(out, p.revenueCents);
+        out += '}';
+    }
+    out += "]}";
+}
+
+// RFC 4180: a field holding a comma, quote or line break is quoted, with
+// inner quotes doubled
+template <class Str>
+void appendCsvField(Str &out, string_view v) {
+    if (v.find_first_of(",\"\r\n") == string_view::npos) {
+        out.append(v.data(), v.size());
+        return;
+    }
+    out += '"';
+    for (char c : v) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+static const char ORDER_CSV_HEADER[] =
+    "id,product,name,contact,email,address,productPrice,deliveryCharges,totalAmount,payment,createdAt\r\n";
+
+// One order as a CSV record, columns as in ORDER_CSV_HEADER
+template <class Str>
+void appendOrderCsv(Str &out, const Order &o) {
+    for (int i = 0; i < ORDER_COLUMN_COUNT; ++i) {
+        if (i) out += ',';
+        appendCsvField(out, o.*ORDER_COLUMNS[i]);
+    }
+    out += "\r\n";
+}
+
+// GET /api/orders body
+void serializeOrdersJson(ArenaString &out) {
+    out += '[';
+    {
+        lock_guard<mutex> lock(g_storage_mutex);
+        out.reserve(out.size() + orders.size() * 320);
+        for (size_t i = 0; i < orders.size(); ++i) {
+            if (i) out += ',';
+            appendOrderJson(out, orders[i]);
+        }
+    }
+    out += ']';
+}
+
+// ------------------- Order event stream (SSE) -------------------
+// GET /api/orders/stream hands its socket to one broadcaster thread. Each new
+// order is serialized once into an immutable frame that every subscriber's
+// queue shares; the thread flushes queues with non-blocking writes, so a slow
+// admin tab only delays itself and is dropped once it falls too far behind.
+// Event ids are the numeric part of the order id, and a reconnect with
+// Last-Event-ID replays what the client missed.
+static long long orderSeq(const string &id) {
+    long long n = 0;
+    if (id.size() < 2 || id[0] != 'O') return 0;
+    if (from_chars(id.data() + 1, id.data() + id.size(), n).ec != errc()) return 0;
+    return n;
+}
+
+static shared_ptr<const string> orderEventFrame(const Order &o) {
+    auto frame = make_shared<string>();
+    frame->reserve(384);
+    *frame += "id: " + to_string(orderSeq(o.id)) + "\nevent: order\ndata: ";
+    appendOrderJson(*frame, o);
+    *frame += "\n\n";
+    return frame;
+}
+
+class OrderBroadcaster {
+public:
+    static const size_t MAX_SUBSCRIBERS = 256;
+    static const size_t MAX_QUEUED_BYTES = 1 << 20;  // per subscriber
+    static const size_t RECENT_EVENTS = 1024;        // replay window kept in memory
+    static const int HEARTBEAT_MS = 15000;
+
+    void start() {
+        if (pipe(wake_) != 0) { LOGE("order stream: pipe failed"); return; }
+        fcntl(wake_[0], F_SETFL, O_NONBLOCK);
+        fcntl(wake_[1], F_SETFL, O_NONBLOCK);
+        running_ = true;
+        thread_ = thread([this]{ run(); });
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) return;
+        wake();
+        if (thread_.joinable()) thread_.join();
+        lock_guard<mutex> lock(mtx_);
+        for (auto &s : subs_) close(s.fd);
+        subs_.clear();
+        g_sse_subscribers.store(0, memory_order_relaxed);
+        close(wake_[0]);
+        close(wake_[1]);
+    }
+
+    // Caller holds g_storage_mutex, so frames enter the stream in the order
+    // orders are stored
+    void publishLocked(const Order &o) {
+        if (!running_.load(memory_order_relaxed)) return;
+        Event ev{orderSeq(o.id), orderEventFrame(o)};
+        {
+            lock_guard<mutex> lock(mtx_);
+            recent_.push_back(ev);
+            if (recent_.size() > RECENT_EVENTS) recent_.pop_front();
+            for (auto &s : subs_) enqueueLocked(s, ev.frame);
+        }
+        wake();
+    }
+
+    // Takes ownership of fd (response head already sent). lastEventId < 0
+    // means a fresh subscription; otherwise everything after that event is
+    // replayed first. Caller holds g_storage_mutex. Returns false, leaving
+    // fd untouched, when the stream is full or not running.
+    bool subscribeLocked(int fd, long long lastEventId) {
+        if (!running_.load(memory_order_relaxed)) return false;
+        Subscriber sub;
+        sub.fd = fd;
+        {
+            lock_guard<mutex> lock(mtx_);
+            if (subs_.size() >= MAX_SUBSCRIBERS) return false;
+            if (lastEventId >= 0) {
+                auto it = find_if(recent_.begin(), recent_.end(), [&](const Event &e){ return e.id == lastEventId; });
+                if (it != recent_.end()) {
+                    for (++it; it != recent_.end(); ++it) enqueueLocked(sub, it->frame);
+                } else {
+                    // older than the window (or unknown): rebuild from the order list
+                    for (auto &o : orders) {
+                        if (orderSeq(o.id) > lastEventId) enqueueLocked(sub, orderEventFrame(o));
+                    }
+                }
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            subs_.push_back(move(sub));
+            g_sse_subscribers.store((int64_t)subs_.size(), memory_order_relaxed);
+        }
+        wake();
+        return true;
+    }
+
+private:
+    struct Event {
+        long long id;
+        shared_ptr<const string> frame;
+    };
+    struct Subscriber {
+        int fd = -1;
+        deque<shared_ptr<const string>> pending;
+        size_t offset = 0;        // bytes of pending.front() already written
+        size_t queuedBytes = 0;
+        bool dead = false;
+    };
+
+    void wake() {
+        char c = 1;
+        ssize_t ignored = write(wake_[1], &c, 1);
+        (void)ignored;
+    }
+
+    void enqueueLocked(Subscriber &s, shared_ptr<const string> frame) {
+        if (s.dead) return;
+        s.queuedBytes += frame->size();
+        s.pending.push_back(move(frame));
+        if (s.queuedBytes > MAX_QUEUED_BYTES) s.dead = true;
+    }
+
+    // Write as much as the socket takes without blocking
+    void flushLocked(Subscriber &s) {
+        while (!s.dead && !s.pending.empty()) {
+            const string &f = *s.pending.front();
+            ssize_t n = send(s.fd, f.data() + s.offset, f.size() - s.offset, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) s.dead = true;
+                return;
+            }
+            s.offset += (size_t)n;
+            if (s.offset == f.size()) {
+                s.queuedBytes -= f.size();
+                s.pending.pop_front();
+                s.offset = 0;
+            }
+        }
+    }
+
+    void run() {
+        static const shared_ptr<const string> heartbeat = make_shared<const string>(": ping\n\n");
+        auto nextHeartbeat = chrono::steady_clock::now() + chrono::milliseconds(HEARTBEAT_MS);
+        vector<pollfd> fds;
+        while (running_.load()) {
+            fds.clear();
+            fds.push_back({wake_[0], POLLIN, 0});
+            {
+                lock_guard<mutex> lock(mtx_);
+                for (auto &s : subs_) {
+                    fds.push_back({s.fd, (short)(POLLIN | (s.pending.empty() ? 0 : POLLOUT)), 0});
+                }
+            }
+            int timeout = (int)max<long long>(0, chrono::duration_cast<chrono::milliseconds>(
+                nextHeartbeat - chrono::steady_clock::now()).count());
+            if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) break;
+            if (fds[0].revents & POLLIN) {
+                char drain[64];
+                while (read(wake_[0], drain, sizeof(drain)) > 0) {}
+            }
+
+            lock_guard<mutex> lock(mtx_);
+            bool beat = chrono::steady_clock::now() >= nextHeartbeat;
+            if (beat) nextHeartbeat = chrono::steady_clock::now() + chrono::milliseconds(HEARTBEAT_MS);
+            // subscribers are only appended while we were polling, so fds[i + 1]
+            // still belongs to subs_[i]
+            for (size_t i = 0; i < subs_.size(); ++i) {
+                Subscriber &s = subs_[i];
+                short rev = i + 1 < fds.size() ? fds[i + 1].revents : 0;
+                if (rev & (POLLERR | POLLHUP | POLLNVAL)) s.dead = true;
+                if (rev & POLLIN) {
+                    // clients never send on this socket; data or EOF both end it
+                    char junk[256];
+                    ssize_t n = recv(s.fd, junk, sizeof(junk), 0);
+                    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) s.dead = true;
+                }
+                if (beat) enqueueLocked(s, heartbeat);
+                flushLocked(s);
+            }
+            for (size_t i = 0; i < subs_.size();) {
+                if (subs_[i].dead) {
+                    close(subs_[i].fd);
+                    subs_[i] = move(subs_.back());
+                    subs_.pop_back();
+                } else ++i;
+            }
+            g_sse_subscribers.store((int64_t)subs_.size(), memory_order_relaxed);
+        }
+    }
+
+    mutex mtx_;
+    vector<Subscriber> subs_;
+    deque<Event> recent_;
+    int wake_[2] = {-1, -1};
+    atomic<bool> running_{false};
+    thread thread_;
+};
+
+static OrderBroadcaster g_order_stream;
+
+// ------------------- Replica refresh -------------------
+// With a shared database other replicas add orders and edit products. Every
+// DB_REFRESH_SEC this replica reloads the (small) product table and fetches
+// orders newer than the newest it holds, looking back a little because
+// sequence values from different replicas can commit out of order.
+static const long long ORDER_REFRESH_LOOKBACK = 256;
+static const size_t ORDER_DEDUP_WINDOW = 1024;
+
+// Bumped under g_storage_mutex by every local product change, so a refresh
+// whose rows were read before that change does not overwrite it
+static uint64_t g_products_version = 0;
+
+// Appends and publishes o. With mayDuplicate it is skipped if already among
+// the newest orders: a refresh can pick up this replica's own insert before
+// its handler does, and a handler can follow a refresh that already had it.
+// Caller holds g_storage_mutex.
+static bool appendOrderLocked(const Order &o, bool mayDuplicate) {
+    size_t scanned = 0;
+    for (auto it = orders.rbegin(); mayDuplicate && it != orders.rend() && scanned < ORDER_DEDUP_WINDOW; ++it, ++scanned) {
+        if (it->id == o.id) return false;
+    }
+    orders.push_back(o);
+    trackMaxId(o.id, 'O', currentOrderID);
+    g_sales_stats.add(o);
+    g_order_stream.publishLocked(o);
+    return true;
+}
+
+#ifndef ONLINETRADERZ_NO_MAIN // main's refresher thread and hot restart only
+static int g_refresh_interval_sec = 5;
+
+static void refreshFromStorage() {
+    long long afterSeq;
+    uint64_t productsVersion;
+    {
+        lock_guard<mutex> lock(g_storage_mutex);
+        afterSeq = max(0LL, (long long)currentOrderID - ORDER_REFRESH_LOOKBACK);
+        productsVersion = g_products_version;
+    }
+    vector<Product> fresh;
+    vector<Order> newOrders;
+    if (!g_storage->loadChanges(fresh, afterSeq, newOrders)) return;
+
+    lock_guard<mutex> lock(g_storage_mutex);
+    // a local edit landed meanwhile; these rows may predate it, so wait for the next round
+    bool productsStale = productsVersion != g_products_version;
+    bool productsChanged = !productsStale && fresh.size() != products.size();
+    if (!productsStale && !productsChanged) {
+        unordered_map<string, const Product*> byId;
+        for (auto &p : products) byId[p.id] = &p;
+        for (auto &p : fresh) {
+            auto it = byId.find(p.id);
+            if (it == byId.end() || it->second->title != p.title || it->second->price != p.price ||
+                it->second->img != p.img || it->second->stock != p.stock) { productsChanged = true; break; }
+        }
+    }
+    if (productsChanged) {
+        products = move(fresh);
+        for (auto &p : products) trackMaxId(p.id, 'p', currentProductID);
+        g_product_index.rebuildLocked(products);
+    }
+    size_t added = 0;
+    for (auto &o : newOrders) added += appendOrderLocked(o, true);
+    if (productsChanged || added) LOGD("Refreshed from storage: products " + string(productsChanged ? "reloaded" : "unchanged") +
+                                       ", " + to_string(added) + " new orders");
+}
+#endif // ONLINETRADERZ_NO_MAIN
+
+// ------------------- Shipping labels -------------------
+// Labels are rendered from a template compiled once into literal runs and
+// field slots, with a Code 128 barcode of the order id drawn as one SVG path.
+// Rendered labels are kept in an LRU cache keyed by order id, so reprinting
+// a morning's batch is mostly copying. An --import can rewrite stored orders
+// (from another process, or another replica), so each entry also carries a
+// fingerprint of the fields it was rendered from and is only reused while
+// the order read from storage still matches it.
+// LABEL_CACHE_SIZE sets the number of labels kept.
+static const size_t LABELS_PER_DOCUMENT_MAX = 500;
+static size_t g_label_cache_size = 4096;
+static CacheStats *g_label_stats = registerCacheStats("shipping_labels");
+
+// Bar/space widths in modules for Code 128 values 0-105, then the stop symbol
+static const char *const CODE128_PATTERNS[] = {
+    "212222", "222122", "222221", "121223", "121322", "131222", "122213", "122312", "132212", "221213",
+    "221312", "231212", "112232", "122132", "122231", "113222", "123122", "123221", "223211", "221132",
+    "221231", "213212", "223112", "312131", "311222", "321122", "321221", "312212", "322112", "322211",
+    "212123", "212321", "232121", "111323", "131123", "131321", "112313", "132113", "132311", "211313",
+    "231113", "231311", "112133", "112331", "132131", "113123", "113321", "133121", "313121", "211331",
+    "231131", "213113", "213311", "213131", "311123", "311321", "331121", "312113", "312311", "332111",
+    "314111", "221411", "431111", "111224", "111422", "121124", "121421", "141122", "141221", "112214",
+    "112412", "122114", "122411", "142112", "142211", "241211", "221114", "413111", "241112", "134111",
+    "111242", "121142", "121241", "114212", "124112", "124211", "411212", "421112", "421211", "212141",
+    "214121", "412121", "111143", "111341", "131141", "114113", "114311", "411113", "411311", "113141",
+    "114131", "311141", "411131", "211412", "211214", "211232", "2331112",
+};
+static const int CODE128_CODE_B = 100, CODE128_CODE_C = 99;
+static const int CODE128_START_B = 104, CODE128_START_C = 105, CODE128_STOP = 106;
+
+// Symbol values for text, check symbol and stop included. Runs of four or
+// more digits use code set C (two digits per symbol), everything else code
+// set B; bytes outside printable ASCII are encoded as '?'.
+static vector<int> code128Encode(string_view text) {
+    vector<int> codes;
+    int set = 0;
+    auto use = [&](int wanted) {
+        if (set == wanted) return;
+        if (set == 0) codes.push_back(wanted == 'C' ? CODE128_START_C : CODE128_START_B);
+        else codes.push_back(wanted == 'C' ? CODE128_CODE_C : CODE128_CODE_B);
+        set = wanted;
+    };
+    for (size_t i = 0; i < text.size();) {
+        size_t run = 0;
+        while (i + run < text.size() && isdigit((unsigned char)text[i + run])) ++run;
+        if (run >= 4) {
+            if (run % 2) { // odd digit out goes first, in set B
+                use('B');
+                codes.push_back(text[i++] - 32);
+                --run;
+            }
+            use('C');
+            for (; run > 0; run -= 2, i += 2) codes.push_back((text[i] - '0') * 10 + (text[i + 1] - '0'));
+            continue;
+        }
+        use('B');
+        unsigned char c = (unsigned char)text[i++];
+        codes.push_back(c >= 32 && c < 127 ? c - 32 : '?' - 32);
+    }
+    if (codes.empty()) codes.push_back(CODE128_START_B);
+    long long sum = codes[0];
+    for (size_t k = 1; k < codes.size(); ++k) sum += (long long)k * codes[k];
+    codes.push_back((int)(sum % 103));
+    codes.push_back(CODE128_STOP);
+    return codes;
+}
+
+// Barcode as an inline SVG: one path of bars, 10-module quiet zones
+template <class Str>
+static void appendCode128Svg(Str &out, string_view text, int height = 60) {
+    const int quiet = 10;
+    vector<int> codes = code128Encode(text);
+    int width = quiet * 2 + 11 * (int)codes.size() + 2; // the stop symbol is 13 modules
+    auto num = [&](int v) {
+        char buf[16];
+        out.append(buf, (size_t)(to_chars(buf, buf + sizeof(buf), v).ptr - buf));
+    };
+    out += "<svg xmlns=\"http://www.w3.org/2000/svg\" class=\"barcode\" viewBox=\"0 0 ";
+    num(width); out += ' '; num(height);
+    out += "\" width=\""; num(width * 2); out += "\" height=\""; num(height);
+    out += "\" preserveAspectRatio=\"none\" shape-rendering=\"crispEdges\"><rect width=\"100%\" height=\"100%\" fill=\"#fff\"/>"
+           "<path fill=\"#000\" d=\"";
+    int x = quiet;
+    for (int code : codes) {
+        bool bar = true;
+        for (const char *w = CODE128_PATTERNS[code]; *w; ++w, bar = !bar) {
+            int bw = *w - '0';
+            if (bar) {
+                out += 'M'; num(x); out += " 0h"; num(bw); out += 'v'; num(height); out += 'h'; num(-bw); out += 'z';
+            }
+            x += bw;
+        }
+    }
+    out += "\"/></svg>";
+}
+
+// A template with {{field}} slots, split once into literal runs and slots.
+// Field values are HTML-escaped; {{barcode}} inserts the SVG.
+class LabelTemplate {
+public:
+    explicit LabelTemplate(string_view source) {
+        static const pair<const char*, int> names[] = {
+            {"id", F_ID}, {"name", F_NAME}, {"contact", F_CONTACT}, {"address", F_ADDRESS},
+            {"items", F_ITEMS}, {"total", F_TOTAL}, {"createdAt", F_CREATED_AT}, {"barcode", F_BARCODE},
+        };
+        while (!source.empty()) {
+            size_t open = source.find("{{");
+            size_t close = open == string_view::npos ? string_view::npos : source.find("}}", open);
+            int field = F_NONE;
+            if (close != string_view::npos) {
+                string_view name = source.substr(open + 2, close - open - 2);
+                for (auto &n : names) if (name == n.first) field = n.second;
+            }
+            if (field == F_NONE) { // no (known) slot left
+                size_t keep = close == string_view::npos ? source.size() : close + 2;
+                appendLiteral(source.substr(0, keep));
+                source.remove_prefix(keep);
+                continue;
+            }
+            appendLiteral(source.substr(0, open));
+            segments_.push_back({string(), field});
+            source.remove_prefix(close + 2);
+        }
+    }
+
+    template <class Str>
+    void render(Str &out, const Order &o) const {
+        for (auto &s : segments_) {
+            out += s.literal;
+            switch (s.field) {
+            case F_ID: appendHtmlEscaped(out, o.id); break;
+            case F_NAME: appendHtmlEscaped(out, o.name); break;
+            case F_CONTACT: appendHtmlEscaped(out, o.contact); break;
+            case F_ADDRESS: appendHtmlEscaped(out, o.address); break;
+            case F_ITEMS: appendHtmlEscaped(out, o.product); break;
+            case F_TOTAL: appendHtmlEscaped(out, o.totalAmount); break;
+            case F_CREATED_AT: appendHtmlEscaped(out, o.createdAt); break;
+            case F_BARCODE: appendCode128Svg(out, o.id); break;
+            default: break;
+            }
+        }
+    }
+
+private:
+    enum { F_NONE, F_ID, F_NAME, F_CONTACT, F_ADDRESS, F_ITEMS, F_TOTAL, F_CREATED_AT, F_BARCODE };
+    struct Segment {
+        string literal;
+        int field;
+    };
+
+    // merges into the previous run when that one has no slot yet
+    void appendLiteral(string_view text) {
+        if (!segments_.empty() && segments_.back().field == F_NONE) segments_.back().literal += text;
+        else segments_.push_back({string(text), F_NONE});
+    }
+
+    vector<Segment> segments_;
+};
+
+static const LabelTemplate &shippingLabelTemplate() {
+    static const LabelTemplate tpl(
+        "<section class='label'>\n"
+        "<h1>ONLINETRADERZ — Shipping Label</h1>\n"
+        "<div class='meta'><div><strong>Order ID:</strong> {{id}}</div>\n"
+        "<div><strong>Customer:</strong> {{name}}</div>\n"
+        "<div><strong>Contact:</strong> {{contact}}</div>\n"
+        "<div><strong>Address:</strong> {{address}}</div>\n"
+        "<div><strong>Items:</strong> {{items}}</div>\n"
+        "<div><strong>Total:</strong> RS.{{total}}</div>\n"
+        "</div>\n"
+        "<div class='barcode-wrap'>{{barcode}}<div class='barcode-text'>{{id}}</div></div>\n"
+        "</section>\n");
+    return tpl;
+}
+
+// Rendered labels by order id, least recently used evicted first
+// FNV-1a over every stored column, with a separator between fields
+static uint64_t orderFingerprint(const Order &o) {
+    uint64_t h = 1469598103934665603ULL;
+    for (auto column : ORDER_COLUMNS) {
+        for (unsigned char c : o.*column) h = (h ^ c) * 1099511628211ULL;
+        h = (h ^ 0xff) * 1099511628211ULL;
+    }
+    return h;
+}
+
+class LabelCache {
+public:
+    // Appends the cached label for o; false on a miss or if o has changed
+    // since it was rendered
+    template <class Str>
+    bool appendTo(Str &out, const Order &o) {
+        uint64_t fingerprint = orderFingerprint(o);
+        lock_guard<mutex> lock(mutex_);
+        auto it = index_.find(o.id);
+        if (it == index_.end() || it->second->fingerprint != fingerprint) {
+            g_label_stats->misses.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        out += it->second->html;
+        g_label_stats->hits.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    void put(const Order &o, string html) {
+        if (g_label_cache_size == 0) return;
+        uint64_t fingerprint = orderFingerprint(o);
+        lock_guard<mutex> lock(mutex_);
+        auto it = index_.find(o.id);
+        if (it != index_.end()) {
+            it->second->fingerprint = fingerprint;
+            it->second->html = move(html);
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return;
+        }
+        lru_.push_front({o.id, fingerprint, move(html)});
+        index_[o.id] = lru_.begin();
+        while (lru_.size() > g_label_cache_size) {
+            index_.erase(lru_.back().id);
+            lru_.pop_back();
+        }
+    }
+
+private:
+    struct Entry {
+        string id;
+        uint64_t fingerprint;
+        string html;
+    };
+    mutex mutex_;
+    list<Entry> lru_; // most recent first
+    unordered_map<string, list<Entry>::iterator> index_;
+};
+
+static LabelCache g_label_cache;
+
+// Renders the label after a cache miss and caches it
+template <class Str>
+static void renderShippingLabel(Str &out, const Order &o) {
+    string html;
+    shippingLabelTemplate().render(html, o);
+    out += html;
+    g_label_cache.put(o, move(html));
+}
+
+template <class Str>
+static void appendShippingLabel(Str &out, const Order &o) {
+    if (!g_label_cache.appendTo(out, o)) renderShippingLabel(out, o);
+}
+
+// Printable document around already rendered labels; one label per page
+template <class Str>
+static void appendLabelDocumentHead(Str &out, string_view title) {
+    out += "<!doctype html><html><head><meta charset='utf-8'><meta name='viewport' content='width=device-width,initial-scale=1'>\n<title>";
+    appendHtmlEscaped(out, title);
+    out += "</title>\n"
+           "<style>body{font-family:Arial,Helvetica,sans-serif;padding:18px;background:#f6f7fb} "
+           ".label{max-width:720px;margin:0 auto 18px;background:#fff;padding:18px;border-radius:8px;box-shadow:0 10px 30px rgba(0,0,0,0.08)} "
+           "h1{margin:0 0 8px;font-size:18px} .meta{margin:10px 0} .meta div{margin:4px 0} "
+           ".barcode-wrap{margin:12px 0;padding:8px;text-align:center} .barcode{max-width:100%} "
+           ".barcode-text{font-family:monospace;letter-spacing:2px} .notice{max-width:720px;margin:0 auto 18px;color:#a33} "
+           ".printed{text-align:center;margin-top:14px;color:#666;font-size:12px}\n"
+           "@media print{body{background:#fff;padding:0} .label{box-shadow:none;break-after:page;margin:0 auto} .notice{display:none}}"
+           "</style></head><body>\n";
+}
+
+template <class Str>
+static void appendLabelDocumentTail(Str &out) {
+    out += "<div class='printed'>Printed: ";
+    out += nowISO8601();
+    out += "</div>\n</body></html>";
+}
+
+// Records metrics and emits one access log line when handleClient returns,
+// whichever route answered
+class RequestScope {
+public:
+    explicit RequestScope(const string &clientIp) : ip_(clientIp), start_(chrono::steady_clock::now()) {
+        t_req = RequestContext();
+    }
+    // views must outlive the scope (they point into the request buffer)
+    void setRequestLine(string_view method, string_view path, string_view version) {
+        method_ = method; path_ = path; version_ = version;
+    }
+    ~RequestScope() {
+        g_open_connections.fetch_sub(1, memory_order_relaxed);
+        auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_).count();
+        if (t_req.status > 0) {
+            MetricsShard &m = metricsShard();
+            int cls = min(4, max(0, t_req.status / 100 - 1));
+            bump(m.requests[t_req.route][cls]);
+            m.latency[t_req.route].observe((uint64_t)us);
+            if (t_req.route == ROUTE_STATIC) bump(m.staticBytes, t_req.bytesSent);
+        }
+        if (method_.empty() || !g_access_log_enabled.load(memory_order_relaxed)) return;
+        if (t_req.status < 500 && g_access_log_sample < 1.0) {
+            thread_local uint64_t rng = 0x9E3779B97F4A7C15ULL ^ (uint64_t)hash<thread::id>()(this_thread::get_id());
+            rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+            if ((double)(rng >> 11) * (1.0 / 9007199254740992.0) >= g_access_log_sample) return;
+        }
+        string e;
+        e.reserve(ip_.size() + method_.size() + path_.size() + 48);
+        e += ip_;
+        e += "\t\"";
+        e += method_;
+        e += ' ';
+        string_view secret = accessTokenParam(path_);
+        for (size_t i = 0; i < path_.size(); ++i) {
+            if (!secret.empty() && path_.data() + i == secret.data()) { // keep session tokens out of the log
+                e += "REDACTED";
+                i += secret.size() - 1;
+                continue;
+            }
+            unsigned char c = (unsigned char)path_[i];
+            if (c < 0x20 || c == '"' || c == '\\' || c >= 0x7f) {
+                char hex[5]; snprintf(hex, sizeof(hex), "\\x%02x", c); e += hex;
+            } else e += (char)c;
+        }
+        if (!version_.empty()) { e += ' '; e += version_; }
+        e += "\" ";
+        e += to_string(t_req.status);
+        e += ' ';
+        e += t_req.bytesSent ? to_string(t_req.bytesSent) : string("-");
+        e += ' ';
+        e += to_string(us);
+        accessLogPush(time(nullptr), e);
+    }
+private:
+    string_view ip_, method_, path_, version_;
+    chrono::steady_clock::time_point start_;
+};
 
-// Check if orders table is empty  
-count = 0;  
-const char *countOrdersSql = "SELECT COUNT(*) FROM orders;";  
-stmt = nullptr;  
-if (sqlite3_prepare_v2(g_db, countOrdersSql, -1, &stmt, nullptr) == SQLITE_OK) {  
-    if (sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int(stmt, 0);  
-}  
-sqlite3_finalize(stmt);  
-
-if (count == 0) {  
-    string ordersPath = ensureDataFolder("orders.txt");  
-    ifstream ofile(ordersPath);  
-    if (ofile.is_open()) {  
-        LOGI("Migrating orders.txt into SQLite (orders table empty)");  
-        string line;  
-        sqlite3_exec(g_db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);  
-        const char *insertSQL = "INSERT INTO orders (id,product,name,contact,email,address,productPrice,deliveryCharges,totalAmount,payment,createdAt) VALUES (?,?,?,?,?,?,?,?,?,?,?);";  
-        sqlite3_stmt *ins = nullptr;  
-        sqlite3_prepare_v2(g_db, insertSQL, -1, &ins, nullptr);  
-        while (getline(ofile, line)) {  
-            if (line.empty()) continue;  
-            istringstream iss(line);  
-            Order o;  
-            getline(iss, o.id, '|');  
-            getline(iss, o.product, '|');  
-            getline(iss, o.name, '|');  
-            getline(iss, o.contact, '|');  
-            getline(iss, o.email, '|');  
-            getline(iss, o.address, '|');  
-            getline(iss, o.productPrice, '|');  
-            getline(iss, o.deliveryCharges, '|');  
-            getline(iss, o.totalAmount, '|');  
-            getline(iss, o.payment, '|');  
-            getline(iss, o.createdAt, '|');  
-
-            sqlite3_bind_text(ins, 1, o.id.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 2, o.product.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 3, o.name.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 4, o.contact.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 5, o.email.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 6, o.address.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 7, o.productPrice.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 8, o.deliveryCharges.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 9, o.totalAmount.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 10, o.payment.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_bind_text(ins, 11, o.createdAt.c_str(), -1, SQLITE_TRANSIENT);  
-            sqlite3_step(ins);  
-            sqlite3_reset(ins);  
-        }  
-        sqlite3_finalize(ins);  
-        sqlite3_exec(g_db, "COMMIT;", nullptr, nullptr, nullptr);  
-        ofile.close();  
-    }  
-}
+// ------------------- Backups -------------------
+// Timestamped copies of the database under BACKUP_DIR, taken every
+// BACKUP_INTERVAL_SEC and on POST /api/admin/backup by one background thread.
+// Each copy is written to a .tmp name and renamed when complete; the newest
+// BACKUP_KEEP are retained.
+static string g_backup_dir;                // BACKUP_DIR, default DATA_DIR/backups
+static int g_backup_interval_sec = 86400;  // BACKUP_INTERVAL_SEC; 0 = on demand only
+static int g_backup_keep = 7;              // BACKUP_KEEP
+static int g_backup_step_pages = 64;       // BACKUP_STEP_PAGES copied per batch
+static int g_backup_step_pause_ms = 20;    // BACKUP_STEP_PAUSE_MS between batches
 
-}
+class BackupScheduler {
+public:
+    ~BackupScheduler() { stop(); }
 
-// Load products from SQLite into memory
-void loadProducts() {
-lock_guard<mutex> lock(g_storage_mutex);
-products.clear();
-if (!g_db) return;
-const char *sql = "SELECT id, title, price, img, stock FROM products ORDER BY id;";
-sqlite3_stmt *stmt = nullptr;
-if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-while (sqlite3_step(stmt) == SQLITE_ROW) {
-Product p;
-const unsigned char *c0 = sqlite3_column_text(stmt, 0);
-const unsigned char *c1 = sqlite3_column_text(stmt, 1);
-const unsigned char* c3 = sqlite3_column_text(stmt, 3);
-p.id = c0 ? (const char*)c0 : "";
-p.title = c1 ? (const char*)c1 : "";
-p.price = sqlite3_column_double(stmt, 2);
-p.img = c3 ? (const char*)c3 : "";
-p.stock = sqlite3_column_int(stmt, 4);
-products.push_back(p);
-if (p.id.size() > 1 && p.id[0] == 'p') {
-try {
-int num = stoi(p.id.substr(1));
-if (num > currentProductID) currentProductID = num;
-} catch (...) {}
-}
+    void start() {
+        if (g_backup_dir.empty()) g_backup_dir = ensureDataFolder("backups");
+        if (mkdir(g_backup_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+            LOGW("Cannot create backup directory " + g_backup_dir + ": " + strerror(errno));
+        }
+        stop_ = false;
+        thread_ = thread([this]{ run(); });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(m_);
+            stop_ = true;
+        }
+        cancel_.store(true);
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    // Queues a backup now; false if one is already queued or running
+    bool request() {
+        {
+            lock_guard<mutex> lock(m_);
+            if (requested_ || running_ || !thread_.joinable()) return false;
+            requested_ = true;
+        }
+        cv_.notify_all();
+        return true;
+    }
+
+    template <class Str>
+    void appendStatusJson(Str &out) {
+        vector<string> files = listSnapshots();
+        lock_guard<mutex> lock(m_);
+        out += "{\"running\":";
+        out += running_ || requested_ ? "true" : "false";
+        out += ',';
+        appendJsonField(out, "dir", g_backup_dir);
+        out += ',';
+        appendJsonField(out, "lastFile", lastFile_);
+        out += ",\"lastSuccess\":" + to_string((long long)lastSuccess_);
+        out += ",\"lastDurationMs\":" + to_string(lastDurationMs_);
+        out += ',';
+        appendJsonField(out, "lastError", lastError_);
+        out += ",\"intervalSec\":" + to_string(g_backup_interval_sec);
+        out += ",\"snapshots\":[";
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (i) out += ',';
+            out += '"';
+            appendJsonEscaped(out, files[i]);
+            out += '"';
+        }
+        out += "]}";
+    }
+
+private:
+    void run() {
+        auto next = chrono::steady_clock::now() + chrono::seconds(g_backup_interval_sec);
+        unique_lock<mutex> lock(m_);
+        while (!stop_) {
+            if (g_backup_interval_sec > 0) cv_.wait_until(lock, next, [this]{ return stop_ || requested_; });
+            else cv_.wait(lock, [this]{ return stop_ || requested_; });
+            if (stop_) break;
+            if (!requested_ && chrono::steady_clock::now() < next) continue;
+            requested_ = false;
+            running_ = true;
+            lock.unlock();
+            backupOnce();
+            lock.lock();
+            running_ = false;
+            next = chrono::steady_clock::now() + chrono::seconds(g_backup_interval_sec);
+        }
+    }
+
+    void backupOnce() {
+        char stamp[32];
+        time_t now = time(nullptr);
+        tm tm;
+        gmtime_r(&now, &tm);
+        strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+        string name = string("server-") + stamp + ".db";
+        string path = g_backup_dir + "/" + name;
+        string tmp = path + ".tmp";
+        unlink(tmp.c_str());
+
+        auto started = chrono::steady_clock::now();
+        bool ok = g_storage->backupTo(tmp, g_backup_step_pages, g_backup_step_pause_ms, cancel_);
+        if (ok && rename(tmp.c_str(), path.c_str()) != 0) {
+            LOGE("Failed to rename backup " + tmp + ": " + strerror(errno));
+            ok = false;
+        }
+        if (ok) {
+            int dfd = open(g_backup_dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dfd >= 0) { fsync(dfd); close(dfd); }
+        } else {
+            unlink(tmp.c_str());
+        }
+        long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+        (ok ? g_backups_ok : g_backups_failed).fetch_add(1, memory_order_relaxed);
+        {
+            lock_guard<mutex> lock(m_);
+            lastDurationMs_ = ms;
+            if (ok) {
+                lastFile_ = name;
+                lastSuccess_ = now;
+                lastError_.clear();
+            } else {
+                lastError_ = cancel_.load() ? "cancelled" : "backup failed, see log";
+            }
+        }
+        if (ok) {
+            g_backup_last_success.store((int64_t)now, memory_order_relaxed);
+            LOGI("Backup written to " + path + " in " + to_string(ms) + " ms");
+            prune();
+        }
+    }
+
+    // Newest first
+    static vector<string> listSnapshots() {
+        vector<string> names;
+        if (DIR *d = opendir(g_backup_dir.c_str())) {
+            while (struct dirent *e = readdir(d)) {
+                string n = e->d_name;
+                if (n.compare(0, 7, "server-") == 0 && n.size() > 10 && n.compare(n.size() - 3, 3, ".db") == 0) names.push_back(n);
+            }
+            closedir(d);
+        }
+        sort(names.rbegin(), names.rend()); // timestamps sort lexically
+        return names;
+    }
+
+    static void prune() {
+        vector<string> names = listSnapshots();
+        for (size_t i = (size_t)max(1, g_backup_keep); i < names.size(); ++i) {
+            string path = g_backup_dir + "/" + names[i];
+            if (unlink(path.c_str()) == 0) LOGI("Pruned old backup " + path);
+        }
+    }
+
+    mutex m_;
+    condition_variable cv_;
+    bool stop_ = false;
+    bool requested_ = false;
+    bool running_ = false;
+    atomic<bool> cancel_{false};
+    thread thread_;
+    string lastFile_;
+    time_t lastSuccess_ = 0;
+    long long lastDurationMs_ = 0;
+    string lastError_;
+};
+
+static BackupScheduler g_backups;
+
+// ------------------- Image variants -------------------
+// /uploads/<file>.jpg?w=N serves a downscaled JPEG (sources may be JPEG, or
+// PNG when built WITH_LIBPNG). Widths snap up to a small
+// allowed set so the cache stays bounded. Variants are stored under
+// DATA_DIR/variants named by a hash of the source bytes, so replacing an
+// upload invalidates its variants. Decoding and encoding run on a separate
+// small ThreadPool with a bounded queue; an API worker never waits for one.
+// Until a variant exists the original is served uncached, so the first
+// request for a size costs bandwidth rather than a blocked worker. Sizes that
+// cannot be produced (source too narrow, undecodable) are remembered per
+// source hash and answered with the original without queueing again.
+static const int VARIANT_WIDTHS[] = {160, 320, 640, 1024};
+static const size_t IMAGE_QUEUE_MAX = 32;
+static const int VARIANT_JPEG_QUALITY = 82;
+
+static ThreadPool *g_image_pool = nullptr;
+static CacheStats *g_variant_stats = registerCacheStats("image_variants");
+
+struct SourceHash {
+    off_t size;
+    time_t mtime;
+    string hex;
+};
+static mutex g_variant_mutex;
+static unordered_map<string, SourceHash> g_source_hashes; // source path -> content hash
+static unordered_map<string, bool> g_variants_in_flight;  // variant path -> queued
+static unordered_set<string> g_variants_failed;           // variant paths resizeJpeg refused
+
+// Smallest allowed width >= requested; 0 when the original is at least as good
+static int snapVariantWidth(int requested) {
+    for (int w : VARIANT_WIDTHS) if (requested <= w) return w;
+    return 0;
 }
+
+// Content hash of a source file, recomputed only when size or mtime change
+static string sourceContentHash(const string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return "";
+    {
+        lock_guard<mutex> lock(g_variant_mutex);
+        auto it = g_source_hashes.find(path);
+        if (it != g_source_hashes.end() && it->second.size == st.st_size && it->second.mtime == st.st_mtime) return it->second.hex;
+    }
+    string bytes = readFileBinary(path);
+    if (bytes.empty()) return "";
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)fnv1a64(bytes));
+    lock_guard<mutex> lock(g_variant_mutex);
+    g_source_hashes[path] = {st.st_size, st.st_mtime, hex};
+    return hex;
 }
-sqlite3_finalize(stmt);
+
+#ifdef WITH_LIBJPEG
+struct JpegErrorJump {
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    LOGW(string("libjpeg: ") + msg);
+    longjmp(((JpegErrorJump*)cinfo->err)->jump, 1);
 }
 
-// Persist in-memory products to DB (simple: delete all and insert)
-void saveProducts() {
-lock_guard<mutex> lock(g_storage_mutex);
-if (!g_db) return;
-sqlite3_exec(g_db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
-sqlite3_exec(g_db, "DELETE FROM products;", nullptr, nullptr, nullptr);
-const char *sql = "INSERT INTO products (id, title, price, img, stock) VALUES (?, ?, ?, ?, ?);";
-sqlite3_stmt *stmt = nullptr;
-if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-for (auto &p : products) {
-sqlite3_bind_text(stmt, 1, p.id.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 2, p.title.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_double(stmt, 3, p.price);
-sqlite3_bind_text(stmt, 4, p.img.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_int(stmt, 5, p.stock);
-sqlite3_step(stmt);
-sqlite3_reset(stmt);
+// Corrupt-data warnings go to our log instead of straight to stderr
+static void jpegOutputMessage(j_common_ptr cinfo) {
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    LOGD(string("libjpeg: ") + msg);
 }
-} else {
-LOGE("Failed to prepare insert into products");
+
+// Decode a JPEG to RGB, using DCT scaling to land on the smallest size that
+// is still >= width. Returns false on any libjpeg error.
+static bool decodeJpeg(const string &src, int width, vector<unsigned char> &pixels, int &w, int &h) {
+    jpeg_decompress_struct din;
+    JpegErrorJump err;
+    din.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpegErrorExit;
+    err.mgr.output_message = jpegOutputMessage;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&din);
+        return false;
+    }
+    jpeg_create_decompress(&din);
+    jpeg_mem_src(&din, (unsigned char*)src.data(), (unsigned long)src.size());
+    jpeg_read_header(&din, TRUE);
+    din.out_color_space = JCS_RGB;
+    din.scale_num = 1;
+    din.scale_denom = 1;
+    while (din.scale_denom < 8 && (int)(din.image_width / (din.scale_denom * 2)) >= width) din.scale_denom *= 2;
+    din.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&din);
+    w = (int)din.output_width;
+    h = (int)din.output_height;
+    pixels.resize((size_t)w * h * 3);
+    while (din.output_scanline < din.output_height) {
+        JSAMPROW row = &pixels[(size_t)din.output_scanline * w * 3];
+        jpeg_read_scanlines(&din, &row, 1);
+    }
+    jpeg_finish_decompress(&din);
+    jpeg_destroy_decompress(&din);
+    return true;
 }
-sqlite3_finalize(stmt);
-sqlite3_exec(g_db, "COMMIT;", nullptr, nullptr, nullptr);
+
+#ifdef WITH_LIBPNG
+// Decode a PNG to RGB, flattening any alpha onto white
+static bool decodePng(const string &src, vector<unsigned char> &pixels, int &w, int &h) {
+    png_image img;
+    memset(&img, 0, sizeof(img));
+    img.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&img, src.data(), src.size())) return false;
+    img.format = PNG_FORMAT_RGB;
+    w = (int)img.width;
+    h = (int)img.height;
+    pixels.assign(PNG_IMAGE_SIZE(img), 0xFF);
+    if (!png_image_finish_read(&img, nullptr, pixels.data(), 0, nullptr)) {
+        LOGW(string("libpng: ") + img.message);
+        png_image_free(&img);
+        return false;
+    }
+    return true;
 }
+#endif
 
-// Load orders from SQLite into memory
-void loadOrders() {
-lock_guard<mutex> lock(g_storage_mutex);
-orders.clear();
-if (!g_db) return;
-const char *sql = "SELECT id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt FROM orders ORDER BY id;";
-sqlite3_stmt *stmt = nullptr;
-if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-while (sqlite3_step(stmt) == SQLITE_ROW) {
-Order o;
-const unsigned char *c0 = sqlite3_column_text(stmt, 0);
-const unsigned char *c1 = sqlite3_column_text(stmt, 1);
-const unsigned char* c2 = sqlite3_column_text(stmt, 2);
-const unsigned char* c3 = sqlite3_column_text(stmt, 3);
-const unsigned char* c4 = sqlite3_column_text(stmt, 4);
-const unsigned char* c5 = sqlite3_column_text(stmt, 5);
-const unsigned char* c6 = sqlite3_column_text(stmt, 6);
-const unsigned char* c7 = sqlite3_column_text(stmt, 7);
-const unsigned char* c8 = sqlite3_column_text(stmt, 8);
-const unsigned char* c9 = sqlite3_column_text(stmt, 9);
-const unsigned char* c10 = sqlite3_column_text(stmt, 10);
-o.id = c0 ? (const char*)c0 : "";
-o.product = c1 ? (const char*)c1 : "";
-o.name = c2 ? (const char*)c2 : "";
-o.contact = c3 ? (const char*)c3 : "";
-o.email = c4 ? (const char*)c4 : "";
-o.address = c5 ? (const char*)c5 : "";
-o.productPrice = c6 ? (const char*)c6 : "";
-o.deliveryCharges = c7 ? (const char*)c7 : "";
-o.totalAmount = c8 ? (const char*)c8 : "";
-o.payment = c9 ? (const char*)c9 : "";
-o.createdAt = c10 ? (const char*)c10 : "";
-orders.push_back(o);
-if (o.id.size() > 1 && o.id[0] == 'O') {
-try {
-int num = stoi(o.id.substr(1));
-if (num > currentOrderID) currentOrderID = num;
-} catch (...) {}
+// Area-average RGB pixels from sw x sh down to dw x dh
+static void boxDownscale(const vector<unsigned char> &src, int sw, int sh, vector<unsigned char> &dst, int dw, int dh) {
+    dst.resize((size_t)dw * dh * 3);
+    for (int y = 0; y < dh; ++y) {
+        int y0 = (int)((long long)y * sh / dh), y1 = max(y0 + 1, (int)((long long)(y + 1) * sh / dh));
+        for (int x = 0; x < dw; ++x) {
+            int x0 = (int)((long long)x * sw / dw), x1 = max(x0 + 1, (int)((long long)(x + 1) * sw / dw));
+            unsigned sum[3] = {0, 0, 0};
+            for (int yy = y0; yy < y1; ++yy) {
+                const unsigned char *p = &src[((size_t)yy * sw + x0) * 3];
+                for (int xx = x0; xx < x1; ++xx, p += 3) {
+                    sum[0] += p[0]; sum[1] += p[1]; sum[2] += p[2];
+                }
+            }
+            unsigned area = (unsigned)((y1 - y0) * (x1 - x0));
+            unsigned char *d = &dst[((size_t)y * dw + x) * 3];
+            for (int c = 0; c < 3; ++c) d[c] = (unsigned char)((sum[c] + area / 2) / area);
+        }
+    }
 }
+
+static bool encodeJpeg(const vector<unsigned char> &rgb, int w, int h, string &out) {
+    jpeg_compress_struct cinfo;
+    JpegErrorJump err;
+    unsigned char *encoded = nullptr;
+    unsigned long encodedSize = 0;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpegErrorExit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(encoded);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &encoded, &encodedSize);
+    cinfo.image_width = (JDIMENSION)w;
+    cinfo.image_height = (JDIMENSION)h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, VARIANT_JPEG_QUALITY, TRUE);
+    jpeg_simple_progression(&cinfo);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)&rgb[(size_t)cinfo.next_scanline * w * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    out.assign((const char*)encoded, encodedSize);
+    free(encoded);
+    return true;
 }
+
+// Source (JPEG, or PNG when built WITH_LIBPNG) -> JPEG exactly `width` wide.
+// False if the source can't be decoded or is already no wider than width.
+static bool resizeJpeg(const string &src, int width, string &out) {
+    vector<unsigned char> pixels, scaled;
+    int sw = 0, sh = 0;
+    bool decoded = false;
+    if (src.size() > 2 && (unsigned char)src[0] == 0xFF && (unsigned char)src[1] == 0xD8) {
+        decoded = decodeJpeg(src, width, pixels, sw, sh);
+    }
+#ifdef WITH_LIBPNG
+    else if (src.size() > 8 && memcmp(src.data(), "\x89PNG", 4) == 0) {
+        decoded = decodePng(src, pixels, sw, sh);
+    }
+#endif
+    if (!decoded || sw < width) return false;
+    if (sw == width) return encodeJpeg(pixels, sw, sh, out); // DCT scaling hit it exactly
+    int dh = max(1, (int)((long long)sh * width / sw));
+    boxDownscale(pixels, sw, sh, scaled, width, dh);
+    return encodeJpeg(scaled, width, dh, out);
 }
-sqlite3_finalize(stmt);
+#else
+static bool resizeJpeg(const string &, int, string &) { return false; } // built without WITH_LIBJPEG
+#endif
+
+// Path of the cached variant if it exists, or sourcePath when that width
+// can never be produced. Otherwise queues its generation (at most once) and
+// returns "" so the caller serves the original for now.
+string imageVariantPath(const string &sourcePath, int width) {
+    string hash = sourceContentHash(sourcePath);
+    if (hash.empty()) return "";
+    string variant = g_data_dir + "/variants/" + hash + "-w" + to_string(width) + ".jpg";
+    struct stat st;
+    if (stat(variant.c_str(), &st) == 0) {
+        g_variant_stats->hits.fetch_add(1, memory_order_relaxed);
+        return variant;
+    }
+    g_variant_stats->misses.fetch_add(1, memory_order_relaxed);
+    if (!g_image_pool) return "";
+    {
+        lock_guard<mutex> lock(g_variant_mutex);
+        if (g_variants_failed.count(variant)) return sourcePath;
+        if (g_variants_in_flight.count(variant)) return "";
+        g_variants_in_flight[variant] = true;
+    }
+    bool queued = g_image_pool->tryEnqueue([sourcePath, variant, width]{
+        auto start = chrono::steady_clock::now();
+        string resized;
+        bool resizedOk = resizeJpeg(readFileBinary(sourcePath), width, resized);
+        if (resizedOk && atomicWriteFile(variant, resized)) {
+            auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+            LOGD("Generated " + variant + " (" + to_string(resized.size()) + " bytes, " + to_string(ms) + " ms)");
+        }
+        lock_guard<mutex> lock(g_variant_mutex);
+        if (!resizedOk) g_variants_failed.insert(variant); // a write failure may be transient; retry those
+        g_variants_in_flight.erase(variant);
+    }, IMAGE_QUEUE_MAX);
+    if (!queued) {
+        lock_guard<mutex> lock(g_variant_mutex);
+        g_variants_in_flight.erase(variant);
+    }
+    return "";
 }
-void saveOrder(const Order &o) {
-    lock_guard<mutex> lock(g_storage_mutex);
-    if (!g_db) return;
 
-    const char *sql =
-        "INSERT INTO orders "
-        "(id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt) "
-        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+// ------------------- Multipart parsing -------------------
+// Incremental multipart/form-data parser. Bytes are fed as they come off the
+// socket and part bodies are handed to onData in pieces, never buffered
+// whole; only the last delimiter-length bytes are held back in case a
+// boundary straddles two reads. A callback returning false aborts the parse.
+class MultipartParser {
+public:
+    static const size_t MAX_PART_HEADERS = 8192;
+
+    function<bool(string_view headers)> onPartBegin; // "\r\n"-prefixed block, for headerValue()
+    function<bool(const char *data, size_t len)> onData;
+    function<bool()> onPartEnd;
 
-    sqlite3_stmt *stmt = nullptr;
+    explicit MultipartParser(string_view boundary) : delim_("\r\n--") {
+        delim_.append(boundary.data(), boundary.size());
+        buf_ = "\r\n"; // lets the first delimiter match like the others
+    }
 
-    if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, o.id.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, o.product.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 3, o.name.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 4, o.contact.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 5, o.email.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 6, o.address.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 7, o.productPrice.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 8, o.deliveryCharges.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 9, o.totalAmount.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 10, o.payment.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 11, o.createdAt.c_str(), -1, SQLITE_TRANSIENT);
+    bool done() const { return state_ == DONE; }
 
-        sqlite3_step(stmt);
+    bool feed(const char *data, size_t len) {
+        if (state_ == DONE) return true;  // epilogue is ignored
+        if (state_ == FAILED) return false;
+        buf_.append(data, len);
+        size_t pos = 0;
+        while (state_ != DONE) {
+            if (state_ == PREAMBLE || state_ == BODY) {
+                size_t d = buf_.find(delim_, pos);
+                size_t keep = delim_.size() - 1;
+                size_t end = d != string::npos ? d : max(pos, buf_.size() > keep ? buf_.size() - keep : 0);
+                if (state_ == BODY && end > pos && !onData(buf_.data() + pos, end - pos)) return fail();
+                pos = end;
+                if (d == string::npos) break;
+                if (state_ == BODY && !onPartEnd()) return fail();
+                pos += delim_.size();
+                state_ = AFTER_DELIMITER;
+            } else if (state_ == AFTER_DELIMITER) {
+                if (buf_.size() - pos < 2) break;
+                if (buf_.compare(pos, 2, "--") == 0) { state_ = DONE; break; }
+                if (buf_.compare(pos, 2, "\r\n") != 0) return fail();
+                state_ = HEADERS; // the CRLF stays so an empty header block ends at pos
+            } else {
+                size_t e = buf_.find("\r\n\r\n", pos);
+                if (e == string::npos) {
+                    if (buf_.size() - pos > MAX_PART_HEADERS) return fail();
+                    break;
+                }
+                if (!onPartBegin(string_view(buf_).substr(pos, e - pos))) return fail();
+                pos = e + 4;
+                state_ = BODY;
+            }
+        }
+        buf_.erase(0, pos);
+        return true;
     }
 
-    sqlite3_finalize(stmt);
-}
-// Persist in-memory orders to DB (simple: delete all and insert)
-void saveOrders() {
-lock_guard<mutex> lock(g_storage_mutex);
-if (!g_db) return;
-sqlite3_exec(g_db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
-sqlite3_exec(g_db, "DELETE FROM orders;", nullptr, nullptr, nullptr);
-const char *sql = "INSERT INTO orders (id, product, name, contact, email, address, productPrice, deliveryCharges, totalAmount, payment, createdAt) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
-sqlite3_stmt *stmt = nullptr;
-if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-for (auto &o : orders) {
-sqlite3_bind_text(stmt, 1, o.id.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 2, o.product.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 3, o.name.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 4, o.contact.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 5, o.email.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 6, o.address.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 7, o.productPrice.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 8, o.deliveryCharges.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 9, o.totalAmount.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 10, o.payment.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_bind_text(stmt, 11, o.createdAt.c_str(), -1, SQLITE_TRANSIENT);
-sqlite3_step(stmt);
-sqlite3_reset(stmt);
-}
-} else {
-LOGE("Failed to prepare insert into orders");
-}
-sqlite3_finalize(stmt);
-sqlite3_exec(g_db, "COMMIT;", nullptr, nullptr, nullptr);
-}
+private:
+    enum State { PREAMBLE, AFTER_DELIMITER, HEADERS, BODY, DONE, FAILED };
 
-// ------------------- Utilities (unchanged) -------------------
-string generateProductID() { return "p" + to_string(++currentProductID); }
-// ------------------- Thread-safe Order ID generation -------------------
-string generateOrderID() {
-    lock_guard<mutex> lock(g_storage_mutex); // protect currentOrderID
-    return "O" + to_string(++currentOrderID);
-}
+    bool fail() { state_ = FAILED; buf_.clear(); return false; }
 
-// ------------------- Simple JSON parser for flat keys -------------------
-map<string,string> parseJson(const string &body) {
-map<string,string> res;
-string key, val;
-enum State { NONE, IN_KEY, AFTER_KEY, IN_VAL } st = NONE;
-bool esc = false;
-for (size_t i=0;i<body.size();++i) {
-char c = body[i];
-if (st == NONE) {
-if (c == '"') { st = IN_KEY; key.clear(); esc=false; }
-} else if (st == IN_KEY) {
-if (c == '"' && !esc) { st = AFTER_KEY; }
-else {
-if (c == '\\' && !esc) esc = true; else { key.push_back(c); esc=false; }
-}
-} else if (st == AFTER_KEY) {
-if (c == ':') {
-// move to value; find starting quote
-size_t j = i+1;
-while (j < body.size() && isspace((unsigned char)body[j])) j++;
-if (j < body.size() && body[j] == '"') { st = IN_VAL; i = j; val.clear(); esc=false; }
-else {
-// non-string value (number, boolean) - capture until comma or }
-size_t k = j;
-while (k < body.size() && body[k] != ',' && body[k] != '}' && body[k] != '\n' && body[k] != '\r') k++;
-string raw = body.substr(j, k-j);
-// trim
-size_t a = raw.find_first_not_of(" \t\n\r");
-size_t b = raw.find_last_not_of(" \t\n\r");
-if (a==string::npos) res[key]=""; else res[key]=raw.substr(a, b-a+1);
-i = k-1;
-st = NONE;
+    string delim_;
+    string buf_;
+    State state_ = PREAMBLE;
+};
+
+// ------------------- Request handling (keeps original logic) -------------------
+// Case-insensitive lookup of a header value in the raw header block
+string_view headerValue(string_view headers, string_view name) {
+    size_t pos = headers.find("\r\n");
+    while (pos != string_view::npos) {
+        size_t lineStart = pos + 2;
+        size_t lineEnd = headers.find("\r\n", lineStart);
+        string_view line = headers.substr(lineStart, (lineEnd == string_view::npos ? headers.size() : lineEnd) - lineStart);
+        if (line.size() > name.size() && line[name.size()] == ':' &&
+            equal(name.begin(), name.end(), line.begin(), [](char a, char b){ return tolower((unsigned char)a) == tolower((unsigned char)b); })) {
+            return trimView(line.substr(name.size() + 1));
+        }
+        pos = lineEnd;
+    }
+    return string_view();
 }
+
+// Route a request would take, known from the request line alone. Mirrors the
+// dispatch order in handleClient so limits apply before the body is read.
+Route classifyRoute(string_view method, string_view path) {
+    if (method == "OPTIONS") return ROUTE_OPTIONS;
+    if (path.find("/api/login") == 0 && method == "POST") return ROUTE_LOGIN;
+    if (path.find("/api/addProduct") == 0 && method == "POST") return ROUTE_ADD_PRODUCT;
+    if (path.find("/api/deleteProduct") == 0 && method == "POST") return ROUTE_DELETE_PRODUCT;
+    if (path.find("/api/uploadProductImage") == 0 && method == "POST") return ROUTE_UPLOAD_IMAGE;
+    if (path.find("/api/products/search") == 0 && method == "GET") return ROUTE_PRODUCT_SEARCH;
+    if (path.find("/api/products") == 0 && method == "GET") return ROUTE_PRODUCTS;
+    if (path.find("/api/orders/stream") == 0 && method == "GET") return ROUTE_ORDERS_STREAM;
+    if (path.find("/api/orders/export") == 0 && method == "GET") return ROUTE_ORDERS_EXPORT;
+    if (path.find("/api/orders") == 0 && method == "GET") return ROUTE_ORDERS_LIST;
+    if (path.find("/api/orders") == 0 && method == "POST") return ROUTE_ORDERS_CREATE;
+    if (path.find("/api/shippingLabels") == 0 && method == "GET") return ROUTE_SHIPPING_LABELS;
+    if (path.find("/api/shippingLabel") == 0 && method == "GET") return ROUTE_SHIPPING_LABEL;
+    if (path.find("/api/stats") == 0 && method == "GET") return ROUTE_STATS;
+    if (path.find("/api/admin/backup") == 0 && (method == "GET" || method == "POST")) return ROUTE_ADMIN_BACKUP;
+    if (method == "GET" && (path == "/metrics" || path.find("/metrics?") == 0)) return ROUTE_METRICS;
+    return ROUTE_STATIC;
 }
-} else if (st == IN_VAL) {
-if (c == '"' && !esc) {
-// value ended
-res[key] = val;
-st = NONE;
-} else {
-if (c == '\\' && !esc) esc = true; else { val.push_back(c); esc=false; }
+
+// "METHOD /path HTTP/1.1" from the first header line; path defaults to "/"
+static void splitRequestLine(string_view headers, string_view &method, string_view &path, string_view &version) {
+    string_view requestLine = headers.substr(0, headers.find("\r\n"));
+    size_t sp1 = requestLine.find(' ');
+    size_t sp2 = sp1 == string_view::npos ? string_view::npos : requestLine.find(' ', sp1 + 1);
+    method = requestLine.substr(0, sp1);
+    path = sp1 == string_view::npos ? string_view() : requestLine.substr(sp1 + 1, sp2 == string_view::npos ? string_view::npos : sp2 - sp1 - 1);
+    version = sp2 == string_view::npos ? string_view() : requestLine.substr(sp2 + 1);
+    if (path.empty()) path = "/";
 }
+
+// Last X-Forwarded-For hop, i.e. the address our own proxy saw
+static string_view forwardedClientIp(string_view headers) {
+    string_view xff = headerValue(headers, "x-forwarded-for");
+    size_t comma = xff.rfind(',');
+    return trimView(comma == string_view::npos ? xff : xff.substr(comma + 1));
 }
+
+// ------------------- Admin sessions -------------------
+// POST /api/login returns a stateless token "<expires>.<nonce>.<mac>", the
+// mac being HMAC-SHA256 over the rest with ADMIN_TOKEN_SECRET, or with a
+// random key kept in DATA_DIR/session.key so restarts and hot upgrades keep
+// sessions (replicas sharing a database need the env var). Admin routes take
+// "Authorization: Bearer <token>", or ?access_token= where a browser cannot
+// set headers (EventSource, links); the access log masks the latter.
+// A token is checked by recomputing its mac and comparing in constant time;
+// verified tokens then sit in a small per-thread cache until they expire.
+// Nothing is stored server side, so a token lives until it expires or the
+// secret changes. ADMIN_AUTH=off disables the checks (load tests).
+static bool g_admin_auth_enabled = true;
+static string g_admin_user = "admin";
+static string g_admin_password = "1234";
+static int g_admin_session_ttl_sec = 12 * 3600;
+static const size_t ADMIN_TOKEN_CACHE_SLOTS = 16;
+static CacheStats *g_admin_token_stats = registerCacheStats("admin_tokens");
+
+class Sha256 {
+public:
+    Sha256() {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(h_, init, sizeof(h_));
+    }
+
+    void update(const void *data, size_t n) {
+        const uint8_t *p = (const uint8_t*)data;
+        len_ += n;
+        if (fill_) {
+            size_t take = min(n, sizeof(buf_) - fill_);
+            memcpy(buf_ + fill_, p, take);
+            fill_ += take; p += take; n -= take;
+            if (fill_ < sizeof(buf_)) return;
+            block(buf_);
+            fill_ = 0;
+        }
+        for (; n >= 64; p += 64, n -= 64) block(p);
+        memcpy(buf_, p, n);
+        fill_ = n;
+    }
+
+    void final(uint8_t out[32]) {
+        uint64_t bits = len_ * 8;
+        uint8_t pad[72] = {0x80};
+        size_t padLen = (fill_ < 56 ? 56 : 120) - fill_;
+        for (int i = 0; i < 8; ++i) pad[padLen + i] = (uint8_t)(bits >> (56 - 8 * i));
+        update(pad, padLen + 8);
+        for (int i = 0; i < 8; ++i) {
+            out[4 * i] = (uint8_t)(h_[i] >> 24); out[4 * i + 1] = (uint8_t)(h_[i] >> 16);
+            out[4 * i + 2] = (uint8_t)(h_[i] >> 8); out[4 * i + 3] = (uint8_t)h_[i];
+        }
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void block(const uint8_t *p) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4], f = h_[5], g = h_[6], h = h_[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h_[0] += a; h_[1] += b; h_[2] += c; h_[3] += d; h_[4] += e; h_[5] += f; h_[6] += g; h_[7] += h;
+    }
+
+    uint32_t h_[8];
+    uint8_t buf_[64];
+    uint64_t len_ = 0;
+    size_t fill_ = 0;
+};
+
+// HMAC-SHA256 with the padded key absorbed once, so signing costs only the
+// message blocks plus two compressions
+class HmacSha256 {
+public:
+    void setKey(string_view key) {
+        uint8_t k[64] = {0};
+        if (key.size() > sizeof(k)) {
+            Sha256 kh;
+            kh.update(key.data(), key.size());
+            kh.final(k);
+        } else {
+            memcpy(k, key.data(), key.size());
+        }
+        uint8_t ipad[64], opad[64];
+        for (int i = 0; i < 64; ++i) { ipad[i] = k[i] ^ 0x36; opad[i] = k[i] ^ 0x5c; }
+        inner_ = Sha256();
+        inner_.update(ipad, sizeof(ipad));
+        outer_ = Sha256();
+        outer_.update(opad, sizeof(opad));
+    }
+
+    void sign(string_view message, uint8_t out[32]) const {
+        Sha256 in = inner_;
+        in.update(message.data(), message.size());
+        uint8_t digest[32];
+        in.final(digest);
+        Sha256 o = outer_;
+        o.update(digest, sizeof(digest));
+        o.final(out);
+    }
+
+private:
+    Sha256 inner_, outer_;
+};
+
+static HmacSha256 g_session_hmac;
+
+// Compares without an early exit, so timing does not reveal the matching prefix
+static bool constantTimeEqual(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) diff |= (unsigned char)(a[i] ^ b[i]);
+    return diff == 0;
 }
-return res;
+
+static void sessionMacHex(string_view payload, char hex[64]) {
+    static const char digits[] = "0123456789abcdef";
+    uint8_t mac[32];
+    g_session_hmac.sign(payload, mac);
+    for (int i = 0; i < 32; ++i) { hex[2 * i] = digits[mac[i] >> 4]; hex[2 * i + 1] = digits[mac[i] & 15]; }
 }
 
-// parse application/x-www-form-urlencoded
-string urlDecode(const string &src) {
-ostringstream out;
-for (size_t i=0;i<src.size();++i) {
-if (src[i] == '+') out << ' ';
-else if (src[i] == '%' && i+2 < src.size()) {
-string hex = src.substr(i+1,2);
-char ch = (char) strtol(hex.c_str(), nullptr, 16);
-out << ch;
-i += 2;
-} else out << src[i];
+#ifndef ONLINETRADERZ_NO_MAIN // called from main only
+// ADMIN_TOKEN_SECRET, else DATA_DIR/session.key (created on first start)
+static void loadSessionSecret() {
+    if (const char *env = getenv("ADMIN_TOKEN_SECRET")) {
+        if (strlen(env) >= 16) {
+            g_session_hmac.setKey(env);
+            return;
+        }
+        LOGW("ADMIN_TOKEN_SECRET is shorter than 16 bytes; ignoring it");
+    }
+    string path = ensureDataFolder("session.key");
+    string key = readFileBinary(path);
+    if (key.size() < 32) {
+        random_device rd;
+        key.clear();
+        for (int i = 0; i < 8; ++i) {
+            uint32_t r = rd();
+            key.append((const char*)&r, sizeof(r));
+        }
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        bool saved = fd >= 0 && write(fd, key.data(), key.size()) == (ssize_t)key.size() && fsync(fd) == 0;
+        if (fd >= 0) close(fd);
+        if (!saved) LOGW("Could not save " + path + "; admin sessions end at restart");
+    }
+    g_session_hmac.setKey(key);
 }
-return out.str();
+#endif
+
+static string issueAdminToken(time_t now, time_t &expires) {
+    expires = now + g_admin_session_ttl_sec;
+    random_device rd;
+    char payload[48];
+    int n = snprintf(payload, sizeof(payload), "%lld.%08x%08x", (long long)expires, rd(), rd());
+    char mac[64];
+    sessionMacHex(string_view(payload, (size_t)n), mac);
+    string token(payload, (size_t)n);
+    token += '.';
+    token.append(mac, sizeof(mac));
+    return token;
 }
-map<string,string> parseFormUrlEncoded(const string &body) {
-map<string,string> res;
-size_t pos = 0;
-while (pos < body.size()) {
-size_t eq = body.find('=', pos);
-if (eq == string::npos) break;
-string k = body.substr(pos, eq-pos);
-size_t amp = body.find('&', eq+1);
-string v;
-if (amp == string::npos) { v = body.substr(eq+1); pos = body.size(); }
-else { v = body.substr(eq+1, amp-(eq+1)); pos = amp+1; }
-res[urlDecode(k)] = urlDecode(v);
+
+// Signature and expiry check, answered from the per-thread cache when this
+// thread has verified the token before
+static bool verifyAdminToken(string_view token, time_t now) {
+    struct Slot {
+        string token;
+        time_t expires = 0;
+    };
+    static thread_local Slot cache[ADMIN_TOKEN_CACHE_SLOTS];
+    if (token.size() > 128) return false;
+    size_t macPos = token.rfind('.');
+    if (macPos == string_view::npos || token.size() - macPos - 1 != 64) return false;
+    string_view payload = token.substr(0, macPos);
+    long long expires = 0;
+    auto res = from_chars(payload.data(), payload.data() + payload.size(), expires);
+    if (res.ec != errc() || res.ptr == payload.data() + payload.size() || *res.ptr != '.' || expires <= (long long)now) return false;
+
+    Slot &slot = cache[fnv1a64(token) % ADMIN_TOKEN_CACHE_SLOTS];
+    if (slot.expires > now && constantTimeEqual(slot.token, token)) {
+        g_admin_token_stats->hits.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+    g_admin_token_stats->misses.fetch_add(1, memory_order_relaxed);
+    char mac[64];
+    sessionMacHex(payload, mac);
+    if (!constantTimeEqual(string_view(mac, sizeof(mac)), token.substr(macPos + 1))) return false;
+    slot.token.assign(token);
+    slot.expires = (time_t)expires;
+    return true;
 }
-return res;
+
+static bool routeRequiresAdmin(Route route) {
+    switch (route) {
+    case ROUTE_ADD_PRODUCT: case ROUTE_DELETE_PRODUCT: case ROUTE_UPLOAD_IMAGE:
+    case ROUTE_ORDERS_LIST: case ROUTE_ORDERS_STREAM: case ROUTE_ORDERS_EXPORT:
+    case ROUTE_SHIPPING_LABEL: case ROUTE_SHIPPING_LABELS: case ROUTE_STATS: case ROUTE_ADMIN_BACKUP:
+        return true;
+    default:
+        return false;
+    }
 }
 
-// ------------------- Utility / HTTP -------------------
-void sendResponse(int clientSocket, const string &status, const string &contentType, const string &body) {
-stringstream response;
-response << "HTTP/1.1 " << status << "\r\n";
-response << "Content-Type: " << contentType << "\r\n";
-response << "Access-Control-Allow-Origin: *\r\n";
-response << "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n";
-response << "Access-Control-Allow-Headers: Content-Type\r\n";
-response << "Content-Length: " << body.size() << "\r\n";
-response << "Connection: close\r\n\r\n";
-response << body;
-string resStr = response.str();
-// note: ignoring send() return here (best-effort)
-send(clientSocket, resStr.c_str(), resStr.size(), 0);
-}
-
-// --- NEW: send binary response (headers + raw bytes) ---
-void sendBinaryResponse(int clientSocket, const string &status, const string &contentType, const string &bodyBytes) {
-stringstream response;
-response << "HTTP/1.1 " << status << "\r\n";
-response << "Content-Type: " << contentType << "\r\n";
-response << "Access-Control-Allow-Origin: *\r\n";
-response << "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n";
-response << "Access-Control-Allow-Headers: Content-Type\r\n";
-response << "Content-Length: " << bodyBytes.size() << "\r\n";
-response << "Connection: close\r\n\r\n";
-string headerStr = response.str();
-// send headers
-send(clientSocket, headerStr.c_str(), headerStr.size(), 0);
-// send body bytes (may contain nulls)
-if (!bodyBytes.empty()) {
-ssize_t sent = 0;
-const char *data = bodyBytes.data();
-size_t remaining = bodyBytes.size();
-while (remaining > 0) {
-ssize_t n = send(clientSocket, data + sent, remaining, 0);
-if (n <= 0) break;
-sent += n;
-remaining -= n;
-}
-}
-}
-
-string getQueryParam(const string &path, const string &key) {
-size_t q = path.find('?');
-if (q == string::npos) return "";
-string qs = path.substr(q+1);
-auto params = parseFormUrlEncoded(qs);
-if (params.find(key) != params.end()) return params[key];
-return "";
+static bool authorizeAdmin(string_view headers, string_view path) {
+    string_view token = trimView(headerValue(headers, "authorization"));
+    if (token.size() > 7 && strncasecmp(token.data(), "Bearer ", 7) == 0) token = trimView(token.substr(7));
+    else token = accessTokenParam(path);
+    return !token.empty() && verifyAdminToken(token, time(nullptr));
 }
 
-string htmlEscape(const string &s) {
-string out;
-for (char c : s) {
-    out.push_back(c);
+// ------------------- Product image upload -------------------
+// POST /api/uploadProductImage?id=<productId> with a multipart/form-data body
+// holding one file part. The file streams to public/uploads through an
+// AtomicFileWriter as it is received, named after the product and typed by
+// its magic bytes rather than the client's filename. The product row is
+// pointed at it only after the rename, so a failed upload leaves nothing.
+static size_t g_upload_max_bytes = 10u << 20; // UPLOAD_MAX_MB
+
+static const char *sniffImageExtension(string_view head) {
+    if (head.size() >= 3 && head.compare(0, 3, "\xFF\xD8\xFF") == 0) return "jpg";
+    if (head.size() >= 8 && head.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0) return "png";
+    if (head.size() >= 6 && (head.compare(0, 6, "GIF87a") == 0 || head.compare(0, 6, "GIF89a") == 0)) return "gif";
+    if (head.size() >= 12 && head.compare(0, 4, "RIFF") == 0 && head.compare(8, 4, "WEBP") == 0) return "webp";
+    return nullptr;
 }
-return out;
+
+// boundary parameter of a multipart/form-data Content-Type, unquoted
+static string_view multipartBoundary(string_view contentType) {
+    string_view type = trimView(contentType.substr(0, contentType.find(';')));
+    if (type.size() != 19 || !equal(type.begin(), type.end(), "multipart/form-data",
+                                    [](char a, char b){ return tolower((unsigned char)a) == b; })) return string_view();
+    size_t pos = contentType.find("boundary=");
+    if (pos == string_view::npos) return string_view();
+    string_view b = contentType.substr(pos + 9);
+    if (!b.empty() && b[0] == '"') {
+        b.remove_prefix(1);
+        b = b.substr(0, b.find('"'));
+    } else {
+        b = trimView(b.substr(0, b.find(';')));
+    }
+    return b.size() <= 70 ? b : string_view(); // RFC 2046 limit
 }
 
-// Simulated barcode generator (returns HTML of vertical bars)
-string generateBarcodeHtml(const string &seed) {
-// create deterministic pseudo-random bars from seed
-unsigned long hash = 1469598103934665603ULL;
-for (char c : seed) hash = (hash ^ (unsigned long)c) * 1099511628211ULL;
-// create pattern
-stringstream ss;
-ss << "<div style=\"display:flex;align-items:flex-end;height:80px;gap:2px;padding:8px;background:#fff;border:1px solid #ddd;\">\n";
-// produce 40 bars
-for (int i=0;i<40;i++) {
-// deterministic pseudo-random height based on hash and i
-hash = hash * 6364136223846793005ULL + 1442695040888963407ULL + i;
-int h = (int)(20 + (hash % 60)); // 20..79
-int w = (int)(2 + (hash % 4));   // 2..5 px
-ss << "<div style=\"width:" << w
-   << "px;height:" << h
-   << "px;background:#000;display:inline-block;\"></div>\n";
-}
-ss << "</div>\n";
-return ss.str();
+static void handleImageUpload(int clientSocket, string_view headers, string_view path, string_view bodyPrefix,
+                              size_t contentLength, ConnectionDeadline &deadline, pmr::memory_resource *mr) {
+    auto reject = [&](const char *status, const char *error) {
+        sendResponse(clientSocket, status, "application/json",
+                     string("{\"success\":false,\"error\":\"") + error + "\"}");
+        closeClient(clientSocket);
+    };
+
+    string productId = getQueryParam(path, "id", mr);
+    {
+        lock_guard<mutex> lock(g_storage_mutex);
+        // the id becomes part of the file name
+        if (!idCharsSafe(productId) || none_of(products.begin(), products.end(), [&](const Product &p){ return p.id == productId; })) {
+            return reject("404 Not Found", "Product not found");
+        }
+    }
+    string_view boundary = multipartBoundary(headerValue(headers, "content-type"));
+    if (boundary.empty()) return reject("415 Unsupported Media Type", "Expected multipart/form-data");
+    if (contentLength == 0) return reject("411 Length Required", "Content-Length required");
+    if (contentLength > g_upload_max_bytes) return reject("413 Payload Too Large", "Upload too large");
+
+    static atomic<uint64_t> uploadSeq(0);
+    unique_ptr<AtomicFileWriter> file;
+    string fileName, sniff, error;
+    bool inFile = false, sawFile = false;
+    auto openFile = [&]() {
+        const char *ext = sniffImageExtension(sniff);
+        if (!ext) { error = "Unsupported image type"; return false; }
+        fileName = productId + "-" + to_string(time(nullptr)) + "-" + to_string(uploadSeq.fetch_add(1)) + "." + ext;
+        file.reset(new AtomicFileWriter("public/uploads/" + fileName));
+        if (!file->write(sniff.data(), sniff.size())) { error = "Could not store upload"; return false; }
+        return true;
+    };
+
+    MultipartParser parser(boundary);
+    parser.onPartBegin = [&](string_view partHeaders) {
+        inFile = headerValue(partHeaders, "content-disposition").find("filename=") != string_view::npos;
+        if (inFile && sawFile) { error = "Only one file per upload"; return false; }
+        sawFile = sawFile || inFile;
+        return true;
+    };
+    parser.onData = [&](const char *data, size_t len) {
+        if (!inFile) return true; // plain form fields are ignored
+        if (file) {
+            if (file->write(data, len)) return true;
+            error = "Could not store upload";
+            return false;
+        }
+        size_t take = min(len, (size_t)12 - sniff.size()); // enough for every signature
+        sniff.append(data, take);
+        if (sniff.size() < 12) return true;
+        return openFile() && (take == len || file->write(data + take, len - take));
+    };
+    parser.onPartEnd = [&]() {
+        if (inFile && sniff.empty()) sawFile = false; // browsers send an empty part for an unset file input
+        bool ok = !inFile || file || sniff.empty() || openFile();
+        inFile = false;
+        return ok;
+    };
+
+    // the header read may have pulled in the start of the body
+    size_t received = min(bodyPrefix.size(), contentLength);
+    bool ok = parser.feed(bodyPrefix.data(), received);
+    if (ok && received < contentLength) deadline.arm(PHASE_BODY);
+    char buffer[16384];
+    while (ok && received < contentLength && !parser.done()) {
+        ssize_t n = recv(clientSocket, buffer, min(sizeof(buffer), contentLength - received), 0);
+        if (n <= 0) break;
+        received += (size_t)n;
+        ok = parser.feed(buffer, (size_t)n);
+    }
+    if (deadline.expired()) {
+        sendResponse(clientSocket, "408 Request Timeout", "text/plain", "Request Timeout");
+        closeClient(clientSocket);
+        return;
+    }
+    deadline.cancel();
+    if (!ok || !parser.done()) return reject("400 Bad Request", error.empty() ? "Malformed multipart body" : error.c_str());
+    if (!file) return reject("400 Bad Request", "No image file in upload");
+    size_t bytes = file->size();
+    if (!file->commit()) return reject("500 Internal Server Error", "Could not store upload");
+
+    string img = "uploads/" + fileName;
+    if (!g_storage->updateProductImage(productId, img)) {
+        unlink(("public/" + img).c_str());
+        return reject("500 Internal Server Error", "Could not store upload");
+    }
+    bool linked = false;
+    string previous;
+    {
+        lock_guard<mutex> lock(g_storage_mutex);
+        for (auto &p : products) {
+            if (p.id != productId) continue;
+            previous = move(p.img);
+            p.img = img;
+            g_product_index.addLocked(p);
+            ++g_products_version;
+            linked = true;
+            break;
+        }
+    }
+    if (!linked) { // deleted while the upload was in flight
+        unlink(("public/" + img).c_str());
+        return reject("404 Not Found", "Product not found");
+    }
+    // every upload gets a fresh name, so the one it replaces would be orphaned;
+    // only files this handler named for the product are removed
+    string ownPrefix = "uploads/" + productId + "-";
+    if (previous.compare(0, ownPrefix.size(), ownPrefix) == 0 && previous.find("..") == string::npos) {
+        unlink(("public/" + previous).c_str());
+    }
+    LOGI("Stored " + to_string(bytes) + " byte image for " + productId + " as " + img);
+    sendResponse(clientSocket, "200 OK", "application/json",
+                 "{\"success\":true,\"id\":\"" + productId + "\",\"img\":\"" + img + "\"}");
+    closeClient(clientSocket);
 }
 
-// ------------------- Request handling (keeps original logic) -------------------
-void handleClient(int clientSocket) {
+static void serveRequest(int clientSocket, const string &clientIp) {
+RequestArena &arena = threadArena();
+arena.reset();
+pmr::memory_resource *mr = arena.resource();
 const int BUF_SIZE = 8192;
-string request;
+ArenaString request(mr);
+request.reserve(BUF_SIZE);
+RequestScope requestScope(clientIp);
+ConnectionDeadline deadline(clientSocket);
 char buffer[BUF_SIZE];
 ssize_t n;
 
 // Read headers first (robust)  
-bool headersDone = false;  
-while (!headersDone) {  
+deadline.arm(PHASE_HEADER);
+size_t headerPos = string::npos;
+while (headerPos == string::npos) {  
     n = recv(clientSocket, buffer, BUF_SIZE, 0);  
-    if (n <= 0) { close(clientSocket); return; }  
+    if (n <= 0) {
+        if (deadline.expired() && !request.empty()) sendResponse(clientSocket, "408 Request Timeout", "text/plain", "Request Timeout");
+        closeClient(clientSocket);
+        return;
+    }  
+    size_t scanFrom = request.size() > 3 ? request.size() - 3 : 0;
     request.append(buffer, buffer + n);  
-    if (request.find("\r\n\r\n") != string::npos) { headersDone = true; break; }  
+    headerPos = request.find("\r\n\r\n", scanFrom);
+    if (headerPos == string::npos && request.size() > HEADER_MAX_BYTES) {
+        sendResponse(clientSocket, "431 Request Header Fields Too Large", "text/plain", "Request Header Fields Too Large");
+        closeClient(clientSocket);
+        return;
+    }
 }  
 
-size_t headerPos = request.find("\r\n\r\n");  
-string headers = (headerPos != string::npos) ? request.substr(0, headerPos) : "";  
-string body = (headerPos != string::npos) ? request.substr(headerPos + 4) : "";  
-
 // find Content-Length  
 size_t contentLength = 0;  
-string headersLower = headers;  
-transform(headersLower.begin(), headersLower.end(), headersLower.begin(), ::tolower);  
-size_t clPos = headersLower.find("content-length:");  
-if (clPos != string::npos) {  
-    size_t start = clPos + strlen("content-length:");  
-    while (start < headersLower.size() && isspace((unsigned char)headersLower[start])) start++;  
-    size_t end = headersLower.find("\r\n", start);  
-    string num = headersLower.substr(start, (end==string::npos?headersLower.size():end)-start);  
-    try { contentLength = stoul(num); } catch(...) { contentLength = 0; }  
-}  
+{
+    string_view headers(request.data(), headerPos);
+    string_view num = headerValue(headers, "content-length");
+    if (from_chars(num.data(), num.data() + num.size(), contentLength).ec != errc()) contentLength = 0;
+
+    // rate limit on the request line alone, before spending time on the body
+    string_view method, path, version;
+    splitRequestLine(headers, method, path, version);
+    Route route = classifyRoute(method, path);
+    string_view forwarded = g_trust_proxy ? forwardedClientIp(headers) : string_view();
+    int retryAfter = rateLimitAcquire(forwarded.empty() ? clientIp : string(forwarded), route);
+    if (retryAfter) {
+        t_req.route = route;
+        requestScope.setRequestLine(method, path, version);
+        sendResponse(clientSocket, "429 Too Many Requests", "application/json",
+                     "{\"status\":\"error\",\"message\":\"Too many requests\"}",
+                     "Retry-After: " + to_string(retryAfter) + "\r\n");
+        closeClient(clientSocket);
+        return;
+    }
+    // admin routes are refused before their body is read
+    if (g_admin_auth_enabled && routeRequiresAdmin(route) && !authorizeAdmin(headers, path)) {
+        t_req.route = route;
+        requestScope.setRequestLine(method, path, version);
+        sendResponse(clientSocket, "401 Unauthorized", "application/json",
+                     "{\"status\":\"error\",\"message\":\"Admin login required\"}", "WWW-Authenticate: Bearer\r\n");
+        closeClient(clientSocket);
+        return;
+    }
+    // uploads stream to disk instead of being read into the request buffer
+    if (route == ROUTE_UPLOAD_IMAGE) {
+        t_req.route = route;
+        requestScope.setRequestLine(method, path, version);
+        string_view bodyPrefix(request.data() + headerPos + 4, request.size() - (headerPos + 4));
+        handleImageUpload(clientSocket, headers, path, bodyPrefix, contentLength, deadline, mr);
+        return;
+    }
+    if (contentLength > g_body_max_bytes) {
+        t_req.route = route;
+        requestScope.setRequestLine(method, path, version);
+        sendResponse(clientSocket, "413 Payload Too Large", "application/json",
+                     "{\"status\":\"error\",\"message\":\"Request body too large\"}");
+        closeClient(clientSocket);
+        return;
+    }
+}
 
-// read remaining body if any  
-while (body.size() < contentLength) {  
+// read remaining body if any; the buffer grows with what actually arrives
+if (request.size() - (headerPos + 4) < contentLength) deadline.arm(PHASE_BODY);
+while (request.size() - (headerPos + 4) < contentLength) {  
     n = recv(clientSocket, buffer, BUF_SIZE, 0);  
     if (n <= 0) break;  
-    body.append(buffer, buffer + n);  
+    request.append(buffer, buffer + n);  
 }  
+if (deadline.expired()) {
+    string_view method, path, version;
+    splitRequestLine(string_view(request.data(), headerPos), method, path, version);
+    t_req.route = classifyRoute(method, path);
+    requestScope.setRequestLine(method, path, version);
+    sendResponse(clientSocket, "408 Request Timeout", "text/plain", "Request Timeout");
+    closeClient(clientSocket);
+    return;
+}
+// handler time is not bounded; the write deadline is armed when the response goes out
+deadline.cancel();
+
+// views into the request buffer; it no longer grows
+string_view headers(request.data(), headerPos);
+string_view body(request.data() + headerPos + 4, request.size() - (headerPos + 4));
 
 // parse request line  
-istringstream reqStream(request);  
-string method, path, version;  
-reqStream >> method >> path >> version;  
-if (path.empty()) path = "/";  
+string_view method, path, version;
+splitRequestLine(headers, method, path, version);
 
-// Log request (client IP not available here; kept as previously)  
-LOGI(string("Request: ") + method + " " + path);  
-LOGD(string("Raw body: [") + body + "]");  
+requestScope.setRequestLine(method, path, version);
+LOGD(string("Request: ") + clientIp + " " + string(method) + " " + string(path));
+LOGD(string("Raw body: [") + string(body) + "]");  
 
 // quick CORS preflight  
 if (method == "OPTIONS") {  
+    t_req.route = ROUTE_OPTIONS;
     sendResponse(clientSocket, "200 OK", "text/plain", "OK");  
-    close(clientSocket);  
+    closeClient(clientSocket);  
     return;  
 }  
 
@@ -803,66 +5589,87 @@ if (method == "OPTIONS") {
 
 // POST /api/login  
 if (path.find("/api/login") == 0 && method == "POST") {  
-    auto kv = parseJson(body);  
-    string username = trim(kv.count("username") ? kv["username"] : "");  
-    string password = trim(kv.count("password") ? kv["password"] : "");  
+    t_req.route = ROUTE_LOGIN;
+    auto kv = parseJson(body, mr);  
+    ArenaFields form(mr);
+    string_view username = trimView(field(kv, "username"));  
+    string_view password = trimView(field(kv, "password"));  
     // fallback to form  
     if (username.empty() && password.empty()) {  
-        auto form = parseFormUrlEncoded(body);  
-        if (form.count("username")) username = trim(form["username"]);  
-        if (form.count("password")) password = trim(form["password"]);  
+        form = parseFormUrlEncoded(body, mr);  
+        username = trimView(field(form, "username"));  
+        password = trimView(field(form, "password"));  
     }  
-    if (username == "admin" && password == "1234") {  
-        sendResponse(clientSocket, "200 OK", "text/plain", "success");  
+    // both compared in full, whichever one is wrong
+    bool userOk = constantTimeEqual(username, g_admin_user);
+    bool passwordOk = constantTimeEqual(password, g_admin_password);
+    if (userOk && passwordOk) {
+        time_t expires;
+        string token = issueAdminToken(time(nullptr), expires);
+        sendResponse(clientSocket, "200 OK", "application/json",
+                     "{\"status\":\"success\",\"token\":\"" + token + "\",\"expiresAt\":" + to_string((long long)expires) + "}",
+                     "Cache-Control: no-store\r\n");
     } else {  
         sendResponse(clientSocket, "401 Unauthorized", "text/plain", "Invalid credentials");  
     }  
-    close(clientSocket);  
+    closeClient(clientSocket);  
     return;  
 }  
 
+// GET /api/products/search?q=&limit=&minPrice=&maxPrice=&inStock=1
+if (path.find("/api/products/search") == 0 && method == "GET") {
+    t_req.route = ROUTE_PRODUCT_SEARCH;
+    size_t qpos = path.find('?');
+    ArenaFields params(mr);
+    if (qpos != string_view::npos) params = parseFormUrlEncoded(path.substr(qpos + 1), mr);
+    auto number = [&](string_view key, double def) {
+        string_view v = field(params, key);
+        if (v.empty()) return def;
+        try { return stod(string(v)); } catch (...) { return def; }
+    };
+    SearchQuery q;
+    q.text = string(field(params, "q"));
+    q.minPrice = number("minPrice", -1);
+    q.maxPrice = number("maxPrice", -1);
+    q.limit = (size_t)min(100.0, max(1.0, number("limit", 20)));
+    string_view inStock = field(params, "inStock");
+    q.inStockOnly = inStock == "1" || inStock == "true";
+    ArenaString out(mr);
+    serializeProductSearch(out, q);
+    sendResponseView(clientSocket, "200 OK", "application/json", out);
+    closeClient(clientSocket);
+    return;
+}
+
 // GET /api/products  
 if (path.find("/api/products") == 0 && method == "GET") {  
-    stringstream ss;  
-    ss << "[";  
-    // read-lock by copying products (we hold mutex while copying)  
-    {  
-        lock_guard<mutex> lock(g_storage_mutex);  
-        for (size_t i=0;i<products.size();++i) {  
-            auto &p = products[i];  
-            ss << "{"  
-               << "\"id\":\"" << htmlEscape(p.id) << "\","  
-               << "\"title\":\"" << htmlEscape(p.title) << "\","  
-               << "\"price\":" << fixed << setprecision(2) << p.price << ","  
-               << "\"img\":\"" << htmlEscape(p.img) << "\","  
-               << "\"stock\":" << p.stock  
-               << "}";  
-            if (i+1<products.size()) ss << ",";  
-        }  
-    }  
-    ss << "]";  
-    sendResponse(clientSocket, "200 OK", "application/json", ss.str());  
-    close(clientSocket);  
+    t_req.route = ROUTE_PRODUCTS;
+    ArenaString out(mr);
+    serializeProductsJson(out);
+    sendResponseView(clientSocket, "200 OK", "application/json", out);  
+    closeClient(clientSocket);  
     return;  
 }  
 
 // ------------------- POST /api/addProduct -------------------
 if (path.find("/api/addProduct") == 0 && method == "POST") {
-    json j = json::parse(body, nullptr, false);
+    t_req.route = ROUTE_ADD_PRODUCT;
+    json j = json::parse(body.begin(), body.end(), nullptr, false);
 
     // fallback for form-encoded input
     if (j.is_discarded() || !j.contains("name") || !j.contains("price")) {
-        auto form = parseFormUrlEncoded(body);
-        if (form.count("name")) j["name"] = form["name"];
+        if (!j.is_object()) j = json::object();
+        auto form = parseFormUrlEncoded(body, mr);
+        if (form.count("name")) j["name"] = string(field(form, "name"));
         if (form.count("price")) {
-            try { j["price"] = stod(form["price"]); } catch(...) { j["price"] = 0.0; }
+            try { j["price"] = stod(string(field(form, "price"))); } catch(...) { j["price"] = 0.0; }
         }
     }
 
     if (!j.contains("name") || !j.contains("price")) {
         sendResponse(clientSocket, "400 Bad Request", "application/json",
                      "{\"success\":false,\"error\":\"Invalid input\"}");
-        close(clientSocket);
+        closeClient(clientSocket);
         return;
     }
 
@@ -870,104 +5677,215 @@ if (path.find("/api/addProduct") == 0 && method == "POST") {
     double price = j["price"].get<double>();
 
     Product p;
+    p.id = generateProductID();
+    p.title = name;
+    p.price = price;
+    p.img = "";
+    p.stock = 0;
+    if (p.id.empty() || !g_storage->upsertProduct(p)) {
+        sendResponse(clientSocket, "500 Internal Server Error", "application/json",
+                     "{\"success\":false,\"error\":\"Could not save product\"}");
+        closeClient(clientSocket);
+        return;
+    }
     {
         lock_guard<mutex> lock(g_storage_mutex);
-
-        // Find max existing product ID
-        int maxID = 0;
-        for (auto &prod : products) {
-            if (prod.id.size() > 1 && prod.id[0] == 'p') {
-                try { int n = stoi(prod.id.substr(1)); if (n > maxID) maxID = n; } catch(...) {}
-            }
-        }
-        p.id = "p" + to_string(maxID + 1);
-        p.title = name;
-        p.price = price;
-        p.img = "";
-        p.stock = 0;
-
         products.push_back(p);
-
-        // Save new product to DB
-        saveProducts();
+        g_product_index.addLocked(p);
+        ++g_products_version;
     }
 
     string resp = "{\"success\":true,\"id\":\"" + p.id + "\"}";
     sendResponse(clientSocket, "200 OK", "application/json", resp);
-    close(clientSocket);
+    closeClient(clientSocket);
     return;
 }
 
 
 // POST /api/deleteProduct  
 if (path.find("/api/deleteProduct") == 0 && method == "POST") {  
-    auto kv = parseJson(body);  
-    if (kv.empty()) kv = parseFormUrlEncoded(body);  
-    string id = trim(kv.count("id") ? kv["id"] : "");  
+    t_req.route = ROUTE_DELETE_PRODUCT;
+    auto kv = parseJson(body, mr);  
+    if (kv.empty()) kv = parseFormUrlEncoded(body, mr);  
+    string_view id = trimView(field(kv, "id"));  
     if (id.empty()) {  
         sendResponse(clientSocket, "400 Bad Request", "text/plain", "id required");  
-        close(clientSocket);  
+        closeClient(clientSocket);  
         return;  
     }  
+    string productId;
+    {
+        lock_guard<mutex> lock(g_storage_mutex);
+        for (auto &p : products) if (trimView(p.id) == id) { productId = p.id; break; }
+    }
     bool deleted = false;  
-    {  
+    if (!productId.empty() && g_storage->deleteProduct(productId)) {
         lock_guard<mutex> lock(g_storage_mutex);  
         size_t before = products.size();  
         products.erase(remove_if(products.begin(), products.end(), [&](const Product &p){  
-            return trim(p.id) == id;  
+            if (p.id != productId) return false;
+            g_product_index.removeLocked(p.id);
+            return true;
         }), products.end());  
-        if (products.size() < before) {  
-            saveProducts();  
-            deleted = true;  
-        }  
+        deleted = products.size() < before;
+        ++g_products_version;
     }  
     if (deleted) sendResponse(clientSocket, "200 OK", "text/plain", "Product deleted successfully");  
     else sendResponse(clientSocket, "404 Not Found", "text/plain", "Product not found");  
-    close(clientSocket);  
+    closeClient(clientSocket);  
     return;  
 }  
-// GET /api/orders
-if (path.find("/api/orders") == 0 && method == "GET") {
-    stringstream ss;
-    ss << "[";
+// GET /api/orders/stream (Server-Sent Events; the socket moves to the broadcaster)
+if (path.find("/api/orders/stream") == 0 && method == "GET") {
+    t_req.route = ROUTE_ORDERS_STREAM;
+    // EventSource sends Last-Event-ID on reconnect; ?lastEventId= covers the first connect
+    string_view lastIdText = headerValue(headers, "last-event-id");
+    string lastIdParam;
+    if (lastIdText.empty()) {
+        lastIdParam = getQueryParam(path, "lastEventId", mr);
+        lastIdText = lastIdParam;
+    }
+    long long lastEventId = -1;
+    if (!lastIdText.empty() && from_chars(lastIdText.data(), lastIdText.data() + lastIdText.size(), lastEventId).ec != errc()) {
+        lastEventId = -1;
+    }
 
-    {
+    static const char head[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "X-Accel-Buffering: no\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: keep-alive\r\n\r\n"
+        "retry: 3000\n\n";
+    deadline.arm(PHASE_WRITE);
+    bool sent = sendAll(clientSocket, head, sizeof(head) - 1);
+    deadline.cancel();
+    bool subscribed = false;
+    if (sent) {
         lock_guard<mutex> lock(g_storage_mutex);
-        for (size_t i = 0; i < orders.size(); ++i) {
-            auto &o = orders[i];
-            ss << "{"
-               << "\"id\":\"" << htmlEscape(o.id) << "\","
-               << "\"product\":\"" << htmlEscape(o.product) << "\","
-               << "\"name\":\"" << htmlEscape(o.name) << "\","
-               << "\"contact\":\"" << htmlEscape(o.contact) << "\","
-               << "\"email\":\"" << htmlEscape(o.email) << "\","
-               << "\"address\":\"" << htmlEscape(o.address) << "\","
-               << "\"productPrice\":\"" << htmlEscape(o.productPrice) << "\","
-               << "\"deliveryCharges\":\"" << htmlEscape(o.deliveryCharges) << "\","
-               << "\"totalAmount\":\"" << htmlEscape(o.totalAmount) << "\","
-               << "\"payment\":\"" << htmlEscape(o.payment) << "\","
-               << "\"createdAt\":\"" << htmlEscape(o.createdAt) << "\""
-               << "}";
-            if (i + 1 < orders.size()) ss << ",";
-        }
-    }
-
-    ss << "]";
-    sendResponse(clientSocket, "200 OK", "application/json", ss.str());
-    close(clientSocket);
+        subscribed = g_order_stream.subscribeLocked(clientSocket, lastEventId);
+    }
+    t_req.status = subscribed ? 200 : 503;
+    if (!subscribed) {
+        if (sent) {
+            const char *full = "event: error\ndata: {\"message\":\"stream unavailable\"}\n\n";
+            sendAll(clientSocket, full, strlen(full));
+        }
+        closeClient(clientSocket);
+    }
+    return;
+}
+
+// GET /api/orders/export?format=csv|ndjson&from=&to=
+// Rows stream from a storage cursor into chunked output; neither the order
+// book nor g_storage_mutex is involved, so checkout carries on meanwhile.
+if (path.find("/api/orders/export") == 0 && method == "GET") {
+    t_req.route = ROUTE_ORDERS_EXPORT;
+    string format = getQueryParam(path, "format", mr);
+    if (format.empty()) format = "csv";
+    if (format != "csv" && format != "ndjson") {
+        sendResponse(clientSocket, "400 Bad Request", "application/json",
+                     "{\"status\":\"error\",\"message\":\"format must be csv or ndjson\"}");
+        closeClient(clientSocket);
+        return;
+    }
+    bool csv = format == "csv";
+    string from = getQueryParam(path, "from", mr);
+    string to = getQueryParam(path, "to", mr);
+
+    string head = string("HTTP/1.1 200 OK\r\n"
+                         "Content-Type: ") + (csv ? "text/csv; charset=utf-8" : "application/x-ndjson") + "\r\n"
+                  "Content-Disposition: attachment; filename=\"orders." + format + "\"\r\n"
+                  "Cache-Control: no-store\r\n"
+                  "Access-Control-Allow-Origin: *\r\n"
+                  "Transfer-Encoding: chunked\r\n"
+                  "Connection: close\r\n\r\n";
+    t_req.status = 200;
+    deadline.arm(PHASE_WRITE);
+    if (!sendAll(clientSocket, head.data(), head.size())) {
+        closeClient(clientSocket);
+        return;
+    }
+    ChunkedWriter body(clientSocket, mr);
+    if (csv) body.buffer() += ORDER_CSV_HEADER;
+    size_t rows = 0;
+    bool complete = g_storage->scanOrders(from, to, [&](const Order &o) {
+        if (csv) appendOrderCsv(body.buffer(), o);
+        else {
+            appendOrderJson(body.buffer(), o);
+            body.buffer() += '\n';
+        }
+        ++rows;
+        body.maybeFlush();
+        return body.ok();
+    });
+    // Without the final zero-length chunk the client sees a truncated
+    // transfer rather than a short file that looks complete
+    if (complete) body.finish();
+    else LOGW("Order export stopped after " + to_string(rows) + " rows");
+    closeClient(clientSocket);
+    return;
+}
+
+// GET /api/orders
+if (path.find("/api/orders") == 0 && method == "GET") {
+    t_req.route = ROUTE_ORDERS_LIST;
+    ArenaString out(mr);
+    serializeOrdersJson(out);
+    sendResponseView(clientSocket, "200 OK", "application/json", out);
+    closeClient(clientSocket);
     return;
 }
 // POST /api/orders  
 if (path.find("/api/orders") == 0 && method == "POST") {  
+    t_req.route = ROUTE_ORDERS_CREATE;
+
+    // Retries carrying an Idempotency-Key get the original response back
+    IdempotencyClaim claim;
+    uint64_t bodyHash = 0;
+    string_view idemKey = trimView(headerValue(headers, "Idempotency-Key"));
+    if (!idemKey.empty()) {
+        if (idemKey.size() > IDEMPOTENCY_MAX_KEY) {
+            sendResponse(clientSocket, "400 Bad Request", "application/json",
+                         "{\"status\":\"error\",\"message\":\"Idempotency-Key too long\"}");
+            closeClient(clientSocket);
+            return;
+        }
+        string key(idemKey), storedStatus, storedResponse;
+        bodyHash = fnv1a64(body);
+        switch (claimIdempotencyKey(key, bodyHash, storedStatus, storedResponse)) {
+        case IDEMPOTENCY_REPLAY:
+            sendResponse(clientSocket, storedStatus, "application/json", move(storedResponse),
+                         "Idempotent-Replayed: true\r\n");
+            closeClient(clientSocket);
+            return;
+        case IDEMPOTENCY_IN_FLIGHT:
+            sendResponse(clientSocket, "409 Conflict", "application/json",
+                         "{\"status\":\"error\",\"message\":\"A request with this Idempotency-Key is in progress\"}",
+                         "Retry-After: 1\r\n");
+            closeClient(clientSocket);
+            return;
+        case IDEMPOTENCY_MISMATCH:
+            sendResponse(clientSocket, "422 Unprocessable Entity", "application/json",
+                         "{\"status\":\"error\",\"message\":\"Idempotency-Key was used with a different request body\"}");
+            closeClient(clientSocket);
+            return;
+        case IDEMPOTENCY_CLAIMED:
+            claim.key = move(key);
+            break;
+        }
+    }
+
     // Accept JSON body that contains products (array of {product,qty}), plus name/contact/email/address  
     // We will compute subtotal using server-side product prices to avoid client manipulation  
-    string bodyStr = body;  
-    auto kv = parseJson(bodyStr);  
+    string_view bodyStr = body;  
+    auto kv = parseJson(bodyStr, mr);  
     // fallback to form  
-    if (kv.empty()) kv = parseFormUrlEncoded(bodyStr);  
+    if (kv.empty()) kv = parseFormUrlEncoded(bodyStr, mr);  
 
     // parse products array by scanning body string (simple approach)  
-    vector<pair<string,int>> orderProducts;  
+    pmr::vector<pair<string_view,int>> orderProducts(mr);  
     size_t pos = 0;  
     while ((pos = bodyStr.find("\"product\":", pos)) != string::npos) {  
         pos += 10;  
@@ -976,7 +5894,7 @@ if (path.find("/api/orders") == 0 && method == "POST") {
         start++;  
         size_t end = bodyStr.find('"', start);  
         if (end == string::npos) break;  
-        string prodId = bodyStr.substr(start, end-start);  
+        string_view prodId = bodyStr.substr(start, end-start);  
 
         size_t qtyPos = bodyStr.find("\"qty\":", end);  
         if (qtyPos == string::npos) break;  
@@ -984,7 +5902,8 @@ if (path.find("/api/orders") == 0 && method == "POST") {
         size_t qtyEnd = bodyStr.find_first_of(",}", qtyPos);  
         if (qtyEnd == string::npos) break;  
         int qty = 1;  
-        try { qty = stoi(bodyStr.substr(qtyPos, qtyEnd-qtyPos)); } catch(...) { qty = 1; }  
+        string_view qtyStr = trimView(bodyStr.substr(qtyPos, qtyEnd-qtyPos));
+        if (from_chars(qtyStr.data(), qtyStr.data() + qtyStr.size(), qty).ec != errc()) qty = 1;  
 
         orderProducts.push_back({prodId, qty});  
         pos = qtyEnd;  
@@ -992,22 +5911,28 @@ if (path.find("/api/orders") == 0 && method == "POST") {
 
     Order o;  
     o.id = generateOrderID();  
-    o.name = kv.count("name") ? kv["name"] : "";  
-    o.contact = kv.count("contact") ? kv["contact"] : "";  
-    o.email = kv.count("email") ? kv["email"] : "";  
-    o.address = kv.count("address") ? kv["address"] : "";  
+    if (o.id.empty()) {
+        sendResponse(clientSocket, "503 Service Unavailable", "application/json",
+                     "{\"status\":\"error\",\"message\":\"Could not save order\"}", "Retry-After: 1\r\n");
+        closeClient(clientSocket);
+        return;
+    }
+    o.name = string(field(kv, "name"));  
+    o.contact = string(field(kv, "contact"));  
+    o.email = string(field(kv, "email"));  
+    o.address = string(field(kv, "address"));  
 
     double subtotal = 0.0;  
     string prodSummary;  
     {  
         lock_guard<mutex> lock(g_storage_mutex);  
         for (auto &pp : orderProducts) {  
-            string pid = trim(pp.first);  
+            string_view pid = trimView(pp.first);  
             int qty = pp.second;  
             double price = 0.0;  
-            string title = pid;  
+            string_view title = pid;  
             for (auto &prod : products) {  
-                if (trim(prod.id) == pid) {  
+                if (trimView(prod.id) == pid) {  
                     price = prod.price;  
                     title = prod.title;  
                     break;  
@@ -1015,7 +5940,10 @@ if (path.find("/api/orders") == 0 && method == "POST") {
             }  
             subtotal += price * qty;  
             char priceBuf[64]; snprintf(priceBuf, sizeof(priceBuf), "%.2f", price);  
-            prodSummary += title + " (RS." + string(priceBuf) + ") x" + to_string(qty) + ", ";  
+            prodSummary += title;
+            prodSummary += " (RS.";
+            prodSummary += priceBuf;
+            prodSummary += ") x" + to_string(qty) + ", ";  
         }  
     }  
     if (!prodSummary.empty()) { prodSummary.pop_back(); prodSummary.pop_back(); }  
@@ -1037,70 +5965,206 @@ if (path.find("/api/orders") == 0 && method == "POST") {
     o.payment = "Cash on Delivery";  
     o.createdAt = nowISO8601();  
 
+    // Return order id so frontend can link to shipping label  
+    string response = "{\"status\":\"success\",\"message\":\"Order placed successfully\",\"orderId\":\"" + o.id + "\"}";  
+    time_t idemExpires = time(nullptr) + g_idempotency_ttl;
+
+    // The idempotency record commits atomically with the order row. Another
+    // replica may already hold the key; its stored response is replayed.
+    IdempotencyRecord record{claim.key, bodyHash, "200 OK", response, idemExpires};
+    StoreResult stored = g_storage->insertOrder(o, claim.key.empty() ? nullptr : &record);
+    if (stored == STORE_DUPLICATE_KEY && g_storage->findIdempotencyKey(claim.key, record)) {
+        bool sameBody = record.bodyHash == bodyHash;
+        completeIdempotencyKey(claim.key, record.status, record.response, record.expires);
+        claim.completed = true;
+        if (sameBody) {
+            sendResponse(clientSocket, record.status, "application/json", record.response, "Idempotent-Replayed: true\r\n");
+        } else {
+            sendResponse(clientSocket, "422 Unprocessable Entity", "application/json",
+                         "{\"status\":\"error\",\"message\":\"Idempotency-Key was used with a different request body\"}");
+        }
+        closeClient(clientSocket);
+        return;
+    }
+    if (stored != STORE_OK) {
+        sendResponse(clientSocket, "500 Internal Server Error", "application/json",
+                     "{\"status\":\"error\",\"message\":\"Could not save order\"}");
+        closeClient(clientSocket);
+        return;
+    }
     {  
         lock_guard<mutex> lock(g_storage_mutex);  
-        orders.push_back(o);  
-        // Persist orders immediately and robustly  
-        saveOrders();  
+        appendOrderLocked(o, g_storage->shared());
     }  
+    if (!claim.key.empty()) {
+        completeIdempotencyKey(claim.key, "200 OK", response, idemExpires);
+        claim.completed = true;
+    }
 
-    // Return order id so frontend can link to shipping label  
-    string response = "{\"status\":\"success\",\"message\":\"Order placed successfully\",\"orderId\":\"" + o.id + "\"}";  
     sendResponse(clientSocket, "200 OK", "application/json", response);  
-    close(clientSocket);  
+    closeClient(clientSocket);  
     return;  
 }  
 
 
 
 
-// GET /api/shippingLabel?id=ORDER_ID  
-if (path.find("/api/shippingLabel") == 0 && method == "GET") {  
-    string id = getQueryParam(path, "id");  
-    if (id.empty()) {  
-        sendResponse(clientSocket, "400 Bad Request", "text/plain", "id query param required");  
-        close(clientSocket);  
-        return;  
-    }  
-    // find order  
-    Order *found = nullptr;  
-    {  
-        lock_guard<mutex> lock(g_storage_mutex);  
-        for (auto &o : orders) if (trim(o.id) == id) { found = &o; break; }  
-    }  
-    if (!found) {  
-        sendResponse(clientSocket, "404 Not Found", "text/plain", "Order not found");  
-        close(clientSocket);  
-        return;  
-    }  
-    // Build a simple printable HTML page with order details and simulated barcode  
-    string html;  
-    html += "<!doctype html><html><head><meta charset='utf-8'><meta name='viewport' content='width=device-width,initial-scale=1'>\n";  
-    html += "<title>Shipping Label - " + htmlEscape(found->id) + "</title>\n";  
-    html += "<style>body{font-family:Arial,Helvetica,sans-serif;padding:18px;background:#f6f7fb} .label{max-width:720px;margin:0 auto;background:#fff;padding:18px;border-radius:8px;box-shadow:0 10px 30px rgba(0,0,0,0.08)} h1{margin:0 0 8px;font-size:18px} .meta{margin:10px 0} .meta div{margin:4px 0} .barcode-wrap{margin:12px 0;padding:8px;background:#fff;border-radius:6px;display:flex;justify-content:center}\n";  
-    html += "@media print{body{background:#fff} .label{box-shadow:none}}</style></head><body>\n";  
-    html += "<div class='label'>\n";  
-    html += "<h1>ONLINETRADERZ — Shipping Label</h1>\n";  
-    html += "<div class='meta'><div><strong>Order ID:</strong> " + htmlEscape(found->id) + "</div>\n";  
-    html += "<div><strong>Customer:</strong> " + htmlEscape(found->name) + "</div>\n";  
-    html += "<div><strong>Contact:</strong> " + htmlEscape(found->contact) + "</div>\n";  
-    html += "<div><strong>Address:</strong> " + htmlEscape(found->address) + "</div>\n";  
-    html += "<div><strong>Items:</strong> " + htmlEscape(found->product) + "</div>\n";  
-    html += "<div><strong>Total:</strong> RS." + htmlEscape(found->totalAmount) + "</div>\n";  
-    html += "</div>\n";  
-    html += "<div class='barcode-wrap'>\n";  
-    html += generateBarcodeHtml(found->id + "|" + found->createdAt + "|" + found->contact);  
-    html += "</div>\n";  
-    html += "<div style='text-align:center;margin-top:14px;color:#666;font-size:12px'>Printed: " + nowISO8601() + "</div>\n";  
-    html += "</div>\n</body></html>";  
-    sendResponse(clientSocket, "200 OK", "text/html", html);  
-    close(clientSocket);  
-    return;  
-}  
+// GET /api/shippingLabels?ids=O1,O2,... or ?from=&to= (createdAt range, as for the export)
+// One print document, one label per page, at most LABELS_PER_DOCUMENT_MAX labels
+if (path.find("/api/shippingLabels") == 0 && method == "GET") {
+    t_req.route = ROUTE_SHIPPING_LABELS;
+    string ids = getQueryParam(path, "ids", mr);
+    string from = getQueryParam(path, "from", mr);
+    string to = getQueryParam(path, "to", mr);
+    if (ids.empty() && from.empty() && to.empty()) {
+        sendResponse(clientSocket, "400 Bad Request", "text/plain", "ids or from/to query param required");
+        closeClient(clientSocket);
+        return;
+    }
+    ArenaString labels(mr), notice(mr);
+    size_t count = 0;
+    if (!ids.empty()) {
+        vector<string> wanted;
+        for (string_view rest = ids; !rest.empty();) {
+            size_t comma = rest.find(',');
+            string_view id = trimView(rest.substr(0, comma));
+            rest = comma == string_view::npos ? string_view() : rest.substr(comma + 1);
+            if (!id.empty() && find(wanted.begin(), wanted.end(), id) == wanted.end()) wanted.emplace_back(id);
+        }
+        if (wanted.size() > LABELS_PER_DOCUMENT_MAX) {
+            sendResponse(clientSocket, "400 Bad Request", "text/plain",
+                         "at most " + to_string(LABELS_PER_DOCUMENT_MAX) + " ids per request");
+            closeClient(clientSocket);
+            return;
+        }
+        Order order;
+        for (auto &id : wanted) {
+            if (g_storage->findOrder(id, order)) {
+                appendShippingLabel(labels, order);
+                ++count;
+                continue;
+            }
+            notice += notice.empty() ? "Not found: " : ", ";
+            appendHtmlEscaped(notice, id);
+        }
+        if (count == 0) {
+            sendResponse(clientSocket, "404 Not Found", "text/plain", "No matching orders");
+            closeClient(clientSocket);
+            return;
+        }
+    } else {
+        bool more = false;
+        g_storage->scanOrders(from, to, [&](const Order &o) {
+            if (count == LABELS_PER_DOCUMENT_MAX) { more = true; return false; }
+            appendShippingLabel(labels, o);
+            ++count;
+            return true;
+        });
+        if (more) {
+            notice += "Only the first " + to_string(LABELS_PER_DOCUMENT_MAX) + " orders are included; narrow the date range for the rest.";
+        } else if (count == 0) {
+            notice += "No orders in this date range.";
+        }
+    }
+    ArenaString html(mr);
+    html.reserve(labels.size() + 2048);
+    appendLabelDocumentHead(html, "Shipping Labels (" + to_string(count) + ")");
+    if (!notice.empty()) {
+        html += "<div class='notice'>";
+        html += notice;
+        html += "</div>\n";
+    }
+    html += labels;
+    appendLabelDocumentTail(html);
+    sendResponseView(clientSocket, "200 OK", "text/html; charset=utf-8", html);
+    closeClient(clientSocket);
+    return;
+}
+
+// GET /api/shippingLabel?id=ORDER_ID
+if (path.find("/api/shippingLabel") == 0 && method == "GET") {
+    t_req.route = ROUTE_SHIPPING_LABEL;
+    string id = getQueryParam(path, "id", mr);
+    if (id.empty()) {
+        sendResponse(clientSocket, "400 Bad Request", "text/plain", "id query param required");
+        closeClient(clientSocket);
+        return;
+    }
+    ArenaString html(mr);
+    appendLabelDocumentHead(html, "Shipping Label - " + id);
+    // a primary-key lookup on this thread's read connection, then the cache
+    Order order;
+    if (!g_storage->findOrder(id, order)) {
+        sendResponse(clientSocket, "404 Not Found", "text/plain", "Order not found");
+        closeClient(clientSocket);
+        return;
+    }
+    appendShippingLabel(html, order);
+    appendLabelDocumentTail(html);
+    sendResponseView(clientSocket, "200 OK", "text/html; charset=utf-8", html);
+    closeClient(clientSocket);
+    return;
+}
+
+// GET /api/stats?days=30&weeks=12&top=20
+if (path.find("/api/stats") == 0 && method == "GET") {
+    t_req.route = ROUTE_STATS;
+    size_t qpos = path.find('?');
+    ArenaFields params(mr);
+    if (qpos != string_view::npos) params = parseFormUrlEncoded(path.substr(qpos + 1), mr);
+    auto count = [&](string_view key, size_t def, size_t cap) {
+        string_view v = field(params, key);
+        size_t n = def;
+        if (!v.empty() && from_chars(v.data(), v.data() + v.size(), n).ec != errc()) n = def;
+        return min(n, cap);
+    };
+    ArenaString out(mr);
+    serializeSalesStats(out, count("days", 30, 366), count("weeks", 12, 104), count("top", 20, 200));
+    sendResponseView(clientSocket, "200 OK", "application/json", out);
+    closeClient(clientSocket);
+    return;
+}
+
+// POST /api/admin/backup starts a backup; GET reports the last one and the snapshots kept
+if (path.find("/api/admin/backup") == 0 && (method == "GET" || method == "POST")) {
+    t_req.route = ROUTE_ADMIN_BACKUP;
+    if (!g_storage->canBackup()) {
+        sendResponse(clientSocket, "501 Not Implemented", "application/json",
+                     string("{\"status\":\"error\",\"message\":\"Backups are not available for ") + g_storage->name() + " storage\"}");
+    } else if (method == "POST") {
+        if (g_backups.request()) {
+            sendResponse(clientSocket, "202 Accepted", "application/json", "{\"status\":\"started\"}");
+        } else {
+            sendResponse(clientSocket, "409 Conflict", "application/json",
+                         "{\"status\":\"error\",\"message\":\"A backup is already running\"}");
+        }
+    } else {
+        ArenaString out(mr);
+        g_backups.appendStatusJson(out);
+        sendResponseView(clientSocket, "200 OK", "application/json", out);
+    }
+    closeClient(clientSocket);
+    return;
+}
+
+// GET /metrics (Prometheus text exposition)
+if (method == "GET" && (path == "/metrics" || path.find("/metrics?") == 0)) {
+    t_req.route = ROUTE_METRICS;
+    sendResponse(clientSocket, "200 OK", "text/plain; version=0.0.4", renderMetrics());
+    closeClient(clientSocket);
+    return;
+}
 
 // Serve static files from public/ (fallback)  
-string assetPath = path;  
+t_req.route = ROUTE_STATIC;
+size_t queryPos = path.find('?');
+string assetPath(path.substr(0, queryPos));  
 if (assetPath == "/") assetPath = "/index.html";  
+if (assetPath.find("..") != string::npos) {
+    sendResponse(clientSocket, "404 Not Found", "text/html", "<h1>404 Not Found</h1>");
+    closeClient(clientSocket);
+    return;
+}
 
 // Determine content type first  
 string contentType = "text/html";  
@@ -1117,7 +6181,7 @@ else if (assetLower.find(".ico") != string::npos) contentType = "image/x-icon";
 else if (assetLower.find(".bmp") != string::npos) contentType = "image/bmp";  
 else if (assetLower.find(".avif") != string::npos) contentType = "image/avif";  
 
-// For images and other binary types, read binary and send with binary sender  
+// For images and other binary types, read the file in binary mode  
 bool isBinary = false;  
 if (assetLower.find(".png") != string::npos ||  
     assetLower.find(".jpg") != string::npos ||  
@@ -1132,12 +6196,30 @@ if (assetLower.find(".png") != string::npos ||
 
 // Build full path and log it (helps debugging missing files)  
 string fullPath = "public" + assetPath;  
-LOGI(string("Static request -> ") + fullPath);  
+LOGD(string("Static request -> ") + fullPath);  
+
+// resized upload: /uploads/x.jpg?w=320
+string cacheHeaders;
+if (contentType == "image/jpeg" && assetPath.compare(0, 9, "/uploads/") == 0 && queryPos != string_view::npos) {
+    string w = getQueryParam(path, "w", mr);
+    int width = 0;
+    from_chars(w.data(), w.data() + w.size(), width);
+    int snapped = width > 0 ? snapVariantWidth(width) : 0;
+    if (snapped) {
+        string variant = imageVariantPath(fullPath, snapped);
+        if (!variant.empty()) {
+            fullPath = variant;
+            cacheHeaders = "Cache-Control: public, max-age=86400\r\n";
+        } else {
+            cacheHeaders = "Cache-Control: no-store\r\n"; // original stands in until the variant is ready
+        }
+    }
+}
 
 if (isBinary) {  
     string fileContentBin = readFileBinary(fullPath);  
     if (!fileContentBin.empty()) {  
-        sendBinaryResponse(clientSocket, "200 OK", contentType, fileContentBin);  
+        sendResponse(clientSocket, "200 OK", contentType, move(fileContentBin), cacheHeaders);  
     } else {  
         LOGW(string("Static file not found: ") + fullPath);  
         sendResponse(clientSocket, "404 Not Found", "text/html", "<h1>404 Not Found</h1>");  
@@ -1145,29 +6227,398 @@ if (isBinary) {
 } else {  
     string fileContent = readFile(fullPath);  
     if (!fileContent.empty()) {  
-        sendResponse(clientSocket, "200 OK", contentType, fileContent);  
+        sendResponse(clientSocket, "200 OK", contentType, move(fileContent));  
     } else {  
         LOGW(string("Static file not found: ") + fullPath);  
         sendResponse(clientSocket, "404 Not Found", "text/html", "<h1>404 Not Found</h1>");  
     }  
 }  
 
-close(clientSocket);
+closeClient(clientSocket);
+
+}
+
+// An escaping exception must not leak the connection
+void handleClient(int clientSocket, const string &clientIp) {
+    t_client_fd = clientSocket;
+    try {
+        serveRequest(clientSocket, clientIp);
+    } catch (const exception &e) {
+        LOGE("Request handler failed: " + string(e.what()));
+    } catch (...) {
+        LOGE("Request handler failed");
+    }
+    if (t_client_fd == clientSocket) closeClient(clientSocket);
+}
+
+
+#ifndef ONLINETRADERZ_NO_MAIN // benchmark builds link the handlers without main
+// ------------------- Hot restart -------------------
+// SIGUSR2 hands the listening socket to a freshly started copy of the binary
+// (found by the path this process was started from, so a deploy that replaced
+// the file runs the new build):
+//   1. The successor is spawned with one end of a Unix socket pair in
+//      ONLINETRADERZ_HANDOFF_FD and loads its data while this process serves.
+//   2. It sends READY; this process stops accepting and passes the listener
+//      over with SCM_RIGHTS. New connections queue in the listen backlog.
+//   3. This process drains its in-flight requests (DRAIN_TIMEOUT_SEC), sends
+//      DRAINED and exits. With SQLite the successor waits for DRAINED and picks
+//      up the orders written meanwhile before it accepts; with shared storage
+//      it starts accepting at once.
+// If the successor exits or misses UPGRADE_TIMEOUT_SEC it is killed and this
+// process carries on.
+static const char *HANDOFF_ENV = "ONLINETRADERZ_HANDOFF_FD";
+static const char HANDOFF_READY = 'R';
+static const char HANDOFF_DRAINED = 'D';
+static int g_drain_timeout_sec = 15;     // DRAIN_TIMEOUT_SEC
+static int g_upgrade_timeout_sec = 120;  // UPGRADE_TIMEOUT_SEC
+static string g_exe_path;
+static vector<string> g_exe_args;
+
+static bool sendListener(int channel, int fd) {
+    char byte = 'L';
+    struct iovec iov = { &byte, 1 };
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    ssize_t n;
+    do n = sendmsg(channel, &msg, MSG_NOSIGNAL); while (n < 0 && errno == EINTR);
+    return n == 1;
+}
+
+static int receiveListener(int channel) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC); while (n < 0 && errno == EINTR);
+    if (n != 1) return -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c), sizeof(int));
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static bool sendHandoffByte(int channel, char b) {
+    ssize_t n;
+    do n = send(channel, &b, 1, MSG_NOSIGNAL); while (n < 0 && errno == EINTR);
+    return n == 1;
+}
+
+// Waits up to timeoutMs for byte `want`; false on timeout, EOF or anything else
+static bool waitHandoffByte(int channel, char want, int timeoutMs) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+    while (true) {
+        int left = (int)chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (left <= 0) return false;
+        struct pollfd p = { channel, POLLIN, 0 };
+        int r = poll(&p, 1, left);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        char b;
+        ssize_t n = recv(channel, &b, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        return n == 1 && b == want;
+    }
+}
+
+// The predecessor side of one handoff attempt
+class Successor {
+public:
+    ~Successor() { if (channel_ >= 0) close(channel_); }
+
+    bool spawn() {
+        int ends[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ends) != 0) {
+            LOGE(string("Hot restart: socketpair failed: ") + strerror(errno));
+            return false;
+        }
+        // everything exec needs is built before fork; the child only makes
+        // async-signal-safe calls
+        vector<string> env;
+        string prefix = string(HANDOFF_ENV) + "=";
+        for (char **e = environ; *e; ++e) {
+            if (strncmp(*e, prefix.c_str(), prefix.size()) != 0) env.push_back(*e);
+        }
+        env.push_back(prefix + to_string(ends[1]));
+        vector<char*> envp, argv;
+        for (auto &s : env) envp.push_back(&s[0]);
+        envp.push_back(nullptr);
+        for (auto &s : g_exe_args) argv.push_back(const_cast<char*>(s.c_str()));
+        argv.push_back(nullptr);
+        struct rlimit rl{};
+        int maxFd = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (int)min<rlim_t>(rl.rlim_cur, 65536) : 65536;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            // client sockets, log files and the listener must not leak into the successor
+            for (int fd = 3; fd < maxFd; ++fd) if (fd != ends[1]) close(fd);
+            fcntl(ends[1], F_SETFD, 0);
+            execve(g_exe_path.c_str(), argv.data(), envp.data());
+            _exit(127);
+        }
+        close(ends[1]);
+        if (pid < 0) {
+            LOGE(string("Hot restart: fork failed: ") + strerror(errno));
+            close(ends[0]);
+            return false;
+        }
+        channel_ = ends[0];
+        pid_.store(pid);
+        LOGI("Hot restart: started successor pid " + to_string(pid) + " (" + g_exe_path + ")");
+        return true;
+    }
+
+    bool waitReady() {
+        if (waitHandoffByte(channel_, HANDOFF_READY, g_upgrade_timeout_sec * 1000)) return true;
+        pid_t pid = pid_.load();
+        LOGE("Hot restart: successor pid " + to_string(pid) + " did not become ready; keeping this process");
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        pid_.store(-1);
+        return false;
+    }
+
+    int channel() const { return channel_; }
+
+    // Makes a pending waitReady() fail now (shutdown while starting)
+    void cancel() {
+        pid_t pid = pid_.load();
+        if (pid > 0) kill(pid, SIGKILL);
+    }
+
+private:
+    atomic<pid_t> pid_{-1};
+    int channel_ = -1;
+};
+
+// Binds a fresh listening socket on port; -1 on failure
+static int openListener(int port) {
+    int server_fd;  
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {  
+        perror("socket failed");  
+        return -1;  
+    }  
+
+    int opt = 1;  
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {  
+        perror("setsockopt SO_REUSEADDR failed");  
+    }
+
+#ifdef SO_REUSEPORT
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed (non-fatal)");
+    }
+#endif
+
+    struct sockaddr_in address{};  
+    address.sin_family = AF_INET;  
+    address.sin_addr.s_addr = INADDR_ANY;  
+    address.sin_port = htons(port);  
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {  
+        perror("bind failed");  
+        close(server_fd);
+        return -1;  
+    }  
+
+    if (listen(server_fd, 128) < 0) {  
+        perror("listen");  
+        close(server_fd);
+        return -1;  
+    }  
+    return server_fd;
+}
 
+// Successor side: reports READY, receives the predecessor's listener and,
+// unless storage is shared, waits for DRAINED and catches up on its writes.
+// port is set to the one the listener is bound to.
+static int takeOverListener(int channel, int &port) {
+    int server_fd = -1;
+    if (sendHandoffByte(channel, HANDOFF_READY)) server_fd = receiveListener(channel);
+    if (server_fd < 0) {
+        LOGE("Hot restart: did not receive the listening socket");
+        close(channel);
+        return -1;
+    }
+    if (!g_storage->shared()) {
+        if (!waitHandoffByte(channel, HANDOFF_DRAINED, (g_drain_timeout_sec + 30) * 1000)) {
+            LOGW("Hot restart: predecessor did not report drained; continuing");
+        }
+        refreshFromStorage();
+    }
+    close(channel);
+    struct sockaddr_in bound{};
+    socklen_t len = sizeof(bound);
+    if (getsockname(server_fd, (struct sockaddr *)&bound, &len) == 0) port = ntohs(bound.sin_port);
+    LOGI("Hot restart: took over the listening socket");
+    return server_fd;
 }
 
+// Waits for accepted connections to finish; past the deadline their pending
+// read/write deadlines fire at once so blocked workers give up. True if
+// every connection finished in time.
+static bool drainConnections(int timeoutSec) {
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(timeoutSec);
+    while (g_open_connections.load(memory_order_relaxed) > 0 && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(20));
+    }
+    int64_t left = g_open_connections.load(memory_order_relaxed);
+    if (left > 0) {
+        LOGW("Drain deadline passed with " + to_string(left) + " connections open; closing them");
+        g_timer_wheel.expireAll();
+    }
+    return left == 0;
+}
 
 // ------------------- Main -------------------
 
-int main() {
+int main(int argc, char **argv) {
+    // re-executed on SIGUSR2; resolve the path now so a replaced binary is picked up
+    char exe[4096];
+    ssize_t exeLen = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    g_exe_path = exeLen > 0 ? string(exe, (size_t)exeLen) : string(argv[0]);
+    g_exe_args.assign(argv, argv + argc);
+    string importPath;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--import") != 0) continue;
+        if (i + 1 >= argc) {
+            fprintf(stderr, "usage: %s --import FILE\n", argv[0]);
+            return 2;
+        }
+        importPath = argv[++i];
+    }
+    int handoffChannel = -1;
+    if (const char *env_handoff = getenv(HANDOFF_ENV)) {
+        handoffChannel = atoi(env_handoff);
+        unsetenv(HANDOFF_ENV);
+        fcntl(handoffChannel, F_SETFD, FD_CLOEXEC);
+    }
+
     // Enhancement: read env config before continuing
     const char *envp_port = getenv("PORT");
     const char *env_workers = getenv("MAX_WORKERS");
     const char *env_data = getenv("DATA_DIR");
+    const char *env_log_level = getenv("LOG_LEVEL");
+
+    const char *env_access_log = getenv("ACCESS_LOG");
+    const char *env_access_sample = getenv("ACCESS_LOG_SAMPLE");
+    const char *env_access_max = getenv("ACCESS_LOG_MAX_MB");
+    const char *env_access_keep = getenv("ACCESS_LOG_KEEP");
+    const char *env_idem_ttl = getenv("IDEMPOTENCY_TTL");
+    const char *env_rate_limit = getenv("RATE_LIMIT");
+    const char *env_rate_scale = getenv("RATE_LIMIT_SCALE");
+    const char *env_trust_proxy = getenv("TRUST_PROXY");
+    const char *env_header_timeout = getenv("HEADER_TIMEOUT_MS");
+    const char *env_body_timeout = getenv("BODY_TIMEOUT_MS");
+    const char *env_write_timeout = getenv("WRITE_TIMEOUT_MS");
+
+    if (env_log_level && strlen(env_log_level) > 0) {
+        g_log_level.store(parseLogLevel(env_log_level, LOG_INFO));
+    }
+    if (env_access_log && (string(env_access_log) == "off" || string(env_access_log) == "0")) {
+        g_access_log_enabled.store(false);
+    }
+    if (env_access_sample && strlen(env_access_sample) > 0) {
+        try { g_access_log_sample = min(1.0, max(0.0, stod(string(env_access_sample)))); } catch(...) { g_access_log_sample = 1.0; }
+    }
+    if (env_access_max && strlen(env_access_max) > 0) {
+        try { g_access_log_max_bytes = (size_t)max(1, stoi(string(env_access_max))) << 20; } catch(...) {}
+    }
+    if (env_access_keep && strlen(env_access_keep) > 0) {
+        try { g_access_log_keep = max(0, stoi(string(env_access_keep))); } catch(...) {}
+    }
+    if (env_data && strlen(env_data) > 0) {
+        g_data_dir = string(env_data);
+    }
+    if (env_idem_ttl && strlen(env_idem_ttl) > 0) {
+        try { g_idempotency_ttl = max(1, stoi(string(env_idem_ttl))); } catch(...) {}
+    }
+    if (env_rate_limit && (string(env_rate_limit) == "off" || string(env_rate_limit) == "0")) {
+        g_rate_limit_enabled.store(false);
+    }
+    if (env_rate_scale && strlen(env_rate_scale) > 0) {
+        try { scaleRatePolicies(max(0.01, stod(string(env_rate_scale)))); } catch(...) {}
+    }
+    g_trust_proxy = env_trust_proxy && (string(env_trust_proxy) == "1" || string(env_trust_proxy) == "true");
+    if (env_header_timeout && strlen(env_header_timeout) > 0) {
+        try { g_header_timeout_ms = max(100, stoi(string(env_header_timeout))); } catch(...) {}
+    }
+    if (env_body_timeout && strlen(env_body_timeout) > 0) {
+        try { g_body_timeout_ms = max(100, stoi(string(env_body_timeout))); } catch(...) {}
+    }
+    if (env_write_timeout && strlen(env_write_timeout) > 0) {
+        try { g_write_timeout_ms = max(100, stoi(string(env_write_timeout))); } catch(...) {}
+    }
+    if (const char *env_storage = getenv("STORAGE")) {
+        if (*env_storage) g_storage_kind = env_storage;
+    }
+    if (const char *env_refresh = getenv("DB_REFRESH_SEC")) {
+        try { g_refresh_interval_sec = max(1, stoi(string(env_refresh))); } catch(...) {}
+    }
+    if (const char *env_body_max = getenv("BODY_MAX_KB")) {
+        try { g_body_max_bytes = (size_t)max(1, stoi(string(env_body_max))) << 10; } catch(...) {}
+    }
+    if (const char *env_upload_max = getenv("UPLOAD_MAX_MB")) {
+        try { g_upload_max_bytes = (size_t)max(1, stoi(string(env_upload_max))) << 20; } catch(...) {}
+    }
+    if (const char *env_drain = getenv("DRAIN_TIMEOUT_SEC")) {
+        try { g_drain_timeout_sec = max(0, stoi(string(env_drain))); } catch(...) {}
+    }
+    if (const char *env_upgrade = getenv("UPGRADE_TIMEOUT_SEC")) {
+        try { g_upgrade_timeout_sec = max(1, stoi(string(env_upgrade))); } catch(...) {}
+    }
+    if (const char *env_snapshot = getenv("SNAPSHOT")) {
+        g_snapshot_enabled = !(string(env_snapshot) == "off" || string(env_snapshot) == "0");
+    }
+    if (const char *env_label_cache = getenv("LABEL_CACHE_SIZE")) {
+        try { g_label_cache_size = (size_t)max(0, stoi(string(env_label_cache))); } catch(...) {}
+    }
+    if (const char *env_import_batch = getenv("IMPORT_BATCH_ROWS")) {
+        try { g_import_batch_rows = (size_t)max(1, stoi(string(env_import_batch))); } catch(...) {}
+    }
+    if (const char *env_backup_dir = getenv("BACKUP_DIR")) g_backup_dir = env_backup_dir;
+    if (const char *env_backup_interval = getenv("BACKUP_INTERVAL_SEC")) {
+        try { g_backup_interval_sec = max(0, stoi(string(env_backup_interval))); } catch(...) {}
+    }
+    if (const char *env_backup_keep = getenv("BACKUP_KEEP")) {
+        try { g_backup_keep = max(1, stoi(string(env_backup_keep))); } catch(...) {}
+    }
+    if (const char *env_backup_pages = getenv("BACKUP_STEP_PAGES")) {
+        try { g_backup_step_pages = max(1, stoi(string(env_backup_pages))); } catch(...) {}
+    }
+    if (const char *env_backup_pause = getenv("BACKUP_STEP_PAUSE_MS")) {
+        try { g_backup_step_pause_ms = max(0, stoi(string(env_backup_pause))); } catch(...) {}
+    }
+    if (const char *env_admin_auth = getenv("ADMIN_AUTH")) g_admin_auth_enabled = strcmp(env_admin_auth, "off") != 0;
+    if (const char *env_admin_user = getenv("ADMIN_USER")) g_admin_user = env_admin_user;
+    if (const char *env_admin_password = getenv("ADMIN_PASSWORD")) g_admin_password = env_admin_password;
+    if (const char *env_session_ttl = getenv("ADMIN_SESSION_TTL_SEC")) {
+        try { g_admin_session_ttl_sec = max(60, stoi(string(env_session_ttl))); } catch(...) {}
+    }
+
+    // declared before the pool so workers can log until they have joined
+    LogWriter logWriter;
+    if (g_access_log_enabled.load() && importPath.empty()) logWriter.openAccessLog(ensureDataFolder("access.log"));
+    logWriter.start();
 
-    if (env_data && strlen(env_data) > 0) {  
-        g_data_dir = string(env_data);  
-    }  
     if (env_workers && strlen(env_workers) > 0) {  
         try { g_max_workers = stoi(string(env_workers)); } catch(...) { g_max_workers = 4; }  
     } else {  
@@ -1181,11 +6632,21 @@ int main() {
         LOGE("Could not initialize database - exiting");  
         return 1;  
     }  
+    if (!importPath.empty()) {
+        int status = runImport(importPath);
+        closeDatabase();
+        return status;
+    }
+    loadSessionSecret();
+    if (g_admin_password == "1234") LOGW("Using the default admin password; set ADMIN_PASSWORD");
 
-    migrateTextFilesIfNeeded();  
+    if (!loadStartupSnapshot()) {
+        migrateTextFilesIfNeeded();  
 
-    loadProducts();  
-    loadOrders();  
+        loadProducts();  
+        loadOrders();  
+    }
+    loadIdempotencyKeys();
 
     signal(SIGPIPE, SIG_IGN);  
 
@@ -1195,58 +6656,89 @@ int main() {
     sa.sa_flags = 0;  
     sigaction(SIGINT, &sa, nullptr);  
     sigaction(SIGTERM, &sa, nullptr);  
+    if (pipe2(g_wake_pipe, O_CLOEXEC | O_NONBLOCK) != 0) perror("pipe2");
+    struct sigaction upgrade{};
+    upgrade.sa_handler = upgradeSignal;
+    sigemptyset(&upgrade.sa_mask);
+    sigaction(SIGUSR2, &upgrade, nullptr);
 
-    ThreadPool pool(max(1, g_max_workers));  
-    g_threadpool_ptr = &pool;  
-
-    int server_fd;  
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {  
-        perror("socket failed");  
-        if (g_db) sqlite3_close(g_db);  
-        return 1;  
-    }  
-    g_server_fd = server_fd;  
-
-    int opt = 1;  
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {  
-        perror("setsockopt SO_REUSEADDR failed");  
+    // keeps running until static destruction, after the pool has joined
+    g_timer_wheel.start();
+    g_order_stream.start();
+    if (g_storage->canBackup()) g_backups.start();
+    // replicas sharing a database pick up each other's writes
+    thread refresher;
+    if (g_storage->shared()) {
+        refresher = thread([]{
+            while (g_running.load()) {
+                for (int i = 0; i < g_refresh_interval_sec * 10 && g_running.load(); ++i) {
+                    this_thread::sleep_for(chrono::milliseconds(100));
+                }
+                if (g_running.load()) refreshFromStorage();
+            }
+        });
     }
-
-#ifdef SO_REUSEPORT
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt SO_REUSEPORT failed (non-fatal)");
+    // image work gets its own threads so resizing can't occupy API workers
+    int imageWorkers = 1;
+    if (const char *env_image_workers = getenv("IMAGE_WORKERS")) {
+        try { imageWorkers = max(1, stoi(string(env_image_workers))); } catch(...) {}
     }
-#endif
-
-    struct sockaddr_in address{};  
-    address.sin_family = AF_INET;  
-    address.sin_addr.s_addr = INADDR_ANY;  
+    ThreadPool imagePool(imageWorkers);
+    g_image_pool = &imagePool;
+    ThreadPool pool(max(1, g_max_workers));  
+    g_threadpool_ptr = &pool;  
 
     int port = 8080;  
     if (envp_port) {  
         try { port = stoi(string(envp_port)); } catch(...) { port = 8080; }  
     }  
-    address.sin_port = htons(port);  
-
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {  
-        perror("bind failed");  
-        if (g_db) sqlite3_close(g_db);  
-        return 1;  
-    }  
-
-    if (listen(server_fd, 128) < 0) {  
-        perror("listen");  
-        if (g_db) sqlite3_close(g_db);  
+    int server_fd = handoffChannel >= 0 ? takeOverListener(handoffChannel, port) : openListener(port);
+    if (server_fd < 0) {
+        g_running.store(false);
+        if (refresher.joinable()) refresher.join();
+        g_backups.stop();
+        closeDatabase();
         return 1;  
     }  
 
     LOGI(string("🚀 Server running on http://0.0.0.0:") +
          to_string(port) +
          " (workers=" + to_string(g_max_workers) +
-         ", data_dir=" + g_data_dir + ")");  
+         ", data_dir=" + g_data_dir + ", escape=" + g_escape.name + ")");  
+
+    // Hot restart: the successor starts on its own thread so accepting carries on
+    enum { UPGRADE_IDLE, UPGRADE_STARTING, UPGRADE_READY };
+    atomic<int> upgradeState(UPGRADE_IDLE);
+    unique_ptr<Successor> successor;
+    thread upgrader;
 
     // ================= ACCEPT LOOP (robust version) =================
 while (g_running.load()) {
+    struct pollfd waitFds[2] = { { server_fd, POLLIN, 0 }, { g_wake_pipe[0], POLLIN, 0 } };
+    if (poll(waitFds, g_wake_pipe[0] >= 0 ? 2 : 1, -1) < 0) {
+        if (errno == EINTR) continue;
+        perror("poll");
+        this_thread::sleep_for(chrono::milliseconds(50));
+        continue;
+    }
+    if (waitFds[1].revents & POLLIN) {
+        char junk[64];
+        while (read(g_wake_pipe[0], junk, sizeof(junk)) > 0) {}
+        if (g_upgrade_requested.exchange(false) && upgradeState.load() == UPGRADE_IDLE) {
+            if (upgrader.joinable()) upgrader.join(); // an earlier attempt that failed
+            successor.reset(new Successor());
+            upgradeState.store(UPGRADE_STARTING);
+            upgrader = thread([&upgradeState, s = successor.get()]{
+                bool ready = s->spawn() && s->waitReady();
+                upgradeState.store(ready ? UPGRADE_READY : UPGRADE_IDLE);
+                wakeAcceptLoop();
+            });
+        }
+        if (upgradeState.load() == UPGRADE_READY) break;
+        continue;
+    }
+    if (!(waitFds[0].revents & POLLIN)) continue;
+
     struct sockaddr_in clientAddr{};
     socklen_t clientLen = sizeof(clientAddr);
 
@@ -1267,34 +6759,48 @@ while (g_running.load()) {
     char client_ip[INET_ADDRSTRLEN] = {0};
     inet_ntop(AF_INET, &clientAddr.sin_addr, client_ip, sizeof(client_ip));
     string cli = string(client_ip) + ":" + to_string(ntohs(clientAddr.sin_port));
-    LOGI("Accepted connection from " + cli);
+    LOGD("Accepted connection from " + cli);
 
+    g_open_connections.fetch_add(1, memory_order_relaxed);
     try {
-        pool.enqueue([clientSock]() {
-            handleClient(clientSock);
+        pool.enqueue([clientSock, ip = string(client_ip)]() {
+            handleClient(clientSock, ip);
         });
     } catch (const std::exception &ex) {
         LOGE("Failed to enqueue client handler: " + string(ex.what()));
+        g_open_connections.fetch_sub(1, memory_order_relaxed);
         close(clientSock);
     }
 }
 
 // ================= SHUTDOWN =================
-// ================= SHUTDOWN =================
-LOGI("Server shutting down...");
-
-// Close listening socket if not already closed
-if (g_server_fd >= 0) {
-    close(g_server_fd);
-    g_server_fd = -1;
+if (int signo = g_shutdown_signal.load()) LOGI("Received signal " + to_string(signo) + " - initiating graceful shutdown");
+bool handedOff = false;
+if (upgradeState.load() == UPGRADE_READY) {
+    handedOff = sendListener(successor->channel(), server_fd);
+    if (handedOff) LOGI("Hot restart: listening socket handed to the successor; draining");
+    else LOGE(string("Hot restart: could not pass the listening socket: ") + strerror(errno));
+} else {
+    LOGI("Server shutting down...");
+    if (successor) successor->cancel();
 }
+if (upgrader.joinable()) upgrader.join();
+g_running.store(false);
 
-// Optional: close DB
-if (g_db) {
-    sqlite3_close(g_db);
-    g_db = nullptr;
-}
+// Stop accepting; the successor (if any) holds its own reference to the socket
+close(server_fd);
+
+g_order_stream.stop(); // EventSource clients reconnect to whoever holds the listener
+bool drained = drainConnections(g_drain_timeout_sec);
+if (handedOff) sendHandoffByte(successor->channel(), HANDOFF_DRAINED);
+// not after a handoff (the successor already runs from the database) or while
+// a straggler might still write
+else if (drained) writeStartupSnapshot();
+
+if (refresher.joinable()) refresher.join();
+g_backups.stop();
 
 LOGI("Server exited cleanly");
 return 0;
 }
+#endif // ONLINETRADERZ_NO_MAIN